@@ -0,0 +1,478 @@
+#include "smtp_benchmark.h"
+
+#include "utils/smtp/smtp_allocations.h"
+#include "tests/smtp/smtp_server.h"
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QDateTime>
+#include <QSysInfo>
+#include <QStringBuilder>
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Max size of the messages sent as a text body
+constexpr int pn_maxTextSize = 64 * 1024;
+
+// Gets the given bytes as a readable size
+QString pn_sizeName(int bytes)
+{
+    if (bytes >= 1024 * 1024 && bytes % (1024 * 1024) == 0)
+        return QString::number(bytes / (1024 * 1024)) + "MB";
+    if (bytes >= 1024 && bytes % 1024 == 0)
+        return QString::number(bytes / 1024) + "KB";
+    return QString::number(bytes) + "B";
+}
+// Gets the connection type name
+const char* pn_connectionName(Client::ConnectionType type)
+{
+    switch (type) {
+    case Client::TcpConnection: return "tcp";
+    case Client::SslConnection: return "ssl";
+    case Client::TlsConnection: return "starttls";
+    default: return "unknown";
+    }
+}
+// Gets the authentication method name
+const char* pn_authName(Client::AuthMethod method)
+{
+    switch (method) {
+    case Client::AuthPlain: return "plain";
+    case Client::AuthLogin: return "login";
+    case Client::AuthCramMd5: return "cram-md5";
+    default: return "none";
+    }
+}
+
+// Builds a text of the given size, repeating the given sample
+// \note The text is cut at a sample boundary and padded with spaces, so utf8 sequences stay valid
+QByteArray pn_repeatedSample(const QByteArray &sample, int size)
+{
+    QByteArray text;
+    text.reserve(size);
+    while (text.size() + sample.size() <= size)
+        text += sample;
+    text += QByteArray(size - text.size(), ' ');
+    return text;
+}
+// Builds pseudo-random binary data of the given size (deterministic, xorshift)
+QByteArray pn_binaryData(int size)
+{
+    QByteArray data (qMax(size, 0), Qt::Uninitialized);
+    quint32 state = 0x9E3779B9u;
+    for (int ix = 0; ix < size; ++ix) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[ix] = char(state);
+    }
+    return data;
+}
+// Builds the message of the scenario
+MimeMessage pn_buildMessage(const ClientBenchmark::Scenario &scenario)
+{
+    MimeMessage msg;
+    msg.setSenderAddress(EmailAddress("bench@example.com", "Benchmark"));
+    for (int ix = 0; ix < scenario.recipients; ++ix)
+        msg.addToRecipient(EmailAddress(QString("rcpt%1@example.com").arg(ix)));
+    msg.setMessageSubject("Benchmark " + scenario.name());
+    // small payloads as text body, big ones as attachment
+    if (scenario.messageSize <= pn_maxTextSize) {
+        msg.setMessageBodyText(EncoderBenchmark::corpus(EncoderBenchmark::AsciiProse, scenario.messageSize));
+    } else {
+        msg.setMessageBodyText("See the attachment.");
+        msg.addMimePart(new MimeAttachmentFile(pn_binaryData(scenario.messageSize), "payload.bin"));
+    }
+    // encode the body once, as a real sender would do for a queued message
+    msg.releaseMessageBodySource();
+    return msg;
+}
+
+// Gets the given result as a JSON object
+QJsonObject pn_resultObject(const ClientBenchmark::Result &result)
+{
+    const auto &scenario = result.scenario;
+    QJsonObject latency {
+        { "min_us", result.minUsecs },
+        { "mean_us", result.meanUsecs },
+        { "max_us", result.maxUsecs },
+        { "p50_us", result.p50Usecs },
+        { "p99_us", result.p99Usecs },
+        { "p999_us", result.p999Usecs }
+    };
+    return QJsonObject {
+        { "name", scenario.name() },
+        { "message_size", scenario.messageSize },
+        { "recipients", scenario.recipients },
+        { "connection", pn_connectionName(scenario.connection) },
+        { "auth", pn_authName(scenario.auth) },
+        { "server_latency_ms", scenario.serverLatency },
+        { "messages", scenario.messages },
+        { "sent", result.sent },
+        { "failed", result.failed },
+        { "connect_us", result.connectUsecs },
+        { "elapsed_us", result.elapsedUsecs },
+        { "messages_per_second", result.messagesPerSecond },
+        { "megabytes_per_second", result.megabytesPerSecond },
+        { "latency", latency },
+        { "allocations_per_message", result.allocationsPerMessage },
+        { "bytes_allocated_per_message", result.bytesAllocatedPerMessage },
+        { "peak_live_bytes", result.peakLiveBytes }
+    };
+}
+
+// Gets the run environment as a JSON object
+QJsonObject pn_environmentObject()
+{
+    return QJsonObject {
+        { "qt_version", qVersion() },
+        { "os", QSysInfo::prettyProductName() },
+        { "cpu_architecture", QSysInfo::currentCpuArchitecture() },
+        { "kernel", QSysInfo::kernelType() % ' ' % QSysInfo::kernelVersion() },
+        { "timestamp", QDateTime::currentDateTimeUtc().toString(Qt::ISODate) }
+    };
+}
+
+// Gets the encoder name
+const char* pn_encoderName(EncoderBenchmark::Encoder encoder)
+{
+    switch (encoder) {
+    case EncoderBenchmark::QuotedPrintable: return "encodeQuotedPrintable";
+    case EncoderBenchmark::QuotedPrintableLines: return "formatQuotedPrintableIntoLines";
+    case EncoderBenchmark::DataLines: return "formatDataIntoLines";
+    case EncoderBenchmark::MimeWordQ: return "encodeMimeWordQ";
+    case EncoderBenchmark::MimeWordB: return "encodeMimeWordB";
+    case EncoderBenchmark::EmailAddresses: return "encodeEmailAddresses";
+    }
+    return "unknown";
+}
+// Gets the corpus name
+const char* pn_corpusName(EncoderBenchmark::Corpus corpus)
+{
+    switch (corpus) {
+    case EncoderBenchmark::AsciiProse: return "ascii_prose";
+    case EncoderBenchmark::AccentedText: return "accented_text";
+    case EncoderBenchmark::CjkText: return "cjk_text";
+    case EncoderBenchmark::HtmlMarkup: return "html_markup";
+    case EncoderBenchmark::BinaryPdf: return "binary_pdf";
+    }
+    return "unknown";
+}
+
+// Encoder input, prepared out of the measured loop
+struct pn_EncoderInput
+{
+    QByteArray data; // raw, quoted-printable or base64 data
+    QString text; // header text
+    EmailAddresses addresses;
+};
+// Prepares the input of the given encoder
+pn_EncoderInput pn_encoderInput(EncoderBenchmark::Encoder encoder, const QByteArray &corpus)
+{
+    pn_EncoderInput input;
+    switch (encoder) {
+    case EncoderBenchmark::QuotedPrintable:
+        input.data = corpus;
+        break;
+    case EncoderBenchmark::QuotedPrintableLines:
+        input.data = MimeUtils::encodeQuotedPrintable(corpus);
+        break;
+    case EncoderBenchmark::DataLines:
+        input.data = corpus.toBase64();
+        break;
+    case EncoderBenchmark::MimeWordQ:
+    case EncoderBenchmark::MimeWordB:
+        input.text = QString::fromUtf8(corpus);
+        break;
+    case EncoderBenchmark::EmailAddresses: {
+        // owner names taken from the corpus, up to 32 bytes each (cut at character boundaries)
+        for (int ix = 0, count = 0; ix < corpus.size(); ++count) {
+            int end = qMin(ix + 32, corpus.size());
+            while (end < corpus.size() && (quint8(corpus.at(end)) & 0xC0) == 0x80)
+                --end;
+            input.addresses.append(EmailAddress(QString("user%1@example.com").arg(count),
+                QString::fromUtf8(corpus.constData() + ix, end - ix)));
+            ix = end;
+        }
+        break;
+    }
+    }
+    return input;
+}
+// Runs the given encoder once, returning the output size
+int pn_runEncoder(EncoderBenchmark::Encoder encoder, const pn_EncoderInput &input)
+{
+    switch (encoder) {
+    case EncoderBenchmark::QuotedPrintable:
+        return MimeUtils::encodeQuotedPrintable(input.data).size();
+    case EncoderBenchmark::QuotedPrintableLines:
+        return MimeUtils::formatQuotedPrintableIntoLines(input.data).size();
+    case EncoderBenchmark::DataLines:
+        return MimeUtils::formatDataIntoLines(input.data).size();
+    case EncoderBenchmark::MimeWordQ:
+        return MimeUtils::encodeMimeWordQ(input.text).size();
+    case EncoderBenchmark::MimeWordB:
+        return MimeUtils::encodeMimeWordB(input.text).size();
+    case EncoderBenchmark::EmailAddresses:
+        return MimeUtils::encodeEmailAddresses(input.addresses).size();
+    }
+    return 0;
+}
+
+// Gets the given encoder result as a JSON object
+QJsonObject pn_encoderResultObject(const EncoderBenchmark::Result &result)
+{
+    return QJsonObject {
+        { "encoder", pn_encoderName(result.encoder) },
+        { "corpus", pn_corpusName(result.corpus) },
+        { "input_bytes", result.inputBytes },
+        { "output_bytes", result.outputBytes },
+        { "iterations", result.iterations },
+        { "ns_per_call", result.nsecsPerCall },
+        { "bytes_per_second", result.bytesPerSecond },
+        { "expansion_ratio", result.expansionRatio },
+        { "allocations_per_call", result.allocationsPerCall }
+    };
+}
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+// ClientBenchmark::Scenario
+
+QString ClientBenchmark::Scenario::name() const
+{
+    return pn_sizeName(messageSize) % '/' % QString::number(recipients) % "rcpt/"
+        % pn_connectionName(connection) % '/' % pn_authName(auth) % '/'
+        % QString::number(serverLatency) % "ms";
+}
+
+
+
+// ClientBenchmark
+
+QList<ClientBenchmark::Scenario> ClientBenchmark::scenarios(const Matrix &matrix)
+{
+    QList<Scenario> all;
+    for (int size : matrix.messageSizes) {
+        // bound the amount of messages by the payload
+        const qint64 bySize = matrix.scenarioBytes / qMax(size, 1);
+        const int messages = int(qMax<qint64>(matrix.minMessages, qMin<qint64>(matrix.messages, bySize)));
+        for (int recipients : matrix.recipients)
+            for (auto connection : matrix.connections) {
+                // TLS connections need a server identity
+                if ((connection == Client::SslConnection || connection == Client::TlsConnection)
+                    && matrix.tlsCertificateFile.isEmpty())
+                    continue;
+                for (auto auth : matrix.authMethods)
+                    for (int latency : matrix.serverLatencies) {
+                        Scenario scenario;
+                        scenario.messageSize = size;
+                        scenario.recipients = recipients;
+                        scenario.connection = connection;
+                        scenario.auth = auth;
+                        scenario.serverLatency = latency;
+                        scenario.messages = messages;
+                        scenario.tlsCertificateFile = matrix.tlsCertificateFile;
+                        scenario.tlsKeyFile = matrix.tlsKeyFile;
+                        all.append(scenario);
+                    }
+            }
+    }
+    return all;
+}
+
+ClientBenchmark::Result ClientBenchmark::run(const Scenario &scenario)
+{
+    Result result;
+    result.scenario = scenario;
+    // server setup
+    ScriptedServer server;
+    if ((scenario.connection == Client::SslConnection || scenario.connection == Client::TlsConnection)
+        && !server.loadTlsIdentity(scenario.tlsCertificateFile, scenario.tlsKeyFile))
+        return result;
+    server.setImplicitTls(scenario.connection == Client::SslConnection);
+    server.setMaxMessageSize(0);
+    if (scenario.serverLatency > 0)
+        server.setCommandLatency("*", scenario.serverLatency);
+    if (!server.start())
+        return result;
+    // client setup, trusting the server whatever its identity
+    Client client;
+    client.setServerHost("localhost");
+    client.setServerPort(server.port());
+    client.setConnectionType(scenario.connection, QSslSocket::VerifyNone, true);
+    if (scenario.auth != Client::AuthNone) {
+        client.setAccountUser("user");
+        client.setAccountPassword("password");
+    }
+    client.setAuthMethod(scenario.auth);
+    const MimeMessage msg = pn_buildMessage(scenario);
+    msg.encodedHeaders();
+    // connect
+    QElapsedTimer timer;
+    timer.start();
+    if (!client.connectToServer())
+        return result;
+    result.connectUsecs = timer.nsecsElapsed() / 1000;
+    // send, stopping on the first failure
+    LatencyHistogram latencies;
+    QElapsedTimer messageTimer;
+    AllocationScope allocations;
+    timer.restart();
+    for (int ix = 0; ix < scenario.messages; ++ix) {
+        messageTimer.start();
+        if (!client.sendMessage(msg)) {
+            ++result.failed;
+            break;
+        }
+        latencies.recordNsecs(messageTimer.nsecsElapsed());
+        ++result.sent;
+    }
+    result.elapsedUsecs = timer.nsecsElapsed() / 1000;
+    const AllocationStats allocationStats = allocations.stats();
+    client.closeConnection();
+    // results
+    if (result.elapsedUsecs > 0) {
+        const double seconds = double(result.elapsedUsecs) / 1000000.0;
+        result.messagesPerSecond = double(result.sent) / seconds;
+        result.megabytesPerSecond = double(result.sent) * double(scenario.messageSize)
+            / (1024.0 * 1024.0) / seconds;
+    }
+    result.minUsecs = latencies.min();
+    result.meanUsecs = qint64(latencies.mean());
+    result.maxUsecs = latencies.max();
+    result.p50Usecs = latencies.percentile(50.0);
+    result.p99Usecs = latencies.percentile(99.0);
+    result.p999Usecs = latencies.percentile(99.9);
+    if (AllocationScope::isAvailable() && result.sent > 0) {
+        result.allocationsPerMessage = double(allocationStats.allocations) / double(result.sent);
+        result.bytesAllocatedPerMessage = double(allocationStats.bytesAllocated) / double(result.sent);
+        result.peakLiveBytes = allocationStats.peakLiveBytes;
+    }
+    return result;
+}
+
+QList<ClientBenchmark::Result> ClientBenchmark::run(const QList<Scenario> &scenarios)
+{
+    QList<Result> results;
+    results.reserve(scenarios.size());
+    for (const auto &scenario : scenarios)
+        results.append(run(scenario));
+    return results;
+}
+
+QByteArray ClientBenchmark::toJson(const QList<Result> &results)
+{
+    QJsonArray scenarios;
+    for (const auto &result : results)
+        scenarios.append(pn_resultObject(result));
+    const QJsonObject root {
+        { "benchmark", "smtp_client" },
+        { "environment", pn_environmentObject() },
+        { "scenarios", scenarios }
+    };
+    return QJsonDocument(root).toJson(QJsonDocument::Indented);
+}
+
+
+
+// EncoderBenchmark
+
+QByteArray EncoderBenchmark::corpus(Corpus corpus, int size)
+{
+    switch (corpus) {
+    case AsciiProse:
+        return pn_repeatedSample(QByteArrayLiteral(
+            "The quick brown fox jumps over the lazy dog, while the benchmark keeps counting bytes.\r\n"), size);
+    case AccentedText:
+        return pn_repeatedSample(QByteArrayLiteral(
+            "Le cœur déçu mais l'âme plutôt naïve, Louÿs rêva de crapaüter en canoë au-delà des îles. "
+            "Falsches Üben von Xylophonmusik quält jeden größeren Zwerg. "
+            "El pingüino Wenceslao hizo kilómetros bajo exhaustiva lluvia y frío.\r\n"), size);
+    case CjkText:
+        return pn_repeatedSample(QByteArrayLiteral(
+            "いろはにほへと ちりぬるを わかよたれそ つねならむ。"
+            "我能吞下玻璃而不伤身体。키스의 고유조건은 입술끼리 만나야 하고 특별한 기술은 필요치 않다。\r\n"), size);
+    case HtmlMarkup:
+        return pn_repeatedSample(QByteArrayLiteral(
+            "<div class=\"content\"><p style=\"margin:0 0 1em 0;font-family:Arial\">Hello <b>World</b> "
+            "&amp; friends, see <a href=\"https://example.com/offers?id=42&amp;ref=mail\">the offer</a>"
+            "</p></div>\r\n"), size);
+    case BinaryPdf: {
+        // pdf header and a compressed-like stream
+        QByteArray pdf = QByteArrayLiteral("%PDF-1.7\n%\xE2\xE3\xCF\xD3\n1 0 obj\n<< /Length 0 /Filter /FlateDecode >>\nstream\n");
+        pdf += pn_binaryData(size - pdf.size());
+        return pdf.left(size);
+    }
+    }
+    return QByteArray();
+}
+
+EncoderBenchmark::Result EncoderBenchmark::run(Encoder encoder, Corpus corpus, int inputSize, int minMsecs)
+{
+    Result result;
+    result.encoder = encoder;
+    result.corpus = corpus;
+    result.inputBytes = inputSize;
+    // prepare the input, out of the measured loop
+    const pn_EncoderInput input = pn_encoderInput(encoder, EncoderBenchmark::corpus(corpus, inputSize));
+    // first call out of the measured loop, so that one-time initializations are not counted
+    result.outputBytes = pn_runEncoder(encoder, input);
+    // measure batches of growing size, until the min time is reached, counting the allocations
+    //     whether available
+    AllocationScope allocations;
+    QElapsedTimer timer;
+    qint64 elapsed = 0;
+    qint64 outputSink = 0;
+    for (qint64 batch = 1; elapsed < qint64(minMsecs) * 1000000; batch *= 2) {
+        timer.start();
+        for (qint64 ix = 0; ix < batch; ++ix)
+            outputSink += pn_runEncoder(encoder, input);
+        elapsed += timer.nsecsElapsed();
+        result.iterations += batch;
+    }
+    Q_ASSERT(outputSink == result.outputBytes * result.iterations);
+    Q_UNUSED(outputSink)
+    // results
+    if (AllocationScope::isAvailable())
+        result.allocationsPerCall = double(allocations.stats().allocations) / double(result.iterations);
+    result.nsecsPerCall = double(elapsed) / double(result.iterations);
+    result.bytesPerSecond = double(inputSize) * 1000000000.0 / qMax(result.nsecsPerCall, 1.0);
+    result.expansionRatio = double(result.outputBytes) / double(qMax(inputSize, 1));
+    return result;
+}
+
+QList<EncoderBenchmark::Result> EncoderBenchmark::runAll(int bodySize, int headerSize, int minMsecs)
+{
+    static const Corpus corpora[] = { AsciiProse, AccentedText, CjkText, HtmlMarkup, BinaryPdf };
+    static const Encoder encoders[] = {
+        QuotedPrintable, QuotedPrintableLines, DataLines, MimeWordQ, MimeWordB, EmailAddresses };
+    QList<Result> results;
+    for (auto encoder : encoders) {
+        // header encoders run over header-like sizes
+        const bool isHeaderEncoder = (encoder == MimeWordQ || encoder == MimeWordB || encoder == EmailAddresses);
+        for (auto corpus : corpora)
+            results.append(run(encoder, corpus, isHeaderEncoder? headerSize : bodySize, minMsecs));
+    }
+    return results;
+}
+
+QByteArray EncoderBenchmark::toJson(const QList<Result> &results)
+{
+    QJsonArray encoders;
+    for (const auto &result : results)
+        encoders.append(pn_encoderResultObject(result));
+    const QJsonObject root {
+        { "benchmark", "mime_encoders" },
+        { "environment", pn_environmentObject() },
+        { "results", encoders }
+    };
+    return QJsonDocument(root).toJson(QJsonDocument::Indented);
+}
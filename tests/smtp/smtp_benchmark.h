@@ -0,0 +1,141 @@
+#ifndef SMTP_BENCHMARK_H
+#define SMTP_BENCHMARK_H
+
+#include <QList>
+#include <QString>
+#include "utils/smtp/smtp_client.h"
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// End-to-End Client Benchmark, driving Smtp::Client against a local Smtp::ScriptedServer
+/// \note Each scenario opens a single session, then sends its messages one after the other,
+///     measuring the latency of each `sendMessage()` call
+/// \note Results are emitted as JSON, so that runs of different releases can be compared
+/// \warning Scenarios are run on the calling thread and block it until they are done
+class ClientBenchmark
+{
+// public definitions
+public:
+    /// Single Benchmark Scenario
+    struct Scenario
+    {
+        int messageSize = 1024; ///< payload bytes, sent as a text body up to 64KB and as an attachment beyond
+        int recipients = 1; ///< amount of "To" recipients
+        Client::ConnectionType connection = Client::TcpConnection;
+        Client::AuthMethod auth = Client::AuthNone;
+        int serverLatency = 0; ///< msecs the server waits before each reply, emulating the round trip
+        int messages = 100; ///< amount of messages sent
+        QString tlsCertificateFile; ///< PEM certificate of the server, required by TLS connections
+        QString tlsKeyFile; ///< PEM private key of the server, required by TLS connections
+
+        /// Gets a readable name of the scenario (e.g. "1KB/1rcpt/tcp/none/0ms")
+        QString name() const;
+    };
+    /// Scenario Matrix, each scenario being a combination of the given values
+    struct Matrix
+    {
+        QList<int> messageSizes { 1024, 64 * 1024, 1024 * 1024, 10 * 1024 * 1024, 50 * 1024 * 1024 };
+        QList<int> recipients { 1, 10, 100 };
+        QList<Client::ConnectionType> connections { Client::TcpConnection, Client::SslConnection, Client::TlsConnection };
+        QList<Client::AuthMethod> authMethods { Client::AuthNone, Client::AuthPlain, Client::AuthCramMd5 };
+        QList<int> serverLatencies { 0, 20 };
+        int messages = 100; ///< max amount of messages per scenario
+        qint64 scenarioBytes = 256 * 1024 * 1024; ///< max payload per scenario, bounding the messages of big sizes
+        int minMessages = 3; ///< min amount of messages per scenario, whatever the payload
+        QString tlsCertificateFile; ///< PEM certificate of the server, TLS connections skipped whether empty
+        QString tlsKeyFile; ///< PEM private key of the server
+    };
+    /// Scenario Result
+    struct Result
+    {
+        Scenario scenario;
+        int sent = 0; ///< messages sent successfully
+        int failed = 0; ///< messages failed (the scenario stops on the first failure)
+        qint64 connectUsecs = -1; ///< session setup time, -1 whether it failed
+        qint64 elapsedUsecs = 0; ///< time spent sending the messages
+        double messagesPerSecond = 0.0;
+        double megabytesPerSecond = 0.0; ///< payload throughput, 1MB being 2^20 bytes
+        qint64 minUsecs = 0, meanUsecs = 0, maxUsecs = 0; ///< per message latency
+        qint64 p50Usecs = 0, p99Usecs = 0, p999Usecs = 0; ///< per message latency percentiles
+        double allocationsPerMessage = -1.0; ///< client thread allocations, -1 whether not counted by the build
+        double bytesAllocatedPerMessage = -1.0; ///< client thread allocated bytes, -1 whether not counted
+        qint64 peakLiveBytes = -1; ///< client thread peak over the sending, -1 whether not counted
+    };
+
+// public interface
+public:
+    /// Expands the given matrix into its scenarios
+    static QList<Scenario> scenarios(const Matrix &matrix);
+
+    /// Runs the given scenario
+    static Result run(const Scenario &scenario);
+    /// Runs all the given scenarios, in order
+    static QList<Result> run(const QList<Scenario> &scenarios);
+
+    /// Gets the given results as a JSON document, along with the run environment
+    static QByteArray toJson(const QList<Result> &results);
+};
+
+
+
+/// Micro-Benchmark of the MimeUtils Encoders
+/// \note Each encoder runs over realistic corpora, in batches of growing size until a min time
+///     is spent, reporting the throughput and the output expansion over the raw corpus
+/// \note Line formatters are fed as in the message writer: quoted-printable or base64 data
+class EncoderBenchmark
+{
+// public definitions
+public:
+    /// Benchmarked Encoders
+    enum Encoder
+    {
+        QuotedPrintable, ///< MimeUtils::encodeQuotedPrintable
+        QuotedPrintableLines, ///< MimeUtils::formatQuotedPrintableIntoLines
+        DataLines, ///< MimeUtils::formatDataIntoLines
+        MimeWordQ, ///< MimeUtils::encodeMimeWordQ
+        MimeWordB, ///< MimeUtils::encodeMimeWordB
+        EmailAddresses ///< MimeUtils::encodeEmailAddresses, up to 32 bytes of corpus per owner name
+    };
+    /// Input Corpora
+    enum Corpus
+    {
+        AsciiProse,
+        AccentedText, ///< latin text with european accented letters
+        CjkText, ///< japanese, chinese and korean text
+        HtmlMarkup,
+        BinaryPdf ///< pdf header followed by incompressible data
+    };
+    /// Encoder Result
+    struct Result
+    {
+        Encoder encoder = QuotedPrintable;
+        Corpus corpus = AsciiProse;
+        int inputBytes = 0; ///< raw corpus bytes
+        int outputBytes = 0; ///< encoded bytes
+        qint64 iterations = 0;
+        double nsecsPerCall = 0.0;
+        double bytesPerSecond = 0.0; ///< raw corpus bytes encoded per second
+        double expansionRatio = 0.0; ///< output bytes over raw corpus bytes
+        double allocationsPerCall = -1.0; ///< mean of the measured calls, -1 whether not counted (see SMTP_ALLOCATION_PROFILING)
+    };
+
+// public interface
+public:
+    /// Builds the given corpus, of the given size in bytes
+    static QByteArray corpus(Corpus corpus, int size);
+
+    /// Runs the given encoder over the given corpus for at least the given time
+    static Result run(Encoder encoder, Corpus corpus, int inputSize, int minMsecs = 200);
+    /// Runs all the encoders over all the corpora, header encoders with the header size
+    static QList<Result> runAll(int bodySize = 64 * 1024, int headerSize = 256, int minMsecs = 200);
+
+    /// Gets the given results as a JSON document, along with the run environment
+    static QByteArray toJson(const QList<Result> &results);
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_BENCHMARK_H
@@ -0,0 +1,732 @@
+#include "smtp_server.h"
+
+#include <QTcpServer>
+#include <QSslSocket>
+#include <QThread>
+#include <QTimer>
+#include <QSemaphore>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QHash>
+#include <QDateTime>
+#include <QFile>
+#include <QRandomGenerator>
+#include <QMessageAuthenticationCode>
+#include <QStringBuilder>
+#include <cstring>
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Server Setup, copied by the server thread when started
+struct pn_ServerSetup
+{
+    // Injected Reply
+    struct Injection
+    {
+        QByteArray verb;
+        int occurrence;
+        QByteArray reply;
+    };
+
+    ScriptedServer::Capabilities capabilities = ScriptedServer::AllCapabilities;
+    qint64 maxMessageSize = 32 * 1024 * 1024;
+    QByteArray username = "user";
+    QByteArray password = "password";
+    QSslCertificate certificate; // null whether no TLS identity
+    QSslKey privateKey;
+    bool implicitTls = false;
+    bool keepMessages = false;
+    QHash<QByteArray, int> latencies;
+    QList<Injection> injections;
+};
+
+// Server State, shared by all sessions and the owner
+struct pn_ServerState
+{
+    mutable QMutex mutex;
+    QHash<QByteArray, int> verbCounts; // occurrences of each verb, guarded by the mutex
+    QList<ScriptedServer::ReceivedMessage> messages; // guarded by the mutex
+    QAtomicInt acceptedMessages;
+    QAtomicInt receivedCommands;
+};
+
+// Session Input Modes
+enum pn_InputMode
+{
+    CommandInput,
+    DataInput,
+    BdatInput,
+    AuthPlainInput,
+    AuthLoginUserInput,
+    AuthLoginPasswordInput,
+    AuthCramMd5Input
+};
+
+// Scripted SMTP Session, serving a single connection
+class pn_Session : public QObject
+{
+public:
+    // Ctor, taking the ownership of the socket
+    pn_Session(QSslSocket *socket, const pn_ServerSetup &setup, pn_ServerState &state, QObject *parent)
+        : QObject(parent), d_socket(socket), d_setup(setup), d_state(state)
+    {
+        d_socket->setParent(this);
+        connect(d_socket, &QSslSocket::readyRead, this, &pn_Session::onReadyRead);
+        connect(d_socket, &QSslSocket::disconnected, this, &pn_Session::deleteLater);
+        // implicit TLS, writes are buffered until the handshake completes
+        if (d_setup.implicitTls)
+            startEncryption();
+        // greeting
+        reply("CONNECT", QByteArrayLiteral("220 localhost ESMTP ScriptedServer ready"));
+    }
+
+private:
+    // Reads the available data and processes it
+    void onReadyRead()
+    {
+        d_input += d_socket->readAll();
+        process();
+    }
+    // Processes the received input, until more data is needed or a delayed reply is pending
+    void process()
+    {
+        while (!d_replyPending && d_socket->state() == QAbstractSocket::ConnectedState) {
+            if (!processStep())
+                break;
+        }
+        // drop the consumed input
+        if (d_inputOffset > 0) {
+            d_input.remove(0, d_inputOffset);
+            d_inputOffset = 0;
+        }
+    }
+    // Processes the next input step, returning false whether more data is needed
+    bool processStep()
+    {
+        const char *begin = d_input.constData() + d_inputOffset;
+        const int available = d_input.size() - d_inputOffset;
+        // chunks are binary, taken as they are
+        if (d_mode == BdatInput) {
+            const int toTake = int(qMin<qint64>(available, d_bdatRemaining));
+            appendData(begin, toTake);
+            d_inputOffset += toTake;
+            d_bdatRemaining -= toTake;
+            if (d_bdatRemaining > 0)
+                return false;
+            d_mode = CommandInput;
+            if (d_bdatLast)
+                finishMessage();
+            else
+                reply("BDAT", status(250, "2.0.0", "Chunk accepted"));
+            return true;
+        }
+        // everything else is line based
+        const auto *lineFeed = static_cast<const char*>(std::memchr(begin, '\n', size_t(available)));
+        if (lineFeed == nullptr)
+            return false;
+        const int lineSize = int(lineFeed - begin) + 1;
+        d_inputOffset += lineSize;
+        // message data, removing the dot-stuffing
+        if (d_mode == DataInput) {
+            const int contentSize = lineSize - ((lineSize >= 2 && lineFeed[-1] == '\r')? 2 : 1);
+            if (contentSize == 1 && begin[0] == '.') {
+                d_mode = CommandInput;
+                finishMessage();
+            } else if (begin[0] == '.') {
+                appendData(begin + 1, lineSize - 1);
+            } else {
+                appendData(begin, lineSize);
+            }
+            return true;
+        }
+        // command or authentication line, without the line break
+        QByteArray line (begin, lineSize);
+        while (line.endsWith('\n') || line.endsWith('\r'))
+            line.chop(1);
+        if (d_mode == CommandInput)
+            handleCommand(line);
+        else
+            handleAuthLine(line);
+        return true;
+    }
+
+    // Handles a command line
+    void handleCommand(const QByteArray &line)
+    {
+        d_state.receivedCommands.fetchAndAddRelaxed(1);
+        const int space = line.indexOf(' ');
+        const QByteArray verb = line.left(space).toUpper();
+        const QByteArray args = (space < 0)? QByteArray() : line.mid(space + 1).trimmed();
+        // injected replies replace the command handling
+        QByteArray injected;
+        if (takeInjection(verb, injected))
+            return send(verb, injected);
+
+        // EHLO / HELO
+        if (verb == "EHLO" || verb == "HELO") {
+            resetTransaction();
+            d_greeted = true;
+            if (verb == "HELO")
+                return reply(verb, QByteArrayLiteral("250 localhost"));
+            return reply(verb, ehloReply());
+        }
+        // STARTTLS
+        if (verb == "STARTTLS") {
+            if (!d_setup.capabilities.testFlag(ScriptedServer::CapStartTls) || d_setup.certificate.isNull()
+                || d_encrypted)
+                return reply(verb, status(502, "5.5.1", "STARTTLS not available"));
+            d_startTlsPending = true;
+            return reply(verb, status(220, "2.0.0", "Ready to start TLS"));
+        }
+        // AUTH
+        if (verb == "AUTH")
+            return handleAuth(args);
+        // MAIL FROM
+        if (verb == "MAIL") {
+            if (!args.toUpper().startsWith("FROM:"))
+                return reply(verb, status(501, "5.5.4", "Syntax: MAIL FROM:<address>"));
+            if (!d_sender.isNull())
+                return reply(verb, status(503, "5.5.1", "Sender already specified"));
+            // enforce the declared size
+            const int sizeParam = args.toUpper().indexOf(" SIZE=");
+            if (sizeParam >= 0 && d_setup.maxMessageSize > 0) {
+                const qint64 declaredSize = args.mid(sizeParam + 6).split(' ').first().toLongLong();
+                if (declaredSize > d_setup.maxMessageSize)
+                    return reply(verb, status(552, "5.3.4", "Message size exceeds fixed maximum"));
+            }
+            d_sender = addressOf(args.mid(5));
+            return reply(verb, status(250, "2.1.0", "Sender OK"));
+        }
+        // RCPT TO
+        if (verb == "RCPT") {
+            if (d_sender.isNull())
+                return reply(verb, status(503, "5.5.1", "Need MAIL command"));
+            if (!args.toUpper().startsWith("TO:"))
+                return reply(verb, status(501, "5.5.4", "Syntax: RCPT TO:<address>"));
+            d_recipients.append(addressOf(args.mid(3)));
+            return reply(verb, status(250, "2.1.5", "Recipient OK"));
+        }
+        // DATA
+        if (verb == "DATA") {
+            if (d_recipients.isEmpty())
+                return reply(verb, status(503, "5.5.1", "Need RCPT command"));
+            beginData();
+            d_mode = DataInput;
+            return reply(verb, QByteArrayLiteral("354 Start mail input; end with <CRLF>.<CRLF>"));
+        }
+        // BDAT
+        if (verb == "BDAT") {
+            if (!d_setup.capabilities.testFlag(ScriptedServer::CapChunking))
+                return reply(verb, status(502, "5.5.1", "CHUNKING not available"));
+            if (d_recipients.isEmpty())
+                return reply(verb, status(503, "5.5.1", "Need RCPT command"));
+            const QByteArrayList params = args.split(' ');
+            bool validSize = false;
+            d_bdatRemaining = params.first().toLongLong(&validSize);
+            d_bdatLast = (params.size() > 1 && params.at(1).toUpper() == "LAST");
+            if (!validSize || d_bdatRemaining < 0)
+                return reply(verb, status(501, "5.5.4", "Syntax: BDAT <size> [LAST]"));
+            if (!d_inBdat) {
+                beginData();
+                d_inBdat = true;
+            }
+            d_mode = BdatInput;
+            return;
+        }
+        // RSET, NOOP, QUIT
+        if (verb == "RSET") {
+            resetTransaction();
+            return reply(verb, status(250, "2.0.0", "OK"));
+        }
+        if (verb == "NOOP")
+            return reply(verb, status(250, "2.0.0", "OK"));
+        if (verb == "QUIT") {
+            d_closePending = true;
+            return reply(verb, status(221, "2.0.0", "Bye"));
+        }
+        // unknown
+        reply(verb, status(500, "5.5.2", "Command not recognized"));
+    }
+
+    // Handles the AUTH command
+    void handleAuth(const QByteArray &args)
+    {
+        const QByteArrayList params = args.split(' ');
+        const QByteArray mechanism = params.first().toUpper();
+        const QByteArray initial = (params.size() > 1)? params.at(1) : QByteArray();
+        if (d_authenticated)
+            return reply("AUTH", status(503, "5.5.1", "Already authenticated"));
+        // PLAIN
+        if (mechanism == "PLAIN" && d_setup.capabilities.testFlag(ScriptedServer::CapAuthPlain)) {
+            if (!initial.isEmpty())
+                return checkPlain(initial);
+            d_mode = AuthPlainInput;
+            return reply("AUTH", QByteArrayLiteral("334 "));
+        }
+        // LOGIN
+        if (mechanism == "LOGIN" && d_setup.capabilities.testFlag(ScriptedServer::CapAuthLogin)) {
+            d_mode = AuthLoginUserInput;
+            return reply("AUTH", QByteArrayLiteral("334 VXNlcm5hbWU6"));
+        }
+        // CRAM-MD5
+        if (mechanism == "CRAM-MD5" && d_setup.capabilities.testFlag(ScriptedServer::CapAuthCramMd5)) {
+            d_challenge = '<' % QByteArray::number(QRandomGenerator::global()->generate()) % '.'
+                % QByteArray::number(QDateTime::currentMSecsSinceEpoch()) % "@localhost>";
+            d_mode = AuthCramMd5Input;
+            return reply("AUTH", "334 " + d_challenge.toBase64());
+        }
+        reply("AUTH", status(504, "5.5.4", "Unrecognized authentication type"));
+    }
+    // Handles a line of an authentication exchange
+    void handleAuthLine(const QByteArray &line)
+    {
+        const pn_InputMode mode = d_mode;
+        d_mode = CommandInput;
+        // cancelled by the client
+        if (line == "*")
+            return reply("AUTH", status(501, "5.7.0", "Authentication cancelled"));
+        switch (mode) {
+        case AuthPlainInput:
+            return checkPlain(line);
+        case AuthLoginUserInput:
+            d_loginUser = QByteArray::fromBase64(line);
+            d_mode = AuthLoginPasswordInput;
+            return reply("AUTH", QByteArrayLiteral("334 UGFzc3dvcmQ6"));
+        case AuthLoginPasswordInput:
+            return authResult(d_loginUser == d_setup.username
+                && QByteArray::fromBase64(line) == d_setup.password);
+        case AuthCramMd5Input: {
+            const QByteArray response = QByteArray::fromBase64(line);
+            const int space = response.lastIndexOf(' ');
+            const QByteArray expected = QMessageAuthenticationCode::hash(
+                d_challenge, d_setup.password, QCryptographicHash::Md5).toHex();
+            return authResult(space > 0 && response.left(space) == d_setup.username
+                && response.mid(space + 1) == expected);
+        }
+        default:
+            return;
+        }
+    }
+    // Checks the AUTH PLAIN credentials: [authzid] \0 username \0 password
+    void checkPlain(const QByteArray &encoded)
+    {
+        const QByteArrayList parts = QByteArray::fromBase64(encoded).split('\0');
+        authResult(parts.size() == 3
+            && parts.at(1) == d_setup.username && parts.at(2) == d_setup.password);
+    }
+    // Replies with the authentication result
+    void authResult(bool succeeded)
+    {
+        d_authenticated = succeeded;
+        if (succeeded)
+            reply("AUTH", status(235, "2.7.0", "Authentication successful"));
+        else
+            reply("AUTH", status(535, "5.7.8", "Authentication credentials invalid"));
+    }
+
+    // Gets the EHLO reply, advertising the capabilities
+    QByteArray ehloReply() const
+    {
+        const auto caps = d_setup.capabilities;
+        QByteArrayList lines { QByteArrayLiteral("localhost greets you") };
+        if (caps.testFlag(ScriptedServer::CapPipelining))
+            lines.append("PIPELINING");
+        if (caps.testFlag(ScriptedServer::CapChunking))
+            lines.append("CHUNKING");
+        if (caps.testFlag(ScriptedServer::CapSize))
+            lines.append("SIZE " + QByteArray::number(d_setup.maxMessageSize));
+        if (caps.testFlag(ScriptedServer::Cap8BitMime))
+            lines.append("8BITMIME");
+        if (caps.testFlag(ScriptedServer::CapSmtpUtf8))
+            lines.append("SMTPUTF8");
+        if (caps.testFlag(ScriptedServer::CapEnhancedStatusCodes))
+            lines.append("ENHANCEDSTATUSCODES");
+        if (caps.testFlag(ScriptedServer::CapStartTls) && !d_setup.certificate.isNull() && !d_encrypted)
+            lines.append("STARTTLS");
+        QByteArray mechanisms;
+        if (caps.testFlag(ScriptedServer::CapAuthPlain))
+            mechanisms += " PLAIN";
+        if (caps.testFlag(ScriptedServer::CapAuthLogin))
+            mechanisms += " LOGIN";
+        if (caps.testFlag(ScriptedServer::CapAuthCramMd5))
+            mechanisms += " CRAM-MD5";
+        if (!mechanisms.isEmpty())
+            lines.append("AUTH" + mechanisms);
+        // multi-line reply, the last line with a space separator
+        QByteArray text;
+        for (int ix = 0, max = lines.size(); ix < max; ++ix)
+            text += ((ix > 0)? "\r\n250" : "250") % QByteArray((ix + 1 < max)? "-" : " ") % lines.at(ix);
+        return text;
+    }
+    // Gets a reply text, with the enhanced code whether advertised
+    QByteArray status(int code, const char *enhancedCode, const char *text) const
+    {
+        if (d_setup.capabilities.testFlag(ScriptedServer::CapEnhancedStatusCodes))
+            return QByteArray::number(code) % ' ' % enhancedCode % ' ' % text;
+        return QByteArray::number(code) % ' ' % text;
+    }
+
+    // Message data handling
+    void beginData()
+    {
+        d_data.clear();
+        d_dataSize = 0;
+    }
+    void appendData(const char *data, int size)
+    {
+        d_dataSize += size;
+        if (d_setup.keepMessages && (d_setup.maxMessageSize <= 0 || d_dataSize <= d_setup.maxMessageSize))
+            d_data.append(data, size);
+    }
+    void finishMessage()
+    {
+        d_inBdat = false;
+        // enforce the size
+        if (d_setup.maxMessageSize > 0 && d_dataSize > d_setup.maxMessageSize) {
+            resetTransaction();
+            return reply("DATA-END", status(552, "5.3.4", "Message size exceeds fixed maximum"));
+        }
+        // injected replies reject the message
+        QByteArray injected;
+        if (takeInjection("DATA-END", injected)) {
+            resetTransaction();
+            return send("DATA-END", injected);
+        }
+        // accept it
+        d_state.acceptedMessages.fetchAndAddRelaxed(1);
+        if (d_setup.keepMessages) {
+            QMutexLocker locker (&d_state.mutex);
+            d_state.messages.append({ d_sender, d_recipients, d_data });
+        }
+        resetTransaction();
+        reply("DATA-END", status(250, "2.0.0", "OK queued"));
+    }
+    void resetTransaction()
+    {
+        d_sender = QByteArray();
+        d_recipients.clear();
+        d_data.clear();
+        d_dataSize = 0;
+        d_inBdat = false;
+    }
+
+    // Extracts the address from a "<address> [params]" argument
+    static QByteArray addressOf(const QByteArray &arg)
+    {
+        const QByteArray trimmed = arg.trimmed();
+        const int open = trimmed.indexOf('<');
+        const int close = trimmed.indexOf('>', open + 1);
+        if (open < 0 || close < 0)
+            return trimmed.split(' ').first();
+        return trimmed.mid(open + 1, close - open - 1);
+    }
+
+    // Counts an occurrence of the verb, taking the injected reply for it (whether any)
+    bool takeInjection(const QByteArray &verb, QByteArray &injectedReply)
+    {
+        int occurrence = 0;
+        {
+            QMutexLocker locker (&d_state.mutex);
+            occurrence = ++d_state.verbCounts[verb];
+        }
+        for (const auto &injection : d_setup.injections) {
+            if (injection.verb == verb && (injection.occurrence == 0 || injection.occurrence == occurrence)) {
+                injectedReply = injection.reply;
+                return true;
+            }
+        }
+        return false;
+    }
+    // Replies to a command (not injected)
+    void reply(const QByteArray &verb, const QByteArray &text)
+    {
+        // counts the special verbs, handled outside of the commands
+        if (verb == "CONNECT") {
+            QByteArray injected;
+            if (takeInjection(verb, injected))
+                return send(verb, injected);
+        }
+        send(verb, text);
+    }
+    // Sends the reply, after the latency set for the verb
+    void send(const QByteArray &verb, const QByteArray &text)
+    {
+        d_pendingReply = text;
+        const int latency = d_setup.latencies.value(verb, d_setup.latencies.value("*", 0));
+        if (latency <= 0)
+            return writePendingReply();
+        // wait, holding the input processing
+        d_replyPending = true;
+        QTimer::singleShot(latency, this, &pn_Session::onLatencyElapsed);
+    }
+    void onLatencyElapsed()
+    {
+        writePendingReply();
+        process();
+    }
+    // Writes the pending reply, applying the pending actions
+    void writePendingReply()
+    {
+        d_replyPending = false;
+        // an empty reply drops the connection
+        if (d_pendingReply.isEmpty()) {
+            d_socket->abort();
+            return;
+        }
+        d_socket->write(d_pendingReply % "\r\n");
+        d_pendingReply.clear();
+        // closing after QUIT
+        if (d_closePending) {
+            d_socket->disconnectFromHost();
+            return;
+        }
+        // upgrading after STARTTLS, discarding any plain text input
+        if (d_startTlsPending) {
+            d_startTlsPending = false;
+            d_input.clear();
+            d_inputOffset = 0;
+            startEncryption();
+            resetTransaction();
+            d_greeted = false;
+            d_authenticated = false;
+        }
+    }
+    // Starts the server side of the TLS handshake
+    void startEncryption()
+    {
+        d_socket->setLocalCertificate(d_setup.certificate);
+        d_socket->setPrivateKey(d_setup.privateKey);
+        d_socket->startServerEncryption();
+        d_encrypted = true;
+    }
+
+private:
+    QSslSocket *d_socket = nullptr;
+    const pn_ServerSetup &d_setup;
+    pn_ServerState &d_state;
+    QByteArray d_input;
+    int d_inputOffset = 0;
+    pn_InputMode d_mode = CommandInput;
+    QByteArray d_pendingReply;
+    bool d_replyPending = false;
+    bool d_startTlsPending = false;
+    bool d_closePending = false;
+    bool d_encrypted = false;
+    bool d_greeted = false;
+    bool d_authenticated = false;
+    QByteArray d_loginUser;
+    QByteArray d_challenge;
+    QByteArray d_sender;
+    QByteArrayList d_recipients;
+    QByteArray d_data;
+    qint64 d_dataSize = 0;
+    qint64 d_bdatRemaining = 0;
+    bool d_bdatLast = false;
+    bool d_inBdat = false;
+};
+
+// Listening Server, creating a session per connection
+class pn_TcpServer : public QTcpServer
+{
+public:
+    pn_TcpServer(const pn_ServerSetup &setup, pn_ServerState &state)
+        : d_setup(setup), d_state(state) {}
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override
+    {
+        auto *socket = new QSslSocket();
+        if (!socket->setSocketDescriptor(socketDescriptor)) {
+            delete socket;
+            return;
+        }
+        new pn_Session(socket, d_setup, d_state, this);
+    }
+
+private:
+    const pn_ServerSetup &d_setup;
+    pn_ServerState &d_state;
+};
+
+// Server Thread, running the event loop of the server and its sessions
+class pn_ServerThread : public QThread
+{
+public:
+    pn_ServerThread(const pn_ServerSetup &setup, pn_ServerState &state,
+        const QHostAddress &address, quint16 port)
+        : d_setup(setup), d_state(state), d_address(address), d_port(port) {}
+
+    // Starts the thread, waiting for the server to listen
+    bool startListening()
+    {
+        start();
+        d_ready.acquire();
+        return d_listening;
+    }
+    // Gets the port the server is listening on
+    inline quint16 listeningPort() const { return d_port; }
+
+protected:
+    void run() override
+    {
+        // listen
+        pn_TcpServer server (d_setup, d_state);
+        d_listening = server.listen(d_address, d_port);
+        d_port = server.serverPort();
+        d_ready.release();
+        // serve until quit
+        if (d_listening)
+            exec();
+    }
+
+private:
+    const pn_ServerSetup d_setup; // copy, owned by the thread
+    pn_ServerState &d_state;
+    QHostAddress d_address;
+    quint16 d_port = 0;
+    bool d_listening = false;
+    QSemaphore d_ready;
+};
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+// ScriptedServer
+
+struct Smtp::ScriptedServer::PrivateData
+{
+    pn_ServerSetup setup;
+    pn_ServerState state;
+    pn_ServerThread *thread = nullptr;
+};
+
+ScriptedServer::ScriptedServer()
+    : d(new PrivateData()) {}
+
+ScriptedServer::~ScriptedServer()
+{
+    // ensure it is stopped
+    stop();
+    // free resources
+    delete d;
+}
+
+void ScriptedServer::setCapabilities(Capabilities capabilities)
+{
+    d->setup.capabilities = capabilities;
+}
+
+void ScriptedServer::setMaxMessageSize(qint64 bytes)
+{
+    d->setup.maxMessageSize = bytes;
+}
+
+void ScriptedServer::setCredentials(const QString &username, const QString &password)
+{
+    d->setup.username = username.toUtf8();
+    d->setup.password = password.toUtf8();
+}
+
+void ScriptedServer::setTlsIdentity(const QSslCertificate &certificate, const QSslKey &key)
+{
+    d->setup.certificate = certificate;
+    d->setup.privateKey = key;
+}
+
+bool ScriptedServer::loadTlsIdentity(const QString &certificateFile, const QString &keyFile)
+{
+    // read the PEM files
+    QFile certificatePem (certificateFile);
+    QFile keyPem (keyFile);
+    if (!certificatePem.open(QIODevice::ReadOnly) || !keyPem.open(QIODevice::ReadOnly))
+        return false;
+    const QSslCertificate certificate (certificatePem.readAll(), QSsl::Pem);
+    const QByteArray key = keyPem.readAll();
+    // RSA or EC keys
+    QSslKey privateKey (key, QSsl::Rsa, QSsl::Pem);
+    if (privateKey.isNull())
+        privateKey = QSslKey(key, QSsl::Ec, QSsl::Pem);
+    if (certificate.isNull() || privateKey.isNull())
+        return false;
+    // success
+    setTlsIdentity(certificate, privateKey);
+    return true;
+}
+
+void ScriptedServer::setImplicitTls(bool on)
+{
+    d->setup.implicitTls = on;
+}
+
+void ScriptedServer::setKeepMessages(bool on)
+{
+    d->setup.keepMessages = on;
+}
+
+void ScriptedServer::setCommandLatency(const QByteArray &verb, int msecs)
+{
+    d->setup.latencies.insert(verb.toUpper(), msecs);
+}
+
+void ScriptedServer::injectReply(const QByteArray &verb, int occurrence, const QByteArray &reply)
+{
+    d->setup.injections.append({ verb.toUpper(), occurrence, reply });
+}
+
+bool ScriptedServer::start(const QHostAddress &address, quint16 port)
+{
+    // ensure it is not running, and it has an identity for implicit TLS
+    if (d->thread != nullptr || (d->setup.implicitTls && d->setup.certificate.isNull()))
+        return false;
+    // start the server thread
+    d->thread = new pn_ServerThread(d->setup, d->state, address, port);
+    if (!d->thread->startListening()) {
+        stop();
+        return false;
+    }
+    // success
+    return true;
+}
+
+void ScriptedServer::stop()
+{
+    // fast return whether not running
+    if (d->thread == nullptr)
+        return;
+    // stop the event loop, closing all sessions
+    d->thread->quit();
+    d->thread->wait();
+    delete d->thread;
+    d->thread = nullptr;
+}
+
+bool ScriptedServer::isRunning() const
+{
+    return (d->thread != nullptr);
+}
+
+quint16 ScriptedServer::port() const
+{
+    return (d->thread != nullptr)? d->thread->listeningPort() : 0;
+}
+
+int ScriptedServer::acceptedMessages() const
+{
+    return d->state.acceptedMessages.load();
+}
+
+int ScriptedServer::receivedCommands() const
+{
+    return d->state.receivedCommands.load();
+}
+
+QList<ScriptedServer::ReceivedMessage> ScriptedServer::receivedMessages() const
+{
+    QMutexLocker locker (&d->state.mutex);
+    return d->state.messages;
+}
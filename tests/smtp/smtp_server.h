@@ -0,0 +1,121 @@
+#ifndef SMTP_SERVER_H
+#define SMTP_SERVER_H
+
+#include <QHostAddress>
+#include <QSslCertificate>
+#include <QSslKey>
+#include <QByteArrayList>
+#include "utils/macros.h"
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// Scripted SMTP Server, an in-process stand-in for benchmarks and tests on loopback
+/// \note Test fixture, built into the test and benchmark targets only (not into the library)
+/// \note The server runs its own thread, so blocking clients can be used from the calling one
+/// \note Supported: EHLO capabilities, STARTTLS (or implicit TLS), AUTH PLAIN/LOGIN/CRAM-MD5,
+///     PIPELINING, CHUNKING (BDAT), SIZE, 8BITMIME, SMTPUTF8 and ENHANCEDSTATUSCODES
+/// \note Replies can be delayed per command, and replaced by injected ones to script failures
+/// \note There is no TLS identity as default: STARTTLS is advertised and implicit TLS is started
+///     only once an identity is set (e.g. a self-signed certificate for "localhost", thus clients
+///     must either trust it or ignore the ssl errors)
+/// \warning Setup the server before starting it, the setup is not applied to a running server
+class ScriptedServer
+{
+// public definitions
+public:
+    /// Advertised Capabilities
+    enum Capability
+    {
+        NoCapabilities = 0x0000,
+        CapPipelining = 0x0001,
+        CapChunking = 0x0002,
+        CapSize = 0x0004,
+        Cap8BitMime = 0x0008,
+        CapSmtpUtf8 = 0x0010,
+        CapStartTls = 0x0020,
+        CapAuthPlain = 0x0040,
+        CapAuthLogin = 0x0080,
+        CapAuthCramMd5 = 0x0100,
+        CapEnhancedStatusCodes = 0x0200,
+        AllCapabilities = 0x03FF
+    };
+    Q_DECLARE_FLAGS(Capabilities, Capability)
+
+    /// Message received by the server
+    struct ReceivedMessage
+    {
+        QByteArray sender;
+        QByteArrayList recipients;
+        QByteArray data; ///< message content, dot-stuffing removed
+    };
+
+// construction
+public:
+    // Ctor
+    ScriptedServer();
+    // Dtor, stopping the server
+    ~ScriptedServer();
+    // Not copyable
+    Q_DISABLE_COPY(ScriptedServer)
+
+// public interface
+public:
+    /// Sets the advertised capabilities
+    /// \default As default all capabilities are advertised
+    void setCapabilities(Capabilities capabilities);
+    /// Sets the max message size (advertised by SIZE and enforced), zero for no limit
+    /// \default As default 32MB
+    void setMaxMessageSize(qint64 bytes);
+    /// Sets the credentials accepted by AUTH
+    /// \default As default "user" / "password"
+    void setCredentials(const QString &username, const QString &password);
+    /// Sets the TLS identity used by STARTTLS and implicit TLS
+    void setTlsIdentity(const QSslCertificate &certificate, const QSslKey &key);
+    /// Loads the TLS identity from the given PEM files, a certificate and its RSA or EC key
+    /// \return True on success, False otherwise
+    bool loadTlsIdentity(const QString &certificateFile, const QString &keyFile);
+    /// Enables implicit TLS, encrypting the connections from the start (as SMTPS)
+    void setImplicitTls(bool on);
+    /// Enables keeping the received messages, which are just counted otherwise
+    void setKeepMessages(bool on);
+
+    /// Delays the replies to the given command verb (e.g. "RCPT"), "*" for all commands
+    /// \note The special verbs "CONNECT" and "DATA-END" stand for the greeting and the reply
+    ///     to the message data (DATA terminator or last BDAT chunk)
+    void setCommandLatency(const QByteArray &verb, int msecs);
+    /// Replaces the reply to the Nth occurrence (1-based, over the server life) of the given
+    ///     command verb with the given one (e.g. "452 4.5.3 Too many recipients"),
+    ///     zero occurrence for all of them; an empty reply drops the connection instead
+    /// \note Special verbs are supported as for the latency
+    void injectReply(const QByteArray &verb, int occurrence, const QByteArray &reply);
+
+    /// Starts listening on the given address, a zero port to pick a free one
+    /// \return True on success, False otherwise (implicit TLS with no identity included)
+    bool start(const QHostAddress &address = QHostAddress::LocalHost, quint16 port = 0);
+    /// Stops the server, closing all connections
+    void stop();
+    /// Checks whether the server is running
+    bool isRunning() const;
+    /// Gets the port the server is listening on
+    quint16 port() const;
+
+    /// Gets the amount of messages accepted so far
+    int acceptedMessages() const;
+    /// Gets the amount of commands received so far
+    int receivedCommands() const;
+    /// Gets the messages received so far, whether kept
+    QList<ReceivedMessage> receivedMessages() const;
+
+// private members
+private:
+    PRIVATE_DATA_PTR(d)
+};
+
+
+} // < Smtp NS
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(Smtp::ScriptedServer::Capabilities)
+
+#endif // SMTP_SERVER_H
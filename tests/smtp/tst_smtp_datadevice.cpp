@@ -0,0 +1,139 @@
+#include <QtTest>
+#include "tests/smtp/smtp_server.h"
+#include "utils/smtp/smtp_client.h"
+#include "utils/smtp/smtp_datadevice.h"
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Gets the DATA stream of the given message, written whole or byte by byte
+QByteArray pn_stuffed(const QByteArray &message, bool byteByByte)
+{
+    QBuffer target;
+    target.open(QIODevice::WriteOnly);
+    DataDevice writer (&target);
+    writer.open(QIODevice::WriteOnly);
+    if (!byteByByte) {
+        writer.write(message);
+    } else {
+        for (const char c : message)
+            writer.write(&c, 1);
+    }
+    if (!writer.finish())
+        return QByteArray();
+    return target.data();
+}
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+/// Dot-Stuffing Tests, of the DATA stream and of the messages received over it
+class TestSmtpDataDevice : public QObject
+{
+    Q_OBJECT
+
+// private slots
+private slots:
+    void stuffing_data();
+    void stuffing();
+    void multipleMessages();
+    void roundTrip_data();
+    void roundTrip();
+};
+
+void TestSmtpDataDevice::stuffing_data()
+{
+    QTest::addColumn<QByteArray>("message");
+    QTest::addColumn<QByteArray>("expected");
+    QTest::newRow("plain") << QByteArray("Hello\r\nWorld\r\n") << QByteArray("Hello\r\nWorld\r\n.\r\n");
+    QTest::newRow("leading dot") << QByteArray(".hidden\r\n") << QByteArray("..hidden\r\n.\r\n");
+    QTest::newRow("inner dot") << QByteArray("a.b\r\n") << QByteArray("a.b\r\n.\r\n");
+    QTest::newRow("bare dot line") << QByteArray("a\r\n.\r\nb\r\n") << QByteArray("a\r\n..\r\nb\r\n.\r\n");
+    QTest::newRow("bare dot first line") << QByteArray(".\r\nb\r\n") << QByteArray("..\r\nb\r\n.\r\n");
+    QTest::newRow("bare dot last line") << QByteArray("a\r\n.") << QByteArray("a\r\n..\r\n.\r\n");
+    QTest::newRow("double dot line") << QByteArray("..\r\n") << QByteArray("...\r\n.\r\n");
+    QTest::newRow("missing final CRLF") << QByteArray("a\r\nb") << QByteArray("a\r\nb\r\n.\r\n");
+    QTest::newRow("bare LF") << QByteArray("a\n.\nb") << QByteArray("a\r\n..\r\nb\r\n.\r\n");
+    QTest::newRow("empty") << QByteArray() << QByteArray(".\r\n");
+}
+
+void TestSmtpDataDevice::stuffing()
+{
+    QFETCH(QByteArray, message);
+    QFETCH(QByteArray, expected);
+    // the state carries over the writes, whatever their boundaries
+    QCOMPARE(pn_stuffed(message, false), expected);
+    QCOMPARE(pn_stuffed(message, true), expected);
+}
+
+void TestSmtpDataDevice::multipleMessages()
+{
+    // the terminator resets the state, the next message starting at a line start
+    QBuffer target;
+    target.open(QIODevice::WriteOnly);
+    DataDevice writer (&target);
+    writer.open(QIODevice::WriteOnly);
+    writer.write("first");
+    QVERIFY(writer.finish());
+    writer.write(".second\r\n");
+    QVERIFY(writer.finish());
+    QCOMPARE(target.data(), QByteArray("first\r\n.\r\n..second\r\n.\r\n"));
+    QCOMPARE(writer.forwardedBytes(), qint64(target.data().size()));
+}
+
+void TestSmtpDataDevice::roundTrip_data()
+{
+    QTest::addColumn<QByteArray>("message");
+    QTest::addColumn<QByteArray>("received");
+    QTest::newRow("bare dot line") << QByteArray("Subject: dots\r\n\r\nbefore\r\n.\r\nafter\r\n")
+        << QByteArray("Subject: dots\r\n\r\nbefore\r\n.\r\nafter\r\n");
+    QTest::newRow("dotted lines") << QByteArray("Subject: dots\r\n\r\n.one\r\n..two\r\n")
+        << QByteArray("Subject: dots\r\n\r\n.one\r\n..two\r\n");
+    QTest::newRow("missing final CRLF") << QByteArray("Subject: dots\r\n\r\nlast line")
+        << QByteArray("Subject: dots\r\n\r\nlast line\r\n");
+    QTest::newRow("bare dot without final CRLF") << QByteArray("Subject: dots\r\n\r\n.")
+        << QByteArray("Subject: dots\r\n\r\n.\r\n");
+}
+
+void TestSmtpDataDevice::roundTrip()
+{
+    QFETCH(QByteArray, message);
+    QFETCH(QByteArray, received);
+    // the server removes the dot-stuffing, getting the message back (its last line closed)
+    ScriptedServer server;
+    server.setKeepMessages(true);
+    QVERIFY(server.start());
+    Client client;
+    client.setServerHost(QStringLiteral("127.0.0.1"));
+    client.setServerPort(server.port());
+    client.setClientHost(QStringLiteral("localhost"));
+    client.setConnectionType(Client::TcpConnection);
+    client.setAuthMethod(Client::AuthNone);
+    QVERIFY(client.connectToServer());
+
+    Envelope envelope;
+    envelope.sender = QStringLiteral("sender@example.com");
+    envelope.recipients = QStringList { QStringLiteral("recipient@example.com") };
+    QBuffer data;
+    data.setData(message);
+    data.open(QIODevice::ReadOnly);
+    QVERIFY(client.sendMessage(envelope, data));
+    // the session is still in sync after the message
+    data.seek(0);
+    QVERIFY(client.sendMessage(envelope, data));
+
+    const auto messages = server.receivedMessages();
+    QCOMPARE(messages.size(), 2);
+    QCOMPARE(messages.at(0).sender, QByteArray("sender@example.com"));
+    QCOMPARE(messages.at(0).recipients, QByteArrayList { "recipient@example.com" });
+    QCOMPARE(messages.at(0).data, received);
+    QCOMPARE(messages.at(1).data, received);
+}
+
+QTEST_GUILESS_MAIN(TestSmtpDataDevice)
+
+#include "tst_smtp_datadevice.moc"
@@ -0,0 +1,316 @@
+#include <QtTest>
+#include <QTemporaryDir>
+#include "tests/smtp/smtp_server.h"
+#include "utils/smtp/smtp_client.h"
+#include "utils/smtp/smtp_dispatcher.h"
+#include "utils/smtp/smtp_retry.h"
+#include "utils/smtp/smtp_spool.h"
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Gets an envelope to the given recipients
+Envelope pn_envelope(const QStringList &recipients)
+{
+    Envelope envelope;
+    envelope.sender = QStringLiteral("sender@example.com");
+    envelope.recipients = recipients;
+    return envelope;
+}
+
+// Gets a retry policy with no jitter, so that the next attempts are known
+RetryPolicy pn_policy(int maxAttempts)
+{
+    RetryPolicy policy;
+    policy.initialDelay = 1000;
+    policy.maxDelay = 60 * 1000;
+    policy.multiplier = 2.0;
+    policy.jitter = 0.0;
+    policy.maxAttempts = maxAttempts;
+    policy.maxAge = 0;
+    return policy;
+}
+
+// Gets the statuses carried by the given signal arguments
+inline RecipientStatuses pn_statuses(const QList<QVariant> &arguments)
+{
+    return qvariant_cast<RecipientStatuses>(arguments.at(1));
+}
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+/// Retry and Respool Settlement Tests
+class TestSmtpDispatcher : public QObject
+{
+    Q_OBJECT
+
+// private slots
+private slots:
+    void init();
+    void cleanup();
+
+    void policyDelay();
+    void policyExhaustion();
+    void wheelAdvance();
+    void wheelReschedule();
+    void wheelBeyondTurn();
+
+    void deliver();
+    void deferThenDeliver();
+    void exhaustRetries();
+    void respoolRemaining();
+
+// private members
+private:
+    ScriptedServer *d_server = nullptr;
+    Client *d_client = nullptr;
+    Spool *d_spool = nullptr;
+    QTemporaryDir *d_spoolDir = nullptr;
+};
+
+void TestSmtpDispatcher::init()
+{
+    // each test case gets its own server, as injected replies count over the server life
+    d_server = new ScriptedServer();
+    d_server->setKeepMessages(true);
+    d_client = new Client();
+    d_client->setServerHost(QStringLiteral("127.0.0.1"));
+    d_client->setClientHost(QStringLiteral("localhost"));
+    d_client->setConnectionType(Client::TcpConnection);
+    d_client->setAuthMethod(Client::AuthNone);
+    d_spoolDir = new QTemporaryDir();
+    d_spool = new Spool();
+    d_spool->setSyncBatch(1, 0);
+    QVERIFY(d_spool->open(d_spoolDir->path()));
+}
+
+void TestSmtpDispatcher::cleanup()
+{
+    delete d_spool;
+    delete d_spoolDir;
+    delete d_client;
+    delete d_server;
+    d_spool = nullptr;
+    d_spoolDir = nullptr;
+    d_client = nullptr;
+    d_server = nullptr;
+}
+
+void TestSmtpDispatcher::policyDelay()
+{
+    RetryPolicy policy = pn_policy(0);
+    policy.maxDelay = 5000;
+    QCOMPARE(policy.delay(1), qint64(1000));
+    QCOMPARE(policy.delay(2), qint64(2000));
+    QCOMPARE(policy.delay(3), qint64(4000));
+    QCOMPARE(policy.delay(4), qint64(5000));
+    QCOMPARE(policy.delay(20), qint64(5000));
+    // the jitter shortens the delay, never lengthens it
+    policy.jitter = 0.5;
+    for (int ix = 0; ix < 100; ++ix) {
+        const qint64 delay = policy.delay(2);
+        QVERIFY(delay >= 1000 && delay <= 2000);
+    }
+}
+
+void TestSmtpDispatcher::policyExhaustion()
+{
+    RetryPolicy policy = pn_policy(3);
+    policy.maxAge = 10000;
+    QVERIFY(!policy.isExhausted(2, 9999));
+    QVERIFY(policy.isExhausted(3, 0));
+    QVERIFY(policy.isExhausted(1, 10000));
+    policy.maxAttempts = 0;
+    policy.maxAge = 0;
+    QVERIFY(!policy.isExhausted(1000, 1000 * 1000));
+}
+
+void TestSmtpDispatcher::wheelAdvance()
+{
+    RetryWheel wheel (100, 8);
+    wheel.schedule(1, 1000);
+    wheel.schedule(2, 1250);
+    wheel.schedule(3, 1100);
+    QCOMPARE(wheel.count(), 3);
+    QVERIFY(wheel.advance(999).isEmpty());
+    QCOMPARE(wheel.advance(1000), QList<quint64> { 1 });
+    // due ids come by due tick
+    QCOMPARE(wheel.advance(1300), (QList<quint64> { 3, 2 }));
+    QCOMPARE(wheel.count(), 0);
+    // times already advanced over are due on the next tick
+    wheel.schedule(4, 500);
+    QVERIFY(wheel.advance(1300).isEmpty());
+    QCOMPARE(wheel.advance(1400), QList<quint64> { 4 });
+}
+
+void TestSmtpDispatcher::wheelReschedule()
+{
+    RetryWheel wheel (100, 8);
+    wheel.schedule(1, 1000);
+    wheel.schedule(2, 1000);
+    // rescheduling replaces the previous due time, cancelling drops it
+    wheel.schedule(1, 1500);
+    QVERIFY(wheel.cancel(2));
+    QVERIFY(!wheel.cancel(2));
+    QCOMPARE(wheel.count(), 1);
+    QVERIFY(wheel.advance(1000).isEmpty());
+    QVERIFY(wheel.contains(1));
+    QCOMPARE(wheel.advance(1500), QList<quint64> { 1 });
+    QVERIFY(!wheel.contains(1));
+}
+
+void TestSmtpDispatcher::wheelBeyondTurn()
+{
+    // a turn of the wheel is 800 msecs, later timers wait for their turn in the slot
+    RetryWheel wheel (100, 8);
+    QVERIFY(wheel.advance(1000).isEmpty());
+    wheel.schedule(1, 1000 + 2 * 800);
+    wheel.schedule(2, 1000 + 100);
+    QCOMPARE(wheel.advance(1100), QList<quint64> { 2 });
+    QVERIFY(wheel.advance(1000 + 800).isEmpty());
+    QVERIFY(wheel.advance(1000 + 2 * 800 - 100).isEmpty());
+    QCOMPARE(wheel.advance(1000 + 2 * 800), QList<quint64> { 1 });
+}
+
+void TestSmtpDispatcher::deliver()
+{
+    QVERIFY(d_server->start());
+    d_client->setServerPort(d_server->port());
+    Dispatcher dispatcher (*d_spool, *d_client);
+    dispatcher.setRetryPolicy(pn_policy(3));
+    QSignalSpy deliveredSpy (&dispatcher, &Dispatcher::messageDelivered);
+
+    const quint64 id = d_spool->enqueue(pn_envelope({ "first@example.com", "second@example.com" }),
+        QByteArrayLiteral("Subject: test\r\n\r\nbody\r\n"));
+    QVERIFY(id != 0);
+    QCOMPARE(dispatcher.dispatchDue(), 1);
+    QCOMPARE(dispatcher.stats().delivered, qint64(1));
+    QCOMPARE(deliveredSpy.count(), 1);
+    QCOMPARE(deliveredSpy.at(0).at(0).value<quint64>(), id);
+    QCOMPARE(d_spool->count(), 0);
+    QCOMPARE(dispatcher.scheduledCount(), 0);
+    QCOMPARE(d_server->acceptedMessages(), 1);
+}
+
+void TestSmtpDispatcher::deferThenDeliver()
+{
+    d_server->injectReply("DATA-END", 1, "451 4.3.0 Try again later");
+    QVERIFY(d_server->start());
+    d_client->setServerPort(d_server->port());
+    Dispatcher dispatcher (*d_spool, *d_client);
+    dispatcher.setRetryPolicy(pn_policy(3));
+    QSignalSpy deliveredSpy (&dispatcher, &Dispatcher::messageDelivered);
+    QSignalSpy failedSpy (&dispatcher, &Dispatcher::messageFailed);
+
+    // a transient failure of all the recipients defers the message, as one more attempt
+    const qint64 nowMsecs = QDateTime::currentMSecsSinceEpoch();
+    const quint64 id = d_spool->enqueue(pn_envelope({ "first@example.com", "second@example.com" }),
+        QByteArrayLiteral("Subject: test\r\n\r\nbody\r\n"));
+    QCOMPARE(dispatcher.dispatchDue(nowMsecs), 0);
+    QCOMPARE(dispatcher.stats().deferred, qint64(1));
+    QCOMPARE(dispatcher.stats().delivered, qint64(0));
+    QCOMPARE(failedSpy.count(), 0);
+    Spool::Entry entry;
+    QVERIFY(d_spool->entry(id, entry));
+    QCOMPARE(entry.attempts, 1);
+    QCOMPARE(entry.nextAttemptMsecs, nowMsecs + 1000);
+    QCOMPARE(dispatcher.scheduledCount(), 1);
+
+    // then delivered once due
+    QCOMPARE(dispatcher.dispatchDue(nowMsecs + 1000), 1);
+    QCOMPARE(dispatcher.stats().delivered, qint64(1));
+    QCOMPARE(deliveredSpy.count(), 1);
+    QCOMPARE(deliveredSpy.at(0).at(0).value<quint64>(), id);
+    QCOMPARE(d_spool->count(), 0);
+    QCOMPARE(dispatcher.scheduledCount(), 0);
+    QCOMPARE(d_server->acceptedMessages(), 1);
+}
+
+void TestSmtpDispatcher::exhaustRetries()
+{
+    d_server->injectReply("DATA-END", 0, "451 4.3.0 Try again later");
+    QVERIFY(d_server->start());
+    d_client->setServerPort(d_server->port());
+    Dispatcher dispatcher (*d_spool, *d_client);
+    dispatcher.setRetryPolicy(pn_policy(2));
+    QSignalSpy failedSpy (&dispatcher, &Dispatcher::messageFailed);
+
+    const qint64 nowMsecs = QDateTime::currentMSecsSinceEpoch();
+    const quint64 id = d_spool->enqueue(pn_envelope({ "first@example.com" }),
+        QByteArrayLiteral("Subject: test\r\n\r\nbody\r\n"));
+    QCOMPARE(dispatcher.dispatchDue(nowMsecs), 0);
+    QCOMPARE(failedSpy.count(), 0);
+    // the last attempt gives the message up, settling it as failed
+    QCOMPARE(dispatcher.dispatchDue(nowMsecs + 1000), 1);
+    QCOMPARE(dispatcher.stats().deferred, qint64(1));
+    QCOMPARE(dispatcher.stats().failed, qint64(1));
+    QCOMPARE(failedSpy.count(), 1);
+    QCOMPARE(failedSpy.at(0).at(0).value<quint64>(), id);
+    const auto statuses = pn_statuses(failedSpy.at(0));
+    QCOMPARE(statuses.size(), 1);
+    QCOMPARE(statuses.at(0).code, 451);
+    QCOMPARE(d_spool->count(), 0);
+    QCOMPARE(dispatcher.scheduledCount(), 0);
+    QCOMPARE(d_server->acceptedMessages(), 0);
+}
+
+void TestSmtpDispatcher::respoolRemaining()
+{
+    d_server->injectReply("RCPT", 2, "550 5.1.1 No such user");
+    QVERIFY(d_server->start());
+    d_client->setServerPort(d_server->port());
+    Dispatcher dispatcher (*d_spool, *d_client);
+    dispatcher.setRetryPolicy(pn_policy(3));
+    QSignalSpy deliveredSpy (&dispatcher, &Dispatcher::messageDelivered);
+    QSignalSpy failedSpy (&dispatcher, &Dispatcher::messageFailed);
+
+    // the rejected recipient fails the transaction: it is given up, the others are spooled again
+    const qint64 nowMsecs = QDateTime::currentMSecsSinceEpoch();
+    const QByteArray data = QByteArrayLiteral("Subject: test\r\n\r\nbody\r\n");
+    const quint64 id = d_spool->enqueue(pn_envelope({ "first@example.com", "second@example.com",
+        "third@example.com" }), data, nowMsecs - 5000);
+    QCOMPARE(dispatcher.dispatchDue(nowMsecs), 1);
+    QCOMPARE(dispatcher.stats().failed, qint64(1));
+    QCOMPARE(dispatcher.stats().respooled, qint64(1));
+    QCOMPARE(dispatcher.stats().delivered, qint64(0));
+    QCOMPARE(failedSpy.count(), 1);
+    QCOMPARE(failedSpy.at(0).at(0).value<quint64>(), id);
+    const auto statuses = pn_statuses(failedSpy.at(0));
+    QCOMPARE(statuses.size(), 3);
+    QCOMPARE(statuses.at(0).severity(), ReplyTransient);
+    QCOMPARE(statuses.at(1).code, 550);
+    QCOMPARE(statuses.at(2).severity(), ReplyTransient);
+
+    // the respooled message carries the attempts and the age of the original
+    Spool::Entry entry;
+    QVERIFY(!d_spool->entry(id, entry));
+    const auto pending = d_spool->pending();
+    QCOMPARE(pending.size(), 1);
+    const Spool::Entry respooled = pending.at(0);
+    QVERIFY(respooled.id > id);
+    QCOMPARE(respooled.envelope.recipients, (QStringList { "first@example.com", "third@example.com" }));
+    QCOMPARE(respooled.attempts, 1);
+    QCOMPARE(respooled.createdMsecs, nowMsecs - 5000);
+    QCOMPARE(respooled.nextAttemptMsecs, nowMsecs + 1000);
+    QCOMPARE(dispatcher.scheduledCount(), 1);
+
+    // then delivered to the remaining recipients once due
+    QCOMPARE(dispatcher.dispatchDue(nowMsecs + 1000), 1);
+    QCOMPARE(dispatcher.stats().delivered, qint64(1));
+    QCOMPARE(deliveredSpy.count(), 1);
+    QCOMPARE(deliveredSpy.at(0).at(0).value<quint64>(), respooled.id);
+    QCOMPARE(d_spool->count(), 0);
+    const auto messages = d_server->receivedMessages();
+    QCOMPARE(messages.size(), 1);
+    QCOMPARE(messages.at(0).recipients, (QByteArrayList { "first@example.com", "third@example.com" }));
+    QCOMPARE(messages.at(0).data, data);
+}
+
+QTEST_GUILESS_MAIN(TestSmtpDispatcher)
+
+#include "tst_smtp_dispatcher.moc"
@@ -0,0 +1,274 @@
+#include <QtTest>
+#include <QTcpSocket>
+#include "tests/smtp/smtp_server.h"
+#include "utils/smtp/smtp_client.h"
+#include "utils/smtp/smtp_reply.h"
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Parsed Reply, copied out of the parsed buffer
+struct pn_ParsedReply
+{
+    int code = 0;
+    QByteArray enhancedCode;
+    QByteArray text;
+};
+
+// Reads the given amount of replies from the socket, parsing them one by one as they come
+QList<pn_ParsedReply> pn_readReplies(QTcpSocket &socket, int count)
+{
+    QList<pn_ParsedReply> replies;
+    ReplyParser parser;
+    QByteArray buffer;
+    while (replies.size() < count) {
+        // parse all the replies buffered so far
+        Reply reply;
+        int consumed = 0;
+        const auto result = parser.parse(buffer.constData(), buffer.size(), reply, consumed);
+        if (result == ReplyParser::ReplyMalformed)
+            break;
+        if (result == ReplyParser::ReplyComplete) {
+            replies.append({ reply.code, reply.enhancedCode.toByteArray(), reply.text() });
+            buffer.remove(0, consumed);
+            continue;
+        }
+        // or wait for more data
+        if (socket.bytesAvailable() == 0 && !socket.waitForReadyRead(5000))
+            break;
+        buffer += socket.readAll();
+    }
+    return replies;
+}
+
+// Sets the given client up for the given server
+void pn_setup(Client &client, const ScriptedServer &server)
+{
+    client.setServerHost(QStringLiteral("127.0.0.1"));
+    client.setServerPort(server.port());
+    client.setClientHost(QStringLiteral("localhost"));
+    client.setConnectionType(Client::TcpConnection);
+    client.setAuthMethod(Client::AuthNone);
+}
+
+// Gets an envelope to the given recipients
+Envelope pn_envelope(const QStringList &recipients)
+{
+    Envelope envelope;
+    envelope.sender = QStringLiteral("sender@example.com");
+    envelope.recipients = recipients;
+    return envelope;
+}
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+/// Reply Parser and Pipelining Tests
+class TestSmtpReply : public QObject
+{
+    Q_OBJECT
+
+// private slots
+private slots:
+    void parseSingleLine();
+    void parseMultiLine();
+    void parseIncremental();
+    void parsePipelined();
+    void parseMalformed_data();
+    void parseMalformed();
+    void classify();
+    void pipelinedReplies();
+    void pipelinedRecipientStatuses_data();
+    void pipelinedRecipientStatuses();
+};
+
+void TestSmtpReply::parseSingleLine()
+{
+    const QByteArray data = QByteArrayLiteral("250 2.1.0 Sender OK\r\n");
+    ReplyParser parser;
+    Reply reply;
+    int consumed = 0;
+    QCOMPARE(parser.parse(data.constData(), data.size(), reply, consumed), ReplyParser::ReplyComplete);
+    QCOMPARE(consumed, data.size());
+    QCOMPARE(reply.code, 250);
+    QCOMPARE(reply.enhancedCode.toByteArray(), QByteArray("2.1.0"));
+    QCOMPARE(reply.lines.size(), 1);
+    QCOMPARE(reply.text(), QByteArray("Sender OK"));
+    QCOMPARE(reply.severity(), ReplyPositive);
+}
+
+void TestSmtpReply::parseMultiLine()
+{
+    const QByteArray data = QByteArrayLiteral("250-mail.example.com\r\n250-PIPELINING\r\n250 SIZE 1024\r\n");
+    ReplyParser parser;
+    Reply reply;
+    int consumed = 0;
+    QCOMPARE(parser.parse(data.constData(), data.size(), reply, consumed), ReplyParser::ReplyComplete);
+    QCOMPARE(consumed, data.size());
+    QCOMPARE(reply.code, 250);
+    QVERIFY(!reply.enhancedCode.isValid());
+    QCOMPARE(reply.lines.size(), 3);
+    QCOMPARE(reply.lines.at(1).toByteArray(), QByteArray("PIPELINING"));
+    QCOMPARE(reply.text(), QByteArray("mail.example.com\nPIPELINING\nSIZE 1024"));
+}
+
+void TestSmtpReply::parseIncremental()
+{
+    // the reply comes byte by byte, the parser resuming over the same buffer
+    const QByteArray data = QByteArrayLiteral("451-4.3.0 Try\r\n451 4.3.0 again later\r\n");
+    ReplyParser parser;
+    Reply reply;
+    int consumed = 0;
+    QByteArray buffer;
+    for (int ix = 0; ix < data.size() - 1; ++ix) {
+        buffer += data.at(ix);
+        QCOMPARE(parser.parse(buffer.constData(), buffer.size(), reply, consumed), ReplyParser::ReplyIncomplete);
+    }
+    buffer += data.at(data.size() - 1);
+    QCOMPARE(parser.parse(buffer.constData(), buffer.size(), reply, consumed), ReplyParser::ReplyComplete);
+    QCOMPARE(consumed, data.size());
+    QCOMPARE(reply.code, 451);
+    QCOMPARE(reply.enhancedCode.toByteArray(), QByteArray("4.3.0"));
+    QCOMPARE(reply.text(), QByteArray("Try\nagain later"));
+    QCOMPARE(reply.severity(), ReplyTransient);
+}
+
+void TestSmtpReply::parsePipelined()
+{
+    // replies to pipelined commands, read at once and parsed one by one
+    const QByteArray data = QByteArrayLiteral(
+        "250 2.1.0 OK\r\n250 2.1.5 OK\r\n550 5.1.1 No such user\r\n354 Go ahead\r\n25");
+    const QList<int> expectedCodes { 250, 250, 550, 354 };
+    ReplyParser parser;
+    int offset = 0;
+    for (const int expectedCode : expectedCodes) {
+        Reply reply;
+        int consumed = 0;
+        QCOMPARE(parser.parse(data.constData() + offset, data.size() - offset, reply, consumed),
+            ReplyParser::ReplyComplete);
+        QCOMPARE(reply.code, expectedCode);
+        offset += consumed;
+    }
+    // the partial reply left is waiting for more data
+    Reply reply;
+    int consumed = 0;
+    QCOMPARE(parser.parse(data.constData() + offset, data.size() - offset, reply, consumed),
+        ReplyParser::ReplyIncomplete);
+    QCOMPARE(offset, data.size() - 2);
+}
+
+void TestSmtpReply::parseMalformed_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::newRow("no code") << QByteArray("Hello\r\n");
+    QTest::newRow("short code") << QByteArray("25\r\n");
+    QTest::newRow("bad separator") << QByteArray("250+OK\r\n");
+    QTest::newRow("mixed codes") << QByteArray("250-first\r\n251 second\r\n");
+}
+
+void TestSmtpReply::parseMalformed()
+{
+    QFETCH(QByteArray, data);
+    ReplyParser parser;
+    Reply reply;
+    int consumed = 0;
+    QCOMPARE(parser.parse(data.constData(), data.size(), reply, consumed), ReplyParser::ReplyMalformed);
+}
+
+void TestSmtpReply::classify()
+{
+    QCOMPARE(classifyReply(0), ReplyTransient);
+    QCOMPARE(classifyReply(354), ReplyPositive);
+    QCOMPARE(classifyReply(421), ReplyTransient);
+    QCOMPARE(classifyReply(550, { 5, 1, 1 }), ReplyPermanent);
+    QCOMPARE(classifyReply(552, { 5, 5, 3 }), ReplyTransient);
+    QCOMPARE(classifyReply(552, { 5, 3, 4 }), ReplyPermanent);
+}
+
+void TestSmtpReply::pipelinedReplies()
+{
+    ScriptedServer server;
+    server.injectReply("RCPT", 2, "550 5.1.1 No such user");
+    QVERIFY(server.start());
+
+    QTcpSocket socket;
+    socket.connectToHost(QHostAddress::LocalHost, server.port());
+    QVERIFY(socket.waitForConnected(5000));
+    QCOMPARE(pn_readReplies(socket, 1).value(0).code, 220);
+    socket.write("EHLO localhost\r\n");
+    const auto ehlo = pn_readReplies(socket, 1);
+    QCOMPARE(ehlo.size(), 1);
+    QCOMPARE(ehlo.at(0).code, 250);
+    QVERIFY(ehlo.at(0).text.split('\n').contains("PIPELINING"));
+
+    // the envelope is sent at once, the replies coming back in the command order
+    socket.write("MAIL FROM:<sender@example.com>\r\nRCPT TO:<first@example.com>\r\n"
+        "RCPT TO:<second@example.com>\r\nRCPT TO:<third@example.com>\r\nDATA\r\n");
+    const auto envelope = pn_readReplies(socket, 5);
+    QCOMPARE(envelope.size(), 5);
+    QCOMPARE(envelope.at(0).code, 250);
+    QCOMPARE(envelope.at(1).code, 250);
+    QCOMPARE(envelope.at(2).code, 550);
+    QCOMPARE(envelope.at(2).enhancedCode, QByteArray("5.1.1"));
+    QCOMPARE(envelope.at(2).text, QByteArray("No such user"));
+    QCOMPARE(envelope.at(3).code, 250);
+    QCOMPARE(envelope.at(4).code, 354);
+
+    // the data and the following commands, pipelined as well
+    socket.write("Subject: test\r\n\r\nbody\r\n.\r\nQUIT\r\n");
+    const auto data = pn_readReplies(socket, 2);
+    QCOMPARE(data.size(), 2);
+    QCOMPARE(data.at(0).code, 250);
+    QCOMPARE(data.at(1).code, 221);
+    QCOMPARE(server.acceptedMessages(), 1);
+}
+
+void TestSmtpReply::pipelinedRecipientStatuses_data()
+{
+    QTest::addColumn<bool>("pipelining");
+    QTest::newRow("pipelining") << true;
+    QTest::newRow("lock-step") << false;
+}
+
+void TestSmtpReply::pipelinedRecipientStatuses()
+{
+    QFETCH(bool, pipelining);
+    ScriptedServer server;
+    if (!pipelining)
+        server.setCapabilities(ScriptedServer::AllCapabilities & ~ScriptedServer::CapPipelining);
+    server.injectReply("RCPT", 2, "550 5.1.1 No such user");
+    QVERIFY(server.start());
+    Client client;
+    pn_setup(client, server);
+    QVERIFY(client.connectToServer());
+
+    // each reply is matched to its recipient, whether read afterwards or in lock-step
+    QBuffer data;
+    data.setData("Subject: test\r\n\r\nbody\r\n");
+    data.open(QIODevice::ReadOnly);
+    QVERIFY(!client.sendMessage(pn_envelope({ "first@example.com", "second@example.com",
+        "third@example.com" }), data));
+    const auto statuses = client.recipientStatuses();
+    QCOMPARE(statuses.size(), 3);
+    QCOMPARE(statuses.at(0).code, 0);
+    QCOMPARE(statuses.at(1).code, 550);
+    QCOMPARE(statuses.at(1).enhancedCode.toByteArray(), QByteArray("5.1.1"));
+    QCOMPARE(statuses.at(1).severity(), ReplyPermanent);
+    QCOMPARE(statuses.at(2).code, 0);
+
+    // the failure closed the session, a new one is in sync again
+    QVERIFY(!client.isOpen());
+    QVERIFY(client.connectToServer());
+    data.seek(0);
+    QVERIFY(client.sendMessage(pn_envelope({ "first@example.com", "third@example.com" }), data));
+    QCOMPARE(client.recipientStatuses().at(1).code, 250);
+    QCOMPARE(server.acceptedMessages(), 1);
+}
+
+QTEST_GUILESS_MAIN(TestSmtpReply)
+
+#include "tst_smtp_reply.moc"
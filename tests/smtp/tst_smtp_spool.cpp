@@ -0,0 +1,249 @@
+#include <QtTest>
+#include <QTemporaryDir>
+#include "utils/smtp/smtp_spool.h"
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Gets an envelope to the given recipient
+Envelope pn_envelope(const QString &recipient)
+{
+    Envelope envelope;
+    envelope.sender = QStringLiteral("sender@example.com");
+    envelope.recipients = QStringList { recipient };
+    return envelope;
+}
+
+// Gets the encoded data of the given message number
+QByteArray pn_data(int number)
+{
+    return "Subject: message " + QByteArray::number(number) + "\r\n\r\n"
+        + QByteArray(100 * number, char('a' + number % 26)) + "\r\n";
+}
+
+// Gets the encoded data of the given pending message
+QByteArray pn_readData(const Spool &spool, quint64 id)
+{
+    QScopedPointer<QIODevice> data (spool.openData(id));
+    return data.isNull()? QByteArray() : data->readAll();
+}
+
+// Gets the path of the last segment of the given directory
+QString pn_lastSegment(const QString &directory)
+{
+    const QDir dir (directory);
+    const QStringList segments = dir.entryList({ QStringLiteral("segment-*.log") }, QDir::Files, QDir::Name);
+    return segments.isEmpty()? QString() : dir.filePath(segments.last());
+}
+
+// Copies the files of the spool directory as they are on disk, as left by a crash
+bool pn_crashCopy(const QString &from, const QString &to)
+{
+    const QDir source (from);
+    for (const auto &name : source.entryList(QDir::Files)) {
+        if (!QFile::copy(source.filePath(name), QDir(to).filePath(name)))
+            return false;
+    }
+    return true;
+}
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+/// Spool Recovery Tests, of torn tails and crashes
+class TestSmtpSpool : public QObject
+{
+    Q_OBJECT
+
+// private slots
+private slots:
+    void reopen();
+    void crashRecovery();
+    void crashRecoveryFromIndex();
+    void tornTail_data();
+    void tornTail();
+    void corruptedTail();
+};
+
+void TestSmtpSpool::reopen()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    quint64 ids[3] = {};
+    {
+        Spool spool;
+        spool.setSyncBatch(1, 0);
+        QVERIFY(spool.open(dir.path()));
+        for (int ix = 0; ix < 3; ++ix)
+            ids[ix] = spool.enqueue(pn_envelope(QStringLiteral("r%1@example.com").arg(ix)), pn_data(ix), 1000 + ix);
+        QVERIFY(spool.complete(ids[1]));
+        QVERIFY(spool.defer(ids[2], 5000, 3));
+    }
+    // a clean close leaves an index, and nothing to replay after it
+    Spool spool;
+    QVERIFY(spool.open(dir.path()));
+    QCOMPARE(spool.count(), 2);
+    Spool::Entry entry;
+    QVERIFY(spool.entry(ids[0], entry));
+    QCOMPARE(entry.createdMsecs, qint64(1000));
+    QCOMPARE(entry.envelope.recipients, QStringList { "r0@example.com" });
+    QVERIFY(!spool.entry(ids[1], entry));
+    QVERIFY(spool.entry(ids[2], entry));
+    QCOMPARE(entry.attempts, 3);
+    QCOMPARE(entry.nextAttemptMsecs, qint64(5000));
+    QCOMPARE(pn_readData(spool, ids[2]), pn_data(2));
+    // ids are not reused
+    QVERIFY(spool.enqueue(pn_envelope(QStringLiteral("r3@example.com")), pn_data(3)) > ids[2]);
+}
+
+void TestSmtpSpool::crashRecovery()
+{
+    QTemporaryDir dir, crashDir;
+    QVERIFY(dir.isValid() && crashDir.isValid());
+    // synced records survive a crash, with no index written
+    Spool spool;
+    spool.setSyncBatch(1, 0);
+    QVERIFY(spool.open(dir.path()));
+    const quint64 first = spool.enqueue(pn_envelope(QStringLiteral("first@example.com")), pn_data(1));
+    const quint64 second = spool.enqueue(pn_envelope(QStringLiteral("second@example.com")), pn_data(2));
+    const quint64 third = spool.enqueue(pn_envelope(QStringLiteral("third@example.com")), pn_data(3));
+    QVERIFY(spool.complete(first));
+    QVERIFY(spool.defer(second, 7000, 2));
+    QVERIFY(spool.sync());
+    QVERIFY(pn_crashCopy(dir.path(), crashDir.path()));
+    QVERIFY(!QFile::exists(QDir(crashDir.path()).filePath("spool.index")));
+
+    Spool recovered;
+    QVERIFY(recovered.open(crashDir.path()));
+    QCOMPARE(recovered.count(), 2);
+    const auto pending = recovered.pending();
+    QCOMPARE(pending.size(), 2);
+    QCOMPARE(pending.at(0).id, second);
+    QCOMPARE(pending.at(0).attempts, 2);
+    QCOMPARE(pending.at(0).nextAttemptMsecs, qint64(7000));
+    QCOMPARE(pending.at(1).id, third);
+    QCOMPARE(pending.at(1).envelope.recipients, QStringList { "third@example.com" });
+    QCOMPARE(pn_readData(recovered, second), pn_data(2));
+    QCOMPARE(pn_readData(recovered, third), pn_data(3));
+}
+
+void TestSmtpSpool::crashRecoveryFromIndex()
+{
+    QTemporaryDir dir, crashDir;
+    QVERIFY(dir.isValid() && crashDir.isValid());
+    // the index is loaded, then the records appended after it are replayed
+    Spool spool;
+    spool.setSyncBatch(1, 0);
+    QVERIFY(spool.open(dir.path()));
+    const quint64 first = spool.enqueue(pn_envelope(QStringLiteral("first@example.com")), pn_data(1));
+    const quint64 second = spool.enqueue(pn_envelope(QStringLiteral("second@example.com")), pn_data(2));
+    QVERIFY(spool.checkpoint());
+    const quint64 third = spool.enqueue(pn_envelope(QStringLiteral("third@example.com")), pn_data(3));
+    QVERIFY(spool.complete(first));
+    QVERIFY(spool.defer(third, 9000));
+    QVERIFY(spool.sync());
+    QVERIFY(pn_crashCopy(dir.path(), crashDir.path()));
+
+    Spool recovered;
+    QVERIFY(recovered.open(crashDir.path()));
+    QCOMPARE(recovered.count(), 2);
+    Spool::Entry entry;
+    QVERIFY(!recovered.entry(first, entry));
+    QVERIFY(recovered.entry(second, entry));
+    QCOMPARE(entry.attempts, 0);
+    QVERIFY(recovered.entry(third, entry));
+    QCOMPARE(entry.attempts, 1);
+    QCOMPARE(entry.nextAttemptMsecs, qint64(9000));
+    QCOMPARE(pn_readData(recovered, second), pn_data(2));
+    QCOMPARE(pn_readData(recovered, third), pn_data(3));
+}
+
+void TestSmtpSpool::tornTail_data()
+{
+    QTest::addColumn<int>("tornBytes");
+    QTest::newRow("partial header") << 10;
+    QTest::newRow("partial payload") << 40;
+}
+
+void TestSmtpSpool::tornTail()
+{
+    QFETCH(int, tornBytes);
+    QTemporaryDir dir, crashDir;
+    QVERIFY(dir.isValid() && crashDir.isValid());
+    Spool spool;
+    spool.setSyncBatch(1, 0);
+    QVERIFY(spool.open(dir.path()));
+    const quint64 first = spool.enqueue(pn_envelope(QStringLiteral("first@example.com")), pn_data(1));
+    const quint64 second = spool.enqueue(pn_envelope(QStringLiteral("second@example.com")), pn_data(2));
+    QVERIFY(spool.sync());
+    QVERIFY(pn_crashCopy(dir.path(), crashDir.path()));
+
+    // the crash tore the write of a following record (its first bytes, copied from the segment start)
+    QFile segment (pn_lastSegment(crashDir.path()));
+    QVERIFY(segment.open(QIODevice::ReadWrite));
+    const qint64 validSize = segment.size();
+    const QByteArray torn = segment.read(tornBytes);
+    QVERIFY(segment.seek(validSize));
+    QCOMPARE(segment.write(torn), qint64(tornBytes));
+    segment.close();
+
+    // the torn tail is dropped, the valid records are kept
+    {
+        Spool recovered;
+        recovered.setSyncBatch(1, 0);
+        QVERIFY(recovered.open(crashDir.path()));
+        QCOMPARE(recovered.count(), 2);
+        QCOMPARE(QFileInfo(segment.fileName()).size(), validSize);
+        QCOMPARE(pn_readData(recovered, first), pn_data(1));
+        QCOMPARE(pn_readData(recovered, second), pn_data(2));
+        // appends follow the last valid record, thus survive the next crash as well
+        const quint64 third = recovered.enqueue(pn_envelope(QStringLiteral("third@example.com")), pn_data(3));
+        QVERIFY(third > second);
+        QVERIFY(recovered.sync());
+        QTemporaryDir secondCrashDir;
+        QVERIFY(pn_crashCopy(crashDir.path(), secondCrashDir.path()));
+        Spool again;
+        QVERIFY(again.open(secondCrashDir.path()));
+        QCOMPARE(again.count(), 3);
+        QCOMPARE(pn_readData(again, third), pn_data(3));
+    }
+}
+
+void TestSmtpSpool::corruptedTail()
+{
+    QTemporaryDir dir, crashDir;
+    QVERIFY(dir.isValid() && crashDir.isValid());
+    Spool spool;
+    spool.setSyncBatch(1, 0);
+    QVERIFY(spool.open(dir.path()));
+    const quint64 first = spool.enqueue(pn_envelope(QStringLiteral("first@example.com")), pn_data(1));
+    QVERIFY(spool.sync());
+    const qint64 validSize = QFileInfo(pn_lastSegment(dir.path())).size();
+    const quint64 second = spool.enqueue(pn_envelope(QStringLiteral("second@example.com")), pn_data(2));
+    QVERIFY(spool.sync());
+    QVERIFY(pn_crashCopy(dir.path(), crashDir.path()));
+
+    // the last record is complete but not the one written (e.g. a lost page), failing its crc
+    QFile segment (pn_lastSegment(crashDir.path()));
+    QVERIFY(segment.open(QIODevice::ReadWrite));
+    QVERIFY(segment.seek(segment.size() - 3));
+    QCOMPARE(segment.write("zzz"), qint64(3));
+    segment.close();
+
+    Spool recovered;
+    QVERIFY(recovered.open(crashDir.path()));
+    QCOMPARE(recovered.count(), 1);
+    Spool::Entry entry;
+    QVERIFY(recovered.entry(first, entry));
+    QVERIFY(!recovered.entry(second, entry));
+    QCOMPARE(QFileInfo(segment.fileName()).size(), validSize);
+    QCOMPARE(pn_readData(recovered, first), pn_data(1));
+}
+
+QTEST_GUILESS_MAIN(TestSmtpSpool)
+
+#include "tst_smtp_spool.moc"
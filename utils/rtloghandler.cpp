@@ -1,10 +1,13 @@
 #include "rtloghandler.h"
 
 #include <QMutexLocker>
+#include <QWaitCondition>
+#include <QAtomicPointer>
+#include <QThread>
 #include <QFile>
-#include <QFileInfo>
 #include <QLocale>
 #include <QDateTime>
+#include <QStringBuilder>
 #include <cstdio>
 #include <cstdlib>
 
@@ -16,93 +19,544 @@
 #define RTLOGHANDLER_LOGFILE "application-log.out"
 #endif
 
+#ifndef RTLOGHANDLER_ROTATION_SIZE
+#define RTLOGHANDLER_ROTATION_SIZE (2 * 1024 * 1024)
+#endif
+
+#ifndef RTLOGHANDLER_ROTATION_COUNT
+#define RTLOGHANDLER_ROTATION_COUNT 1
+#endif
+
+#ifndef RTLOGHANDLER_FLUSH_LEVEL
+#define RTLOGHANDLER_FLUSH_LEVEL RTLogHandler::Critical
+#endif
+
 // PRIVATE UTILITY NAMESPACE
 namespace {
 
 /// Gets the string-encoding for the given log-type
-QString toString(RTLogHandler::Type type)
+const char* toString(RTLogHandler::Type type)
 {
     switch (type) {
         case RTLogHandler::Debug: return "DEBUG";
         case RTLogHandler::Warning: return "WARNING";
         case RTLogHandler::Critical: return "CRITICAL";
         case RTLogHandler::Fatal: return "FATAL";
-        default: return QString(); // fallback
+        default: return ""; // fallback
     }
 }
 
-} // PRIVATE UTILITY NAMESPACE
+/// Format Emit-Step Kinds
+enum pn_StepKind { StepLiteral, StepType, StepDateTime, StepFile, StepLine, StepFnc, StepMsg };
+/// Format Emit-Step, literals referencing the format string
+struct pn_FormatStep
+{
+    pn_StepKind kind = StepLiteral;
+    int offset = 0;
+    int size = 0;
+};
+/// Max amount of steps of a format
+constexpr int pn_maxFormatSteps = 32;
+/// Format parsed into a fixed sequence of emit-steps
+struct pn_Format
+{
+    pn_FormatStep steps[pn_maxFormatSteps] = {};
+    int count = 0;
+};
+
+/// Checks whether the given text starts with the given prefix
+constexpr bool pn_startsWith(const char *text, const char *prefix)
+{
+    while (*prefix != '\0')
+        if (*text++ != *prefix++)
+            return false;
+    return true;
+}
+/// Appends a step to the format, counting it even when there is no room (to fail on check)
+constexpr void pn_appendStep(pn_Format &format, pn_StepKind kind, int offset, int size)
+{
+    if (format.count < pn_maxFormatSteps) {
+        format.steps[format.count].kind = kind;
+        format.steps[format.count].offset = offset;
+        format.steps[format.count].size = size;
+    }
+    ++format.count;
+}
+/// Parses the given format into emit-steps, at compile time
+/// \note Loops and local mutations within constexpr functions require C++14
+constexpr pn_Format pn_parseFormat(const char *text)
+{
+    // supported arguments
+    struct Argument { const char *name; int size; pn_StepKind kind; };
+    constexpr Argument arguments[] = {
+        { "%type", 5, StepType }, { "%datetime", 9, StepDateTime }, { "%file", 5, StepFile },
+        { "%line", 5, StepLine }, { "%fnc", 4, StepFnc }, { "%msg", 4, StepMsg }
+    };
+    // iterate over the format, splitting literals and arguments
+    pn_Format format;
+    int literalStart = 0;
+    int ix = 0;
+    while (text[ix] != '\0') {
+        // look for an argument here
+        bool matched = false;
+        if (text[ix] == '%') {
+            for (const auto &argument : arguments) {
+                if (pn_startsWith(text + ix, argument.name)) {
+                    if (ix > literalStart)
+                        pn_appendStep(format, StepLiteral, literalStart, ix - literalStart);
+                    pn_appendStep(format, argument.kind, 0, 0);
+                    ix += argument.size;
+                    literalStart = ix;
+                    matched = true;
+                    break;
+                }
+            }
+        }
+        if (!matched)
+            ++ix;
+    }
+    if (ix > literalStart)
+        pn_appendStep(format, StepLiteral, literalStart, ix - literalStart);
+    return format;
+}
+
+/// Log Format string, and its emit-steps
+constexpr char pn_formatText[] = RTLOGHANDLER_FORMAT;
+constexpr pn_Format pn_format = pn_parseFormat(pn_formatText);
+static_assert(pn_format.count <= pn_maxFormatSteps, "RTLOGHANDLER_FORMAT has too many arguments");
+
+/// Log Record, queued by the callers and formatted by the writer
+struct pn_LogRecord
+{
+    QAtomicPointer<pn_LogRecord> next;
+    CallContext context;
+    RTLogHandler::Type type = RTLogHandler::Debug;
+    qint64 timestamp = 0; ///< msecs since epoch
+    QString msg;
+    RTLogHandler::Arguments args;
+};
 
-/// Static Mutex Instance
-QMutex RTLogHandler::mutex;
+/// Gets the message with the "%N" placeholders substituted by the arguments, in a single pass
+/// \note Placeholders without a matching argument are kept as they are
+QString pn_substitute(const QString &msg, const RTLogHandler::Arguments &args)
+{
+    // fast return whether there is nothing to substitute
+    if (args.isEmpty())
+        return msg;
+    // compute the final size, for a single allocation
+    int size = msg.size();
+    for (const auto &arg : args)
+        size += arg.size();
+    QString result;
+    result.reserve(size);
+    // copy the message, substituting the placeholders
+    const QChar *cursor = msg.constData();
+    const QChar *end = cursor + msg.size();
+    const QChar *copyStart = cursor;
+    while (cursor < end) {
+        // look for a placeholder: '%' followed by digits
+        if (*cursor != QLatin1Char('%') || cursor + 1 == end || !cursor[1].isDigit()) {
+            ++cursor;
+            continue;
+        }
+        const QChar *digits = cursor + 1;
+        int index = 0;
+        while (digits < end && digits->isDigit() && index <= args.size())
+            index = index * 10 + digits++->digitValue();
+        // substitute it whether there is such an argument
+        if (index >= 1 && index <= args.size()) {
+            result.append(copyStart, int(cursor - copyStart));
+            result.append(args.at(index - 1));
+            copyStart = digits;
+        }
+        cursor = digits;
+    }
+    result.append(copyStart, int(end - copyStart));
+    return result;
+}
+
+/// Formats the given record, appending it to the given logs
+void pn_formatTo(QByteArray &logs, const pn_LogRecord &record)
+{
+    // run the format emit-steps
+    for (int ix = 0; ix < pn_format.count; ++ix) {
+        const pn_FormatStep &step = pn_format.steps[ix];
+        switch (step.kind) {
+        case StepLiteral: logs.append(pn_formatText + step.offset, step.size); break;
+        case StepType: logs.append(toString(record.type)); break;
+        case StepDateTime:
+            logs.append(QDateTime::fromMSecsSinceEpoch(record.timestamp).toString(Qt::ISODate).toLatin1());
+            break;
+        case StepFile: logs.append(record.context.file); break;
+        case StepLine: logs.append(QByteArray::number(record.context.line)); break;
+        case StepFnc: logs.append(record.context.fnc); break;
+        case StepMsg: logs.append(pn_substitute(record.msg, record.args).toUtf8()); break;
+        }
+    }
+}
+
+/// Log File, kept open with its size tracked in memory
+class pn_LogFile
+{
+public:
+    /// Sets the rotation size and the amount of backups to keep
+    void setRotation(qint64 maxSize, int backupCount)
+    {
+        d_rotationSize = maxSize;
+        d_rotationCount = qMax(backupCount, 0);
+    }
+    /// Appends the given logs, rotating the file whether they do not fit
+    void write(const QByteArray &logs)
+    {
+        // opens the file on first use, or after a failed rotation
+        if (!d_file.isOpen() && !open())
+            return;
+        // rotate it whether the logs do not fit
+        if (d_rotationSize > 0 && d_size > 0 && d_size + logs.size() > d_rotationSize) {
+            rotate();
+            if (!open())
+                return;
+        }
+        // append them, buffered
+        if (d_file.write(logs) > 0)
+            d_size += logs.size();
+    }
+    /// Flushes the buffered logs
+    void flush()
+    {
+        if (d_file.isOpen())
+            d_file.flush();
+    }
+
+private:
+    /// Opens the file for appending
+    bool open()
+    {
+        if (!d_file.open(QIODevice::Append | QIODevice::Text))
+            return false;
+        d_size = d_file.size();
+        return true;
+    }
+    /// Rotates the backups: log -> .bak -> .bak.2 -> ... -> .bak.N (removed)
+    void rotate()
+    {
+        d_file.close();
+        // without backups the log is just dropped
+        if (d_rotationCount == 0) {
+            QFile::remove(QStringLiteral(RTLOGHANDLER_LOGFILE));
+            return;
+        }
+        // shift the numbered backups, removing the oldest one
+        QFile::remove(backupName(d_rotationCount));
+        for (int index = d_rotationCount - 1; index >= 1; --index)
+            QFile::rename(backupName(index), backupName(index + 1));
+        // moves the log to the first backup
+        QFile::rename(QStringLiteral(RTLOGHANDLER_LOGFILE), backupName(1));
+    }
+    /// Gets the name of the given backup (1-based)
+    static QString backupName(int index)
+    {
+        const QString backup = QStringLiteral(RTLOGHANDLER_LOGFILE ".bak");
+        return (index == 1)? backup : backup + '.' + QString::number(index);
+    }
+
+private:
+    QFile d_file { QStringLiteral(RTLOGHANDLER_LOGFILE) };
+    qint64 d_size = 0;
+    qint64 d_rotationSize = RTLOGHANDLER_ROTATION_SIZE;
+    int d_rotationCount = RTLOGHANDLER_ROTATION_COUNT;
+};
+
+/// Output Mutex, serializing the writer batches and the synchronous writes
+QMutex pn_outputMutex;
+/// Log File, guarded by the output mutex
+pn_LogFile pn_logFile;
+
+/// Writes the formatted logs to the standard error stream and to the log file
+/// \note The log file is flushed only whether requested, otherwise logs are buffered
+void pn_write(const QByteArray &logs, bool flush)
+{
+    QMutexLocker locker (&pn_outputMutex);
+
+    // prints them to the standard error stream
+    fwrite(logs.constData(), 1, size_t(logs.size()), stderr);
+    fflush(stderr); // ensure it is flushed
+
+    // and finally appends them to the log file
+    pn_logFile.write(logs);
+    if (flush)
+        pn_logFile.flush();
+}
+/// Flushes the logs buffered into the log file
+void pn_flushOutput()
+{
+    QMutexLocker locker (&pn_outputMutex);
+    pn_logFile.flush();
+}
+
+/// Background Log Writer
+/// \note Records are pushed into an intrusive lock-free MPSC queue (Vyukov style): producers
+///     only exchange the queue head, while the writer thread consumes from the tail,
+///     formatting the available records and writing them as a single batch
+class pn_LogWriter : public QThread
+{
+public:
+    /// Starts the writer thread
+    pn_LogWriter() { start(); }
+    /// Stops the writer thread, writing all queued records
+    ~pn_LogWriter() override
+    {
+        // stop the thread
+        d_stopping.store(1);
+        wakeUp();
+        wait();
+        // write any record left
+        writeBatch();
+        pn_flushOutput();
+    }
+
+    /// Queues the given record, taking its ownership
+    void push(pn_LogRecord *record)
+    {
+        // count it first, so the writer will not sleep until it is written
+        d_pushed.fetchAndAddOrdered(1);
+        enqueue(record);
+        // wake the writer up only whether it is sleeping
+        if (d_sleeping.testAndSetOrdered(1, 0))
+            wakeUp();
+    }
+    /// Blocks until all records queued so far are written
+    void flush()
+    {
+        const quint64 target = d_pushed.load();
+        QMutexLocker locker (&d_mutex);
+        d_wakeUp.wakeOne();
+        while (d_written.load() < target && isRunning())
+            d_flushed.wait(&d_mutex, 100);
+    }
+
+protected:
+    /// Writer thread loop
+    void run() override
+    {
+        // forever
+        while (true) {
+            // write all available records
+            if (writeBatch() > 0)
+                continue;
+            // a producer may be in the middle of a push
+            if (d_written.load() != d_pushed.load()) {
+                QThread::yieldCurrentThread();
+                continue;
+            }
+            // stop whether requested
+            if (d_stopping.load())
+                return;
+            // going idle, flush the buffered logs
+            if (d_unflushed) {
+                pn_flushOutput();
+                d_unflushed = false;
+            }
+            // sleep until something is pushed
+            QMutexLocker locker (&d_mutex);
+            d_sleeping.store(1);
+            if (d_written.load() == d_pushed.load() && !d_stopping.load())
+                d_wakeUp.wait(&d_mutex, 1000);
+            d_sleeping.store(0);
+        }
+    }
+
+private:
+    /// Wakes the writer up
+    void wakeUp()
+    {
+        QMutexLocker locker (&d_mutex);
+        d_wakeUp.wakeOne();
+    }
+    /// Formats and writes all available records, returning their amount
+    int writeBatch()
+    {
+        // collect the formatted records
+        QByteArray batch;
+        int count = 0;
+        bool flush = false;
+        while (pn_LogRecord *record = dequeue()) {
+            pn_formatTo(batch, *record);
+            flush |= (record->type >= RTLOGHANDLER_FLUSH_LEVEL);
+            delete record;
+            ++count;
+        }
+        // fast return whether there is nothing to write
+        if (count == 0)
+            return 0;
+        // write them at once, flushing only for relevant levels
+        pn_write(batch, flush);
+        d_unflushed = !flush;
+        d_written.fetchAndAddOrdered(quint64(count));
+        // notify any waiting flush
+        QMutexLocker locker (&d_mutex);
+        d_flushed.wakeAll();
+        return count;
+    }
+    /// Links the record as the queue head (producers side)
+    void enqueue(pn_LogRecord *record)
+    {
+        record->next.store(nullptr);
+        pn_LogRecord *previous = d_head.fetchAndStoreOrdered(record);
+        previous->next.storeRelease(record);
+    }
+    /// Unlinks the record at the queue tail (writer side), nullptr whether none is available
+    pn_LogRecord* dequeue()
+    {
+        pn_LogRecord *tail = d_tail;
+        pn_LogRecord *next = tail->next.loadAcquire();
+        // skip the stub
+        if (tail == &d_stub) {
+            if (next == nullptr)
+                return nullptr;
+            d_tail = next;
+            tail = next;
+            next = next->next.loadAcquire();
+        }
+        // the tail has a successor, so it is complete
+        if (next != nullptr) {
+            d_tail = next;
+            return tail;
+        }
+        // a producer is linking a new head
+        if (tail != d_head.loadAcquire())
+            return nullptr;
+        // the tail is the last record, put the stub behind it
+        enqueue(&d_stub);
+        next = tail->next.loadAcquire();
+        if (next != nullptr) {
+            d_tail = next;
+            return tail;
+        }
+        return nullptr;
+    }
+
+private:
+    pn_LogRecord d_stub;
+    QAtomicPointer<pn_LogRecord> d_head { &d_stub };
+    pn_LogRecord *d_tail = &d_stub;
+    QAtomicInteger<quint64> d_pushed;
+    QAtomicInteger<quint64> d_written;
+    QAtomicInt d_sleeping;
+    QAtomicInt d_stopping;
+    bool d_unflushed = false; // whether the last batches were buffered, writer thread only
+    QMutex d_mutex;
+    QWaitCondition d_wakeUp;
+    QWaitCondition d_flushed;
+};
+
+/// Writer state: 0 never used, 1 alive, 2 destroyed (static destruction)
+QAtomicInt pn_writerState;
+
+/// Gets the writer, nullptr whether already destroyed
+pn_LogWriter* pn_writer()
+{
+    // fast return whether destroyed
+    if (pn_writerState.load() == 2)
+        return nullptr;
+    // allocated on first use, destroyed on exit
+    struct Holder
+    {
+        pn_LogWriter writer;
+        Holder() { pn_writerState.store(1); }
+        ~Holder() { pn_writerState.store(2); }
+    };
+    static Holder holder;
+    return &holder.writer;
+}
+
+} // PRIVATE UTILITY NAMESPACE
 
 RTLogHandler::RTLogHandler(
     const CallContext& context, Type type, const QString& msg)
     : context(context), type(type), msg(msg)
 {}
 
+/// Runtime Min Log-Type
+QAtomicInt RTLogHandler::minType (RTLOGHANDLER_MIN_LEVEL);
+
 RTLogHandler::~RTLogHandler()
 {
-    // starts locking shared mutex
-    QMutexLocker locker (&mutex);
-
-    // and then starts computing the final message
-    QString log (RTLOGHANDLER_FORMAT);
-    log.replace("%type", toString(type));
-    log.replace("%datetime", QDateTime::currentDateTime().toString(Qt::ISODate));
-    log.replace("%file", context.file);
-    log.replace("%line", QString::number(context.line));
-    log.replace("%fnc", context.fnc);
-    log.replace("%msg", msg);
-
-    // then prints it to the standard error stream
-    fprintf(stderr, "%s", qPrintable(log));
-    fflush(stderr); // ensure it is flushed
+    // fast return whether disabled (handlers built without the macros)
+    if (!isEnabled(type))
+        return;
+    // build the record to write
+    auto *record = new pn_LogRecord();
+    record->context = context;
+    record->type = type;
+    record->timestamp = QDateTime::currentMSecsSinceEpoch();
+    record->msg.swap(msg);
+    // swap the arguments one by one, no copy nor refcount (QVarLengthArray is not movable in Qt5)
+    record->args.resize(args.size());
+    for (int ix = 0; ix < args.size(); ++ix)
+        record->args[ix].swap(args[ix]);
 
-    // handles log rotation in order to avoid more than 4MB of logs
-    if (QFileInfo(RTLOGHANDLER_LOGFILE).size() > 2 * 1024 * 1024) {
-        // removes the old backup first
-        QFile(RTLOGHANDLER_LOGFILE ".bak").remove();
-        // moves the existing log to the backup destination
-        QFile(RTLOGHANDLER_LOGFILE).rename(RTLOGHANDLER_LOGFILE ".bak");
+    // non-fatal logs are just queued to the writer, whether still available
+    pn_LogWriter *writer = pn_writer();
+    if (type != Fatal && writer != nullptr) {
+        writer->push(record);
+        return;
     }
 
-    // and finally appends it to the log file
-    QFile logfile (RTLOGHANDLER_LOGFILE);
-    if (logfile.open(QIODevice::Append | QIODevice::Text)) {
-        logfile.write(log.toUtf8());
-        logfile.close();
-    }
+    // otherwise write it synchronously, after all the queued ones
+    if (writer != nullptr)
+        writer->flush();
+    QByteArray log;
+    pn_formatTo(log, *record);
+    pn_write(log, true);
+    delete record;
 
     // handles application abort for fatal error
     if (type == Fatal)
         std::abort();
 }
 
+void RTLogHandler::flush()
+{
+    if (pn_LogWriter *writer = pn_writer())
+        writer->flush();
+    pn_flushOutput();
+}
+
+void RTLogHandler::setMinLevel(Type type)
+{
+    minType.store(type);
+}
+
+void RTLogHandler::setLogRotation(qint64 maxFileSize, int backupCount)
+{
+    QMutexLocker locker (&pn_outputMutex);
+    pn_logFile.setRotation(maxFileSize, backupCount);
+}
+
 RTLogHandler& RTLogHandler::operator%(const QVariant& arg)
 {
     // handles QVariant translation for detailed content
-    QString type = (arg.isValid())? arg.typeName() : "Invalid";
-    QString log = QString("QVariant(%1, `%2`, null? %3)").arg(type,
-        arg.toString(), (arg.isNull())? "true" : "false");
-    // replace the next indexed argument with the given arg
-    msg.replace('%' + QString::number(++index), log);
+    args.append(QStringLiteral("QVariant(")
+        % QLatin1String((arg.isValid())? arg.typeName() : "Invalid")
+        % QStringLiteral(", `") % arg.toString() % QStringLiteral("`, null? ")
+        % QLatin1String((arg.isNull())? "true" : "false") % QLatin1Char(')'));
     // allows concatenations
     return *this;
 }
 
 RTLogHandler& RTLogHandler::operator%(const QString& arg)
 {
-    // replace the next indexed argument with the given arg
-    msg.replace('%' + QString::number(++index), arg);
+    // collect the next indexed argument
+    args.append(arg);
     // allows concatenations
     return *this;
 }
 
 RTLogHandler& RTLogHandler::operator%(const char *arg)
 {
-    // replace the next indexed argument with the given arg
-    msg.replace('%' + QString::number(++index), arg);
+    // collect the next indexed argument
+    args.append(QString::fromUtf8(arg));
     // allows concatenations
     return *this;
 }
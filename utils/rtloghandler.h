@@ -3,12 +3,18 @@
 
 #include <QVariant>
 #include <QString>
-#include <QMutex>
+#include <QAtomicInt>
+#include <QVarLengthArray>
 #include "utils/callcontext.h"
 
+#ifndef RTLOGHANDLER_MIN_LEVEL
+#define RTLOGHANDLER_MIN_LEVEL RTLogHandler::Debug
+#endif
+
 /// Real-Time Log-Handler Utility
 /// \note Use `#define RTLOGHANDLER_FORMAT "<custom-format>"`
-///     in order to have a custom formatted logging.
+///     in order to have a custom formatted logging, parsed at compile time (C++14 is required,
+///     the parser being a relaxed constexpr function).
 ///     Available Arguments:
 ///         > "%type": log-type (DEBUG, WARNING, ...)
 ///         > "%datetime": iso formatted date-time
@@ -18,6 +24,18 @@
 ///         > "%msg": log message
 /// \note Use `#define RTLOGHANDLER_LOGFILE "<custom-path>"`
 ///     in order to set a custom log-file path.
+/// \note Use `#define RTLOGHANDLER_ROTATION_SIZE <bytes>` and `RTLOGHANDLER_ROTATION_COUNT <n>`
+///     to set the log-file size which triggers the rotation and the amount of backups kept
+///     (".bak", ".bak.2", ...), as default 2MB and a single backup.
+/// \note The log-file is kept open and buffered: it is flushed for logs from
+///     `RTLOGHANDLER_FLUSH_LEVEL` on (as default Critical) and whenever the writer gets idle.
+/// \note Use `#define RTLOGHANDLER_MIN_LEVEL RTLogHandler::<Type>` (as a build flag, the same for
+///     all sources) to compile out the lower levels, `setMinLevel(..)` to filter them at runtime:
+///     filtered `RT_*` macros are a single branch, their arguments are never evaluated.
+/// \note Logs are queued without locking and written in batches by a background thread,
+///     Fatal logs flush the queue and are written synchronously before aborting.
+/// \note Arguments are collected as they come and substituted into the message in a single pass
+///     when the log is written: "%N" placeholders in arguments are never substituted.
 /// \example Usage example:
 ///     `RT_DEBUG("message: %1, %2") % arg1 % arg2;`
 class RTLogHandler
@@ -26,6 +44,8 @@ class RTLogHandler
 public:
     /// Enumerator for Log-Types
     enum Type { Debug, Warning, Critical, Fatal };
+    /// Collected Arguments, the first ones stored inline
+    typedef QVarLengthArray<QString, 8> Arguments;
 
 // construction
 public:
@@ -46,30 +66,55 @@ public:
     /// Argument-replacing specialization for const char *
     RTLogHandler& operator%(const char *arg);
 
+    /// Checks whether logs of the given type are enabled
+    static inline bool isEnabled(Type type)
+    {
+        return (type == Fatal)
+            || (type >= RTLOGHANDLER_MIN_LEVEL && type >= minType.load());
+    }
+    /// Sets the min type of the logs to write at runtime (Fatal logs are always written)
+    static void setMinLevel(Type type);
+
+    /// Blocks until all the logs queued so far are written
+    static void flush();
+    /// Sets the log-file size which triggers the rotation and the amount of backups to keep
+    /// \note A zero size disables the rotation, zero backups drop the log on rotation
+    static void setLogRotation(qint64 maxFileSize, int backupCount);
 
 // private members
 private:
-    // Thread-Safety Mutex
-    static QMutex mutex;
+    // Runtime Min Log-Type
+    static QAtomicInt minType;
     // Call Context
     CallContext context;
     // Log-Type
     Type type;
-    // Final Output Message
+    // Message, with the placeholders
     QString msg;
-    // Last Replaced Index
-    int index = 0;
+    // Arguments to substitute
+    Arguments args;
+};
+
+/// Ends a log expression as void, for the `RT_*` macros to be conditional expressions
+struct RTLogVoidify
+{
+    inline void operator&(const RTLogHandler&) const {}
 };
 
 /// Some useful MACROS to handle LOGGING
+/// \note The conditional form skips the handler and its `%` arguments whether the type is disabled
+///     (`%` binding tighter than `&`, the arguments belong to the enabled branch), still being an
+///     expression as a whole
+#define RT_LOG(type, msg) \
+    !RTLogHandler::isEnabled(type) ? (void)0 : RTLogVoidify() & RTLogHandler(CALL_CONTEXT, type, msg)
 #define RT_DEBUG(msg) \
-    RTLogHandler(CALL_CONTEXT, RTLogHandler::Debug, msg)
+    RT_LOG(RTLogHandler::Debug, msg)
 #define RT_WARNING(msg) \
-    RTLogHandler(CALL_CONTEXT, RTLogHandler::Warning, msg)
+    RT_LOG(RTLogHandler::Warning, msg)
 #define RT_CRITICAL(msg) \
-    RTLogHandler(CALL_CONTEXT, RTLogHandler::Critical, msg)
+    RT_LOG(RTLogHandler::Critical, msg)
 #define RT_FATAL(msg) \
-    RTLogHandler(CALL_CONTEXT, RTLogHandler::Fatal, msg)
+    RT_LOG(RTLogHandler::Fatal, msg)
 
 /// Some useful MACROS to handle ASSERTIONS
 #define RT_CHECK(cond) if(Q_UNLIKELY(!(cond))) RT_FATAL(#cond " condition failed!")
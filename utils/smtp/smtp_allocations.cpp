@@ -0,0 +1,389 @@
+#include "smtp_allocations.h"
+
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+
+#if defined(SMTP_ALLOCATION_PROFILING) && defined(__GLIBC__)
+#include <malloc.h>
+// glibc entry points, used by the interposed allocation functions
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void *ptr, size_t size);
+extern "C" void __libc_free(void *ptr);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+#include <cerrno>
+#endif
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Allocation Counters of a thread
+struct pn_ThreadAllocations
+{
+    quint64 allocations;
+    quint64 deallocations;
+    quint64 bytesAllocated;
+    qint64 liveBytes; // over the thread life, negative whether it frees memory of other threads
+    qint64 peakLiveBytes; // since the innermost scope start
+};
+// Counters of the current thread, constant-initialized so that no allocation is needed to access them
+#if defined(__GLIBC__)
+thread_local pn_ThreadAllocations pn_thread __attribute__((tls_model("initial-exec"))) = { 0, 0, 0, 0, 0 };
+#else
+thread_local pn_ThreadAllocations pn_thread = { 0, 0, 0, 0, 0 };
+#endif
+
+// Aggregated Allocations of an Operation
+struct pn_OperationTotals
+{
+    QAtomicInteger<quint64> calls;
+    QAtomicInteger<quint64> allocations;
+    QAtomicInteger<quint64> bytesAllocated;
+    QAtomicInteger<qint64> maxPeakLiveBytes;
+};
+pn_OperationTotals pn_totals[AllocationProfile::OperationCount];
+
+#ifdef SMTP_ALLOCATION_PROFILING
+
+// Counts an allocation of the current thread
+inline void pn_countAllocation(size_t size)
+{
+    auto &t = pn_thread;
+    ++t.allocations;
+    t.bytesAllocated += size;
+    t.liveBytes += qint64(size);
+    if (t.liveBytes > t.peakLiveBytes)
+        t.peakLiveBytes = t.liveBytes;
+}
+// Counts a deallocation of the current thread
+inline void pn_countDeallocation(size_t size)
+{
+    auto &t = pn_thread;
+    ++t.deallocations;
+    t.liveBytes -= qint64(size);
+}
+
+#ifdef __GLIBC__
+
+// Counting operator new implementation, returning nullptr on failure
+// \note Counted by the interposed malloc, as its usable size like any other block
+inline void* pn_allocate(size_t size)
+{
+    return malloc(size);
+}
+// Counting operator delete implementation
+inline void pn_deallocate(void *ptr)
+{
+    free(ptr);
+}
+// Counting aligned operator new implementation, returning nullptr on failure
+inline void* pn_allocateAligned(size_t size, size_t alignment)
+{
+    void *ptr = nullptr;
+    return (posix_memalign(&ptr, qMax(alignment, sizeof(void*)), size) == 0)? ptr : nullptr;
+}
+// Counting aligned operator delete implementation
+inline void pn_deallocateAligned(void *ptr)
+{
+    free(ptr);
+}
+
+#else
+
+// Size of the header keeping the size of the blocks allocated by operator new
+constexpr size_t pn_headerSize = alignof(std::max_align_t);
+
+// Counting operator new implementation, returning nullptr on failure
+// \note Counted as the requested size, kept into a header
+void* pn_allocate(size_t size)
+{
+    char *block = static_cast<char*>(std::malloc(size + pn_headerSize));
+    if (block == nullptr)
+        return nullptr;
+    *reinterpret_cast<size_t*>(block) = size;
+    pn_countAllocation(size);
+    return block + pn_headerSize;
+}
+// Counting operator delete implementation
+void pn_deallocate(void *ptr)
+{
+    if (ptr == nullptr)
+        return;
+    char *block = static_cast<char*>(ptr) - pn_headerSize;
+    pn_countDeallocation(*reinterpret_cast<size_t*>(block));
+    std::free(block);
+}
+// Counting aligned operator new implementation, returning nullptr on failure
+// \note Counted as the requested size, kept along with the block start before the aligned pointer
+void* pn_allocateAligned(size_t size, size_t alignment)
+{
+    constexpr size_t header = 2 * sizeof(void*);
+    char *block = static_cast<char*>(std::malloc(size + alignment - 1 + header));
+    if (block == nullptr)
+        return nullptr;
+    const quintptr start = (quintptr(block) + header + alignment - 1) & ~quintptr(alignment - 1);
+    void **ptr = reinterpret_cast<void**>(start);
+    ptr[-1] = block;
+    ptr[-2] = reinterpret_cast<void*>(size);
+    pn_countAllocation(size);
+    return ptr;
+}
+// Counting aligned operator delete implementation
+void pn_deallocateAligned(void *ptr)
+{
+    if (ptr == nullptr)
+        return;
+    void **header = static_cast<void**>(ptr);
+    pn_countDeallocation(reinterpret_cast<size_t>(header[-2]));
+    std::free(header[-1]);
+}
+
+#endif // __GLIBC__
+
+// Throwing operator new implementation
+void* pn_allocateOrThrow(size_t size)
+{
+    // retry through the new-handler, as the default operator new does
+    for (;;) {
+        if (void *ptr = pn_allocate(size))
+            return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+// Throwing aligned operator new implementation
+void* pn_allocateAlignedOrThrow(size_t size, size_t alignment)
+{
+    for (;;) {
+        if (void *ptr = pn_allocateAligned(size, alignment))
+            return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+#endif // SMTP_ALLOCATION_PROFILING
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+#ifdef SMTP_ALLOCATION_PROFILING
+
+// Counting global operator new/delete
+void* operator new(std::size_t size) { return pn_allocateOrThrow(size); }
+void* operator new[](std::size_t size) { return pn_allocateOrThrow(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return pn_allocate(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return pn_allocate(size); }
+void operator delete(void *ptr) noexcept { pn_deallocate(ptr); }
+void operator delete[](void *ptr) noexcept { pn_deallocate(ptr); }
+void operator delete(void *ptr, const std::nothrow_t&) noexcept { pn_deallocate(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t&) noexcept { pn_deallocate(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { pn_deallocate(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { pn_deallocate(ptr); }
+
+#ifdef __cpp_aligned_new
+// Counting over-aligned operator new/delete
+void* operator new(std::size_t size, std::align_val_t alignment)
+    { return pn_allocateAlignedOrThrow(size, size_t(alignment)); }
+void* operator new[](std::size_t size, std::align_val_t alignment)
+    { return pn_allocateAlignedOrThrow(size, size_t(alignment)); }
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+    { return pn_allocateAligned(size, size_t(alignment)); }
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+    { return pn_allocateAligned(size, size_t(alignment)); }
+void operator delete(void *ptr, std::align_val_t) noexcept { pn_deallocateAligned(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { pn_deallocateAligned(ptr); }
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t&) noexcept { pn_deallocateAligned(ptr); }
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t&) noexcept { pn_deallocateAligned(ptr); }
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept { pn_deallocateAligned(ptr); }
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept { pn_deallocateAligned(ptr); }
+#endif // __cpp_aligned_new
+
+#ifdef __GLIBC__
+// Counting malloc family, since Qt containers (QByteArray, QString, ...) allocate with malloc
+// \note Blocks are counted as their usable size, operator new blocks included
+extern "C" void* malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+    if (ptr != nullptr)
+        pn_countAllocation(malloc_usable_size(ptr));
+    return ptr;
+}
+extern "C" void* calloc(size_t count, size_t size)
+{
+    void *ptr = __libc_calloc(count, size);
+    if (ptr != nullptr)
+        pn_countAllocation(malloc_usable_size(ptr));
+    return ptr;
+}
+extern "C" void* realloc(void *ptr, size_t size)
+{
+    // a reallocation counts as a new allocation freeing the old one
+    const size_t oldSize = (ptr != nullptr)? malloc_usable_size(ptr) : 0;
+    void *newPtr = __libc_realloc(ptr, size);
+    if (newPtr == nullptr && size > 0)
+        return nullptr;
+    if (ptr != nullptr)
+        pn_countDeallocation(oldSize);
+    if (newPtr != nullptr)
+        pn_countAllocation(malloc_usable_size(newPtr));
+    return newPtr;
+}
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+    void *ptr = __libc_memalign(alignment, size);
+    if (ptr != nullptr)
+        pn_countAllocation(malloc_usable_size(ptr));
+    return ptr;
+}
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+extern "C" int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    // a power of two multiple of the pointer size
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    void *block = memalign(alignment, size);
+    if (block == nullptr)
+        return ENOMEM;
+    *ptr = block;
+    return 0;
+}
+extern "C" void free(void *ptr)
+{
+    if (ptr == nullptr)
+        return;
+    pn_countDeallocation(malloc_usable_size(ptr));
+    __libc_free(ptr);
+}
+#endif // __GLIBC__
+
+#endif // SMTP_ALLOCATION_PROFILING
+
+
+
+// AllocationProfile
+
+QAtomicInt AllocationProfile::enabled;
+
+void AllocationProfile::setEnabled(bool on)
+{
+    enabled.storeRelease(on? 1 : 0);
+}
+
+void AllocationProfile::record(Operation operation, const AllocationStats &stats)
+{
+    // fast return whether disabled or not an operation
+    if (!isEnabled() || operation <= NoOperation || operation >= OperationCount)
+        return;
+    auto &totals = pn_totals[operation];
+    totals.calls.fetchAndAddRelaxed(1);
+    totals.allocations.fetchAndAddRelaxed(stats.allocations);
+    totals.bytesAllocated.fetchAndAddRelaxed(stats.bytesAllocated);
+    // raise the max peak
+    qint64 peak = totals.maxPeakLiveBytes.load();
+    while (stats.peakLiveBytes > peak && !totals.maxPeakLiveBytes.testAndSetRelaxed(peak, stats.peakLiveBytes, peak)) {}
+}
+
+AllocationProfile::Totals AllocationProfile::totals(Operation operation)
+{
+    Totals totals;
+    if (operation <= NoOperation || operation >= OperationCount)
+        return totals;
+    const auto &source = pn_totals[operation];
+    totals.calls = source.calls.load();
+    totals.allocations = source.allocations.load();
+    totals.bytesAllocated = source.bytesAllocated.load();
+    totals.maxPeakLiveBytes = source.maxPeakLiveBytes.load();
+    return totals;
+}
+
+void AllocationProfile::reset()
+{
+    for (auto &totals : pn_totals) {
+        totals.calls.store(0);
+        totals.allocations.store(0);
+        totals.bytesAllocated.store(0);
+        totals.maxPeakLiveBytes.store(0);
+    }
+}
+
+QByteArray AllocationProfile::report()
+{
+    QByteArray out;
+    for (int ix = 0; ix < OperationCount; ++ix) {
+        const auto operation = static_cast<Operation>(ix);
+        const Totals t = totals(operation);
+        const double calls = double(qMax<quint64>(t.calls, 1));
+        out += QByteArray(operationName(operation))
+            + ": calls=" + QByteArray::number(t.calls)
+            + " allocations/call=" + QByteArray::number(double(t.allocations) / calls, 'f', 1)
+            + " bytes/call=" + QByteArray::number(double(t.bytesAllocated) / calls, 'f', 0)
+            + " max-peak-live-bytes=" + QByteArray::number(t.maxPeakLiveBytes) + '\n';
+    }
+    return out;
+}
+
+const char* AllocationProfile::operationName(Operation operation)
+{
+    switch (operation) {
+    case MessageWrite: return "MimeMessage::writeToDev";
+    case MessageSend: return "Client::sendMessage";
+    default: return "none";
+    }
+}
+
+
+
+// AllocationScope
+
+AllocationScope::AllocationScope(AllocationProfile::Operation operation)
+    : d_operation(operation),
+      d_allocations(pn_thread.allocations),
+      d_deallocations(pn_thread.deallocations),
+      d_bytesAllocated(pn_thread.bytesAllocated),
+      d_liveBytes(pn_thread.liveBytes),
+      d_outerPeak(pn_thread.peakLiveBytes)
+{
+    // restart tracking the peak from the current live bytes
+    pn_thread.peakLiveBytes = pn_thread.liveBytes;
+}
+
+AllocationScope::~AllocationScope()
+{
+    if (d_operation != AllocationProfile::NoOperation)
+        AllocationProfile::record(d_operation, stats());
+    // outer scopes see the inner peak as well
+    pn_thread.peakLiveBytes = qMax(d_outerPeak, pn_thread.peakLiveBytes);
+}
+
+bool AllocationScope::isAvailable()
+{
+#ifdef SMTP_ALLOCATION_PROFILING
+    return true;
+#else
+    return false;
+#endif
+}
+
+AllocationStats AllocationScope::stats() const
+{
+    AllocationStats stats;
+    stats.allocations = pn_thread.allocations - d_allocations;
+    stats.deallocations = pn_thread.deallocations - d_deallocations;
+    stats.bytesAllocated = pn_thread.bytesAllocated - d_bytesAllocated;
+    stats.peakLiveBytes = pn_thread.peakLiveBytes - d_liveBytes;
+    return stats;
+}
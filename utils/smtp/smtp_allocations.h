@@ -0,0 +1,124 @@
+#ifndef SMTP_ALLOCATIONS_H
+#define SMTP_ALLOCATIONS_H
+
+#include <QAtomicInteger>
+#include <QByteArray>
+
+/// Allocation Profiling Utility
+/// \note Use `#define SMTP_ALLOCATION_PROFILING` (as a build flag, the same for all sources)
+///     to install counting `operator new`/`delete` hooks (the aligned ones included, and the malloc
+///     family with glibc): allocations are then counted per thread, so that scopes measure their
+///     own thread only.
+/// \note With glibc all blocks are counted as their usable size, otherwise as the requested one.
+/// \note Without the build flag no hook is installed, scopes measure nothing and
+///     `SMTP_ALLOCATION_SCOPE(..)` compiles to nothing.
+/// \note The profiled operations (`MimeMessage::writeToDev()` and `Client::sendMessage()`)
+///     are aggregated into the `AllocationProfile` whether enabled at runtime.
+
+/// Opens an allocation scope profiling the given operation, until the end of the block
+#ifdef SMTP_ALLOCATION_PROFILING
+#define SMTP_ALLOCATION_SCOPE(operation) \
+    Smtp::AllocationScope allocationScope_ (Smtp::AllocationProfile::operation)
+#else
+#define SMTP_ALLOCATION_SCOPE(operation)
+#endif
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// Allocations of a Scope
+struct AllocationStats
+{
+    quint64 allocations = 0; ///< amount of allocations
+    quint64 deallocations = 0; ///< amount of deallocations
+    quint64 bytesAllocated = 0; ///< sum of the allocated sizes
+    qint64 peakLiveBytes = 0; ///< max amount of bytes allocated and not freed yet, over the scope start
+};
+
+
+
+/// Runtime Allocation Profile, aggregating the allocations of the profiled operations
+/// \note Aggregation is lock-free, thus the profile can be shared by all threads
+class AllocationProfile
+{
+// public definitions
+public:
+    /// Profiled Operations
+    enum Operation
+    {
+        NoOperation = -1,
+        MessageWrite, ///< MimeMessage::writeToDev()
+        MessageSend, ///< Client::sendMessage()
+        OperationCount
+    };
+    /// Aggregated Allocations of an Operation
+    struct Totals
+    {
+        quint64 calls = 0;
+        quint64 allocations = 0;
+        quint64 bytesAllocated = 0;
+        qint64 maxPeakLiveBytes = 0;
+    };
+
+// public interface
+public:
+    /// Enables the aggregation at runtime
+    /// \default As default disabled
+    static void setEnabled(bool on);
+    /// Checks whether the aggregation is enabled
+    static inline bool isEnabled() { return (enabled.loadAcquire() != 0); }
+
+    /// Aggregates the allocations of a call of the given operation
+    static void record(Operation operation, const AllocationStats &stats);
+    /// Gets the aggregated allocations of the given operation
+    static Totals totals(Operation operation);
+    /// Clears the aggregated allocations
+    static void reset();
+    /// Gets a readable report of the aggregated allocations, an operation per line
+    static QByteArray report();
+    /// Gets the operation name (e.g. "MimeMessage::writeToDev")
+    static const char* operationName(Operation operation);
+
+// private members
+private:
+    static QAtomicInt enabled;
+};
+
+
+
+/// Allocation Scope, measuring the allocations of the current thread over its life
+/// \note Scopes can be nested, each one measuring its own allocations (inner ones included)
+class AllocationScope
+{
+// construction
+public:
+    /// Starts measuring, aggregating into the profile the given operation (whether any) on destruction
+    explicit AllocationScope(AllocationProfile::Operation operation = AllocationProfile::NoOperation);
+    /// Stops measuring
+    ~AllocationScope();
+    /// Not copyable
+    AllocationScope(const AllocationScope&) = delete;
+    AllocationScope& operator=(const AllocationScope&) = delete;
+
+// public interface
+public:
+    /// Checks whether allocations are counted by the build
+    static bool isAvailable();
+    /// Gets the allocations measured so far
+    AllocationStats stats() const;
+
+// private members
+private:
+    AllocationProfile::Operation d_operation;
+    quint64 d_allocations;
+    quint64 d_deallocations;
+    quint64 d_bytesAllocated;
+    qint64 d_liveBytes;
+    qint64 d_outerPeak;
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_ALLOCATIONS_H
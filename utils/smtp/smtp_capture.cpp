@@ -0,0 +1,112 @@
+#include "smtp_capture.h"
+
+#include <cstring>
+
+// namespace usage
+using namespace Smtp;
+
+
+
+// TrafficCapture
+
+TrafficCapture::TrafficCapture(int capacity, int dataBudget)
+    : d_dataBudget(qMax(dataBudget, 0))
+{
+    setCapacity(capacity);
+}
+
+void TrafficCapture::setCapacity(int bytes)
+{
+    d_buffer = QByteArray(qMax(bytes, 0), '\0');
+    clear();
+}
+
+void TrafficCapture::record(Direction direction, const char *data, int size)
+{
+    // fast return whether disabled
+    if (!isEnabled())
+        return;
+    // a direction change breaks the current line
+    if (direction != d_direction && !d_atLineStart) {
+        append("\n", 1);
+        d_atLineStart = true;
+    }
+    d_direction = direction;
+    // iterate over all given data, line by line
+    const char *cursor = data;
+    const char *end = data + size;
+    while (cursor < end) {
+        // prefix each line with its direction
+        if (d_atLineStart) {
+            append((direction == ClientTraffic)? "C: " : "S: ", 3);
+            d_atLineStart = false;
+        }
+        // append the line, up to its line feed (included)
+        const auto *lineFeed = static_cast<const char*>(std::memchr(cursor, '\n', size_t(end - cursor)));
+        const char *lineEnd = (lineFeed != nullptr)? lineFeed + 1 : end;
+        append(cursor, int(lineEnd - cursor));
+        d_atLineStart = (lineFeed != nullptr);
+        cursor = lineEnd;
+    }
+}
+
+void TrafficCapture::beginData()
+{
+    d_dataRecorded = 0;
+    d_dataBytes = 0;
+}
+
+void TrafficCapture::endData()
+{
+    // fast return whether disabled or everything was recorded
+    if (!isEnabled() || d_dataBytes <= d_dataRecorded)
+        return;
+    // note the missing bytes
+    if (!d_atLineStart)
+        append("\n", 1);
+    const QByteArray note = "C: <" + QByteArray::number(d_dataBytes - d_dataRecorded)
+        + " bytes of message data not captured>\n";
+    append(note.constData(), note.size());
+    d_atLineStart = true;
+}
+
+QByteArray TrafficCapture::contents() const
+{
+    // not wrapped yet, the buffer is filled up to the head
+    if (!d_wrapped)
+        return d_buffer.left(d_head);
+    // otherwise the oldest data starts at the head
+    return d_buffer.mid(d_head) + d_buffer.left(d_head);
+}
+
+void TrafficCapture::clear()
+{
+    d_head = 0;
+    d_wrapped = false;
+    d_atLineStart = true;
+    d_direction = ClientTraffic;
+    d_dataRecorded = 0;
+    d_dataBytes = 0;
+}
+
+void TrafficCapture::append(const char *data, int size)
+{
+    const int capacity = d_buffer.size();
+    // only the last bytes fit whether the data is bigger than the buffer
+    if (size >= capacity) {
+        std::memcpy(d_buffer.data(), data + size - capacity, size_t(capacity));
+        d_head = 0;
+        d_wrapped = true;
+        return;
+    }
+    // copy up to the end of the buffer, and the rest at its beginning
+    char *buffer = d_buffer.data();
+    const int firstChunk = qMin(size, capacity - d_head);
+    std::memcpy(buffer + d_head, data, size_t(firstChunk));
+    std::memcpy(buffer, data + firstChunk, size_t(size - firstChunk));
+    d_head += size;
+    if (d_head >= capacity) {
+        d_head -= capacity;
+        d_wrapped = true;
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef SMTP_CAPTURE_H
+#define SMTP_CAPTURE_H
+
+#include <QByteArray>
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// Bounded SMTP Traffic Capture
+/// \note Traffic is recorded verbatim into a fixed-size ring buffer, each line prefixed by its
+///     direction ("C: " client, "S: " server), so the oldest traffic is overwritten first
+/// \note Message data is recorded only up to a byte budget per message, the rest is just counted
+/// \note Nothing is recorded (nor allocated) while the capacity is zero, which is the default
+class TrafficCapture
+{
+// public definitions
+public:
+    /// Traffic Directions
+    enum Direction
+    {
+        ClientTraffic,
+        ServerTraffic
+    };
+
+// construction
+public:
+    /// Builds a capture with the given ring buffer capacity and data budget (in bytes)
+    explicit TrafficCapture(int capacity = 0, int dataBudget = 1024);
+
+// public interface
+public:
+    /// Sets the ring buffer capacity, zero to disable the capture
+    /// \note The captured traffic is cleared
+    void setCapacity(int bytes);
+    /// Gets the ring buffer capacity
+    inline int capacity() const { return d_buffer.size(); }
+    /// Checks whether the capture is enabled
+    inline bool isEnabled() const { return !d_buffer.isEmpty(); }
+
+    /// Sets the max amount of message data bytes recorded per message
+    inline void setDataBudget(int bytes) { d_dataBudget = qMax(bytes, 0); }
+    /// Gets the max amount of message data bytes recorded per message
+    inline int dataBudget() const { return d_dataBudget; }
+
+    /// Records the given traffic
+    void record(Direction direction, const char *data, int size);
+
+    /// Starts recording a message data
+    void beginData();
+    /// Records the given message data, within the data budget
+    inline void recordData(const char *data, qint64 size)
+    {
+        // fast return whether disabled or out of budget
+        d_dataBytes += size;
+        if (d_dataRecorded >= d_dataBudget || !isEnabled())
+            return;
+        const int toRecord = int(qMin<qint64>(size, d_dataBudget - d_dataRecorded));
+        d_dataRecorded += toRecord;
+        record(ClientTraffic, data, toRecord);
+    }
+    /// Ends recording a message data, noting the amount of bytes which were not recorded
+    void endData();
+
+    /// Gets the captured traffic, oldest first
+    QByteArray contents() const;
+    /// Clears the captured traffic
+    void clear();
+
+// private interface
+private:
+    /// Appends the given bytes to the ring buffer
+    void append(const char *data, int size);
+
+// private members
+private:
+    QByteArray d_buffer;
+    int d_head = 0;
+    bool d_wrapped = false;
+    bool d_atLineStart = true;
+    Direction d_direction = ClientTraffic;
+    int d_dataBudget = 1024;
+    int d_dataRecorded = 0;
+    qint64 d_dataBytes = 0;
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_CAPTURE_H
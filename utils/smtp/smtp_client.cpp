@@ -1,11 +1,22 @@
 #include "smtp_client.h"
 
+#include <QElapsedTimer>
+#include <QHash>
 #include <QMessageAuthenticationCode>
 #include <QHostInfo>
+#include <QLocalSocket>
 #include <QStringBuilder>
-#include <QBuffer>
+#include "utils/smtp/smtp_allocations.h"
+#include "utils/smtp/smtp_datadevice.h"
+#include "utils/smtp/smtp_reply.h"
 #include "utils/rtloghandler.h"
 
+#ifdef Q_OS_LINUX
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
 // namespace usage
 using namespace Smtp;
 
@@ -28,14 +39,53 @@ struct Smtp::Client::PrivateData
     quint16 serverPort = 0;
     QString clientHost = QHostInfo::localHostName();
     ConnectionType connectionType = UnknownConnection;
+    Protocol protocol = SmtpProtocol;
     QString accountUsername, accountPassword;
     AuthMethod authMethod = AuthNone;
 
     int connectionTimout = 15000;
     int responseTimeout = 15000;
     int sendTimeout = 60000;
-    QTcpSocket *socket = nullptr;
+    QIODevice *device = nullptr; // stream the protocol is spoken over
+    QTcpSocket *socket = nullptr; // network connections only
+    QLocalSocket *localSocket = nullptr; // local connections only
     bool logSocketTraffic = false;
+    qint64 socketHighWaterMark = 1024 * 1024;
+
+    TransportFeatures transportFeatures = Transport8BitMime | TransportSmtpUtf8;
+    TransportFeatures serverFeatures = NoTransportFeatures;
+    QByteArrayList serverExtensions;
+    RecipientStatuses recipientStatuses; // statuses of the recipients of the last message
+
+    QByteArray txBuffer; // queued commands, written at once per protocol step
+    QByteArray rxBuffer; // received data, replies are parsed in place
+    int rxOffset = 0; // start of the data not consumed yet
+    ReplyParser replyParser;
+    TrafficCapture capture;
+    bool captureRedacted = false; // whether commands are captured redacted
+
+    QElapsedTimer phaseTimer; // started at the beginning of the current phase
+    SessionTimings timings;
+    SessionLatencies latencies;
+    SessionLatencies *sharedLatencies = nullptr;
+
+    // Metrics Instruments, registered on the registry
+    struct Metrics
+    {
+        MetricsRegistry *registry = nullptr;
+        MetricCounter *messagesSent = nullptr;
+        MetricCounter *bytesWritten = nullptr;
+        MetricCounter *commandsIssued = nullptr;
+        MetricCounter *connections = nullptr;
+        MetricCounter *connectionFailures = nullptr;
+        MetricCounter *reconnects = nullptr;
+        LatencyHistogram *phases[SessionTimings::PhaseCount] = {};
+        QHash<int, MetricCounter*> messagesFailed; // by reply code, zero for none, registered on use
+    } metrics;
+    bool hasConnected = false; // whether a connection was established before
+    int failureReplyCode = 0; // code of the unexpected reply which failed the transaction
+    EnhancedStatusCode failureEnhancedCode; // its enhanced code
+    int settledStatuses = 0; // leading recipient statuses carrying the final reply to the data
 };
 
 // PRIVATE UTILITY NAMESPACE
@@ -49,17 +99,50 @@ bool pn_fail(const QString &err, const CallContext &ctx)
     // fail
     return false;
 }
-// Tries closing the socket and fail
-bool pn_closeAndFail(Smtp::Client::PrivateData *d)
+// Closes the socket
+void pn_close(Smtp::Client::PrivateData *d)
 {
     // update the status as disconnected
     d->status = Smtp::Client::PrivateData::ST_Disconnected;
     // close the socket
-    d->socket->close();
+    d->device->close();
+    // drop any queued and received data
+    d->txBuffer.resize(0);
+    d->rxBuffer.resize(0);
+    d->rxOffset = 0;
+    d->replyParser.reset();
+    d->captureRedacted = false;
+}
+// Tries closing the socket and fail, logging the captured traffic
+bool pn_closeAndFail(Smtp::Client::PrivateData *d)
+{
+    // dump the traffic which lead to the failure
+    if (d->capture.isEnabled())
+        RT_WARNING("session failed, captured traffic:\n%1") % QString::fromUtf8(d->capture.contents());
+    // close the socket
+    pn_close(d);
     // fail
     return false;
 }
 
+// Record the duration of a session phase
+void pn_recordPhase(Smtp::Client::PrivateData *d, SessionTimings::Phase phase, qint64 nsecs)
+{
+    // record it into the session timings and the aggregated latencies
+    d->timings.addDuration(phase, nsecs);
+    d->latencies.record(phase, nsecs);
+    if (d->sharedLatencies != nullptr)
+        d->sharedLatencies->record(phase, nsecs);
+    if (d->metrics.registry != nullptr)
+        d->metrics.phases[phase]->recordNsecs(nsecs);
+}
+// End the current session phase, recording its duration, and start the next one
+void pn_endPhase(Smtp::Client::PrivateData *d, SessionTimings::Phase phase)
+{
+    pn_recordPhase(d, phase, d->phaseTimer.nsecsElapsed());
+    d->phaseTimer.start();
+}
+
 // Log socket traffic
 void pn_logTraffic(Smtp::Client::PrivateData *d, const QByteArray &who, const QByteArray &msg)
 {
@@ -75,22 +158,23 @@ bool pn_isAllowedToSend(Smtp::Client::PrivateData *d)
 {
     // before we write data, ensure there is nothing available to read
     // cause otherwise it will be read as response to this new message
-    if (d->socket->canReadLine()) {
-        // report such error
-        pn_fail("send fail, found unexpected data available to be read, was:", CALL_CONTEXT);
-        // extract all data from it
-        while (d->socket->canReadLine()) {
-            // extract the line and log it
-            pn_fail(QStringLiteral(" > msg-line: %1")
-                .arg(QString::fromUtf8(d->socket->readLine())), CALL_CONTEXT);
-        }
+    if (d->rxOffset < d->rxBuffer.size() || d->device->bytesAvailable() > 0) {
+        // report such error, extracting all data
+        pn_fail(QStringLiteral("send fail, found unexpected data available to be read, was: %1")
+            .arg(QString::fromUtf8(d->rxBuffer.mid(d->rxOffset) + d->device->readAll())), CALL_CONTEXT);
+        // drop it
+        d->rxBuffer.resize(0);
+        d->rxOffset = 0;
+        d->replyParser.reset();
         // fail
         return false;
     }
     // allowed
     return true;
 }
-// Send a message using the socket, ensuring there is no pending data to read
+// Queue a command to be sent, ensuring there is no pending data to read
+// \note Commands are written to the socket on the next flush, which happens before
+//     waiting for a reply, so all the commands of a protocol step share the same write
 bool pn_sendMessage(Smtp::Client::PrivateData *d, const QByteArray &data)
 {
     // validate send
@@ -98,88 +182,297 @@ bool pn_sendMessage(Smtp::Client::PrivateData *d, const QByteArray &data)
         return false;
     // optional log for traffic
     pn_logTraffic(d, "C", data);
-    // writes given data to the socket
-    d->socket->write(data % QByteArrayLiteral("\r\n"));
+    // queue given data, the buffer keeps its capacity across steps
+    const int commandStart = d->txBuffer.size();
+    d->txBuffer.append(data).append("\r\n", 2);
+    if (d->capture.isEnabled() && d->captureRedacted)
+        d->capture.record(TrafficCapture::ClientTraffic, "<redacted>\r\n", 12);
+    else if (d->capture.isEnabled())
+        d->capture.record(TrafficCapture::ClientTraffic,
+            d->txBuffer.constData() + commandStart, d->txBuffer.size() - commandStart);
+    if (d->metrics.registry != nullptr)
+        d->metrics.commandsIssued->increment();
+    // success
+    return true;
+}
+// Write all the queued commands to the socket
+bool pn_flushCommands(Smtp::Client::PrivateData *d)
+{
+    // fast return whether there is nothing to write
+    if (d->txBuffer.isEmpty())
+        return true;
+    // write all the commands at once, pushing them to the network right away
+    const auto written = d->device->write(d->txBuffer);
+    d->txBuffer.resize(0);
+    if (written < 0)
+        return pn_fail(QStringLiteral("unable to write commands, error: %1")
+            .arg(d->device->errorString()), CALL_CONTEXT);
+    if (d->metrics.registry != nullptr)
+        d->metrics.bytesWritten->increment(quint64(written));
+    if (d->socket != nullptr)
+        d->socket->flush();
+    else
+        d->localSocket->flush();
     // success
     return true;
 }
+// Hold back partial TCP segments while streaming the message data, or release them
+void pn_setCorked(Smtp::Client::PrivateData *d, bool corked)
+{
+    // fast return whether not a network connection
+    if (d->socket == nullptr)
+        return;
+#ifdef Q_OS_LINUX
+    // explicit corking, uncorking also pushes out the last partial segment
+    const int value = corked ? 1 : 0;
+    ::setsockopt(int(d->socket->socketDescriptor()), IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+#else
+    // elsewhere let Nagle's algorithm coalesce the data while streaming
+    d->socket->setSocketOption(QAbstractSocket::LowDelayOption, corked ? 0 : 1);
+#endif
+}
+// Copy all the data of the given device into the given writer
+bool pn_copyData(QIODevice &source, QIODevice &writer)
+{
+    char buffer[64 * 1024];
+    qint64 read = 0;
+    while ((read = source.read(buffer, sizeof(buffer))) > 0) {
+        if (writer.write(buffer, read) != read)
+            return false;
+    }
+    // success whether the data was read up to its end
+    return (read == 0);
+}
 // Send a message using the socket, ensuring there is no pending data to read
-bool pn_sendMessage(Smtp::Client::PrivateData *d, const Smtp::MimeMessage &msg)
+// \note The message is either encoded on the fly, or copied from the given encoded data
+bool pn_sendMessage(Smtp::Client::PrivateData *d,
+    const Smtp::MimeMessage *msg, QIODevice *encodedData, Smtp::TransportFeatures features)
 {
-    // validate send
-    if (!pn_isAllowedToSend(d))
+    // validate send and write any queued command first
+    if (!pn_isAllowedToSend(d) || !pn_flushCommands(d))
         return false;
 
-    // allocate a buffer to collect data to send
-    QByteArray dataToSend;
-    QBuffer writer (&dataToSend);
+    // full segments only while streaming the data
+    pn_setCorked(d, true);
+    // allocate the DATA stream writer, which streams the message directly into the socket
+    DataDevice writer (d->device);
+    writer.setHighWaterMark(d->socketHighWaterMark, d->sendTimeout);
+    // capture the data within the budget
+    if (d->capture.isEnabled()) {
+        d->capture.beginData();
+        writer.setCapture(&d->capture);
+    }
     // open it to write over it
-    writer.open(QBuffer::WriteOnly);
-    // write message to the buffer
-    if (!msg.writeToDev(writer))
-        return false;
+    writer.open(QIODevice::WriteOnly);
+    // write message and terminator to the socket
+    const bool written = ((msg != nullptr)? msg->writeToDev(writer, features) : pn_copyData(*encodedData, writer))
+        && writer.finish();
+    d->capture.endData();
+    if (!written) {
+        // release the segments
+        pn_setCorked(d, false);
+        // fail
+        return pn_fail(QStringLiteral("unable to write the message data, error: %1")
+            .arg(writer.errorString()), CALL_CONTEXT);
+    }
     // close the writer
     writer.close();
-
-    // optional log for traffic
-    pn_logTraffic(d, "C", dataToSend.toBase64());
-    // writes given data to the socket
-    d->socket->write(dataToSend);
+    // hand all the data to the network before releasing the last segment
+    QElapsedTimer drainTimer;
+    drainTimer.start();
+    while (d->device->bytesToWrite() > 0 && d->device->waitForBytesWritten(d->sendTimeout)) {}
+    pn_setCorked(d, false);
+
+    // the streaming time is split between the encoding and the waits on the socket
+    const qint64 transferNsecs = writer.waitedNsecs() + drainTimer.nsecsElapsed();
+    pn_recordPhase(d, SessionTimings::PhaseDataTransfer, transferNsecs);
+    pn_recordPhase(d, SessionTimings::PhaseDataEncoding, d->phaseTimer.nsecsElapsed() - transferNsecs);
+    d->phaseTimer.start();
+    if (d->metrics.registry != nullptr)
+        d->metrics.bytesWritten->increment(quint64(writer.forwardedBytes()));
+
+    // optional log for traffic, just summarizing the data
+    if (d->logSocketTraffic)
+        pn_logTraffic(d, "C", QByteArrayLiteral("<message data, ")
+            % QByteArray::number(writer.forwardedBytes()) % QByteArrayLiteral(" bytes>"));
     // success
     return true;
 }
 
-// Wait for a response with the given Code over the socket, returning the message body
-bool pn_waitForResponse(
-    Smtp::Client::PrivateData *d, const QByteArray &expectedCode, QByteArray &receivedMessageBody)
+// Read the next reply from the socket
+// \note Replies are parsed in place over the receive buffer, so pipelined replies received
+//     together are consumed one by one with no further reads
+// \warning The reply lines are valid until the next read
+bool pn_readReply(Smtp::Client::PrivateData *d, Reply &reply)
 {
-    // ensure the message body is empty
-    receivedMessageBody = QByteArray();
-
+    // the reply may be for a queued command
+    if (!pn_flushCommands(d))
+        return false;
     // forever
     while (true) {
-        // wait for something to read
-        if (!d->socket->waitForReadyRead(d->responseTimeout))
-            return pn_fail("unable to wait for server response, connection timout", CALL_CONTEXT);
-        // while there are lines to read
-        while (d->socket->canReadLine()) {
-            // read a full line
-            auto line = d->socket->readLine().trimmed();
+        // tries parsing a reply from the data not consumed yet
+        int consumed = 0;
+        const auto result = d->replyParser.parse(d->rxBuffer.constData() + d->rxOffset,
+            d->rxBuffer.size() - d->rxOffset, reply, consumed);
+        // handles a complete reply
+        if (result == ReplyParser::ReplyComplete) {
+            // capture it verbatim, then consume it
+            if (d->capture.isEnabled())
+                d->capture.record(TrafficCapture::ServerTraffic,
+                    d->rxBuffer.constData() + d->rxOffset, consumed);
+            d->rxOffset += consumed;
             // optional log for traffic
-            pn_logTraffic(d, "S", line);
-            // extract the code and the code-to-message separator
-            auto code = line.left(3); // first 3 bytes
-            auto codeToMsgSep = line.mid(3, 1); // 4th byte
-            // account the message with an empty separator only
-            if (codeToMsgSep == QByteArrayLiteral(" ")) {
-                // ensure the code is the expected one
-                if (code != expectedCode)
-                    return pn_fail(QStringLiteral("invalid response, expected %1, received: %2")
-                        .arg(QString::fromUtf8(expectedCode), QString::fromUtf8(line)), CALL_CONTEXT);
-                // valid response, fill the message body
-                receivedMessageBody = line.mid(4);
-                // success
-                return true;
-            }
+            if (d->logSocketTraffic)
+                for (const auto &line : reply.lines)
+                    pn_logTraffic(d, "S", QByteArray::number(reply.code) % ' ' % line.toByteArray());
+            // success
+            return true;
+        }
+        // handles a malformed reply
+        if (result == ReplyParser::ReplyMalformed)
+            return pn_fail(QStringLiteral("malformed server response, received: %1")
+                .arg(QString::fromUtf8(d->rxBuffer.mid(d->rxOffset))), CALL_CONTEXT);
+
+        // more data is required, drop the consumed data first (keeping the allocated capacity)
+        if (d->rxOffset > 0) {
+            d->rxBuffer.remove(0, d->rxOffset);
+            d->rxOffset = 0;
         }
+        // wait for something to read
+        if (d->device->bytesAvailable() <= 0 && !d->device->waitForReadyRead(d->responseTimeout))
+            return pn_fail("unable to wait for server response, connection timout", CALL_CONTEXT);
+        // append all available data to the receive buffer
+        const int previousSize = d->rxBuffer.size();
+        const auto available = int(d->device->bytesAvailable());
+        d->rxBuffer.resize(previousSize + available);
+        const auto read = d->device->read(d->rxBuffer.data() + previousSize, available);
+        d->rxBuffer.resize(previousSize + int(qMax<qint64>(read, 0)));
+    }
+}
+// Wait for a response with the given Code over the socket
+bool pn_waitForResponse(Smtp::Client::PrivateData *d, int expectedCode, Reply &reply)
+{
+    // read the next reply
+    if (!pn_readReply(d, reply))
+        return false;
+    // ensure the code is the expected one
+    if (reply.code != expectedCode) {
+        d->failureReplyCode = reply.code;
+        d->failureEnhancedCode = reply.enhancedCode;
+        return pn_fail(QStringLiteral("invalid response, expected %1, received: %2 %3")
+            .arg(expectedCode).arg(reply.code).arg(QString::fromUtf8(reply.text())), CALL_CONTEXT);
     }
+    // success
+    return true;
 }
-// Overloaded version to ignore the message body
-bool pn_waitForResponse(Smtp::Client::PrivateData *d, const QByteArray &expectedCode)
+// Overloaded version to ignore the reply content
+bool pn_waitForResponse(Smtp::Client::PrivateData *d, int expectedCode)
 {
-    // allocate the message body
-    QByteArray ignoredMsgBody;
+    // allocate the reply
+    Reply ignoredReply;
     // wait for the response
-    return pn_waitForResponse(d, expectedCode, ignoredMsgBody);
+    return pn_waitForResponse(d, expectedCode, ignoredReply);
+}
+
+// Send the EHLO (LHLO for LMTP) greeting and collect the extensions advertised by the server
+bool pn_sendEhlo(Smtp::Client::PrivateData *d)
+{
+    // send a EHLO message to the server
+    const QByteArray verb = (d->protocol == Smtp::Client::LmtpProtocol)?
+        QByteArrayLiteral("LHLO ") : QByteArrayLiteral("EHLO ");
+    if (!pn_sendMessage(d, verb % d->clientHost.toLatin1()))
+        return false;
+    // wait for the response, the first line is the server greeting
+    Reply reply;
+    if (!pn_waitForResponse(d, 250, reply))
+        return false;
+
+    // collect the extension keywords, upper-cased
+    d->serverExtensions.clear();
+    d->serverFeatures = NoTransportFeatures;
+    for (int ix = 1, max = reply.lines.size(); ix < max; ++ix)
+        d->serverExtensions.append(reply.lines.at(ix).toByteArray().toUpper());
+    // compute the supported transport features
+    // \note SMTPUTF8 headers are 8bit data, so they require 8BITMIME as well
+    if (d->serverExtensions.contains("8BITMIME")) {
+        d->serverFeatures |= Transport8BitMime;
+        if (d->serverExtensions.contains("SMTPUTF8"))
+            d->serverFeatures |= TransportSmtpUtf8;
+    }
+    // success
+    return true;
 }
 
 // Send a message and wait for the given response code
 inline bool pn_sendAndWaitFor(
-    Smtp::Client::PrivateData *d, const QByteArray &dataToSend, const QByteArray &expectedResCode)
+    Smtp::Client::PrivateData *d, const QByteArray &dataToSend, int expectedResCode)
 {
     // tries to send the given message and wait for the given response code
     return (pn_sendMessage(d, dataToSend) && pn_waitForResponse(d, expectedResCode));
 }
+// Wait for a response about a recipient (RCPT, or LMTP data), recording it into its status
+bool pn_waitForRecipientResponse(Smtp::Client::PrivateData *d, RecipientStatus &status)
+{
+    // wait for the response, recording it whatever the code
+    Reply reply;
+    const bool accepted = pn_waitForResponse(d, 250, reply);
+    if (reply.code != 0) {
+        status.code = reply.code;
+        status.enhancedCode = reply.enhancedCode;
+        status.text = reply.text();
+    }
+    return accepted;
+}
+
+// Clears the failure of the previous operation
+void pn_clearFailure(Smtp::Client::PrivateData *d)
+{
+    d->failureReplyCode = 0;
+    d->failureEnhancedCode = EnhancedStatusCode();
+}
+
+// Settles the statuses of the recipients the failed transaction did not deliver to
+// \note Recipients accepted by RCPT get the failure reply, or no reply (transient) whether
+//     the transaction failed because another recipient was rejected
+void pn_settleStatuses(Smtp::Client::PrivateData *d, bool sent)
+{
+    // fast return whether sent
+    if (sent)
+        return;
+    bool recipientRejected = false;
+    for (const auto &status : d->recipientStatuses)
+        recipientRejected = recipientRejected || (status.code != 0 && !status.isAccepted());
+    for (int ix = d->settledStatuses; ix < d->recipientStatuses.size(); ++ix) {
+        auto &status = d->recipientStatuses[ix];
+        if (status.code != 0 && !status.isAccepted())
+            continue;
+        status.code = recipientRejected? 0 : d->failureReplyCode;
+        status.enhancedCode = recipientRejected? EnhancedStatusCode() : d->failureEnhancedCode;
+        status.text.clear();
+    }
+}
+
+// Track the outcome of a message transaction into the metrics
+bool pn_trackOutcome(Smtp::Client::PrivateData *d, bool sent)
+{
+    // fast return whether metrics are disabled
+    if (d->metrics.registry == nullptr)
+        return sent;
+    if (sent) {
+        d->metrics.messagesSent->increment();
+    // failures by reply code, "none" for transport errors
+    } else {
+        MetricCounter *&failed = d->metrics.messagesFailed[d->failureReplyCode];
+        if (failed == nullptr) {
+            const QByteArray code = (d->failureReplyCode != 0)?
+                QByteArray::number(d->failureReplyCode) : QByteArrayLiteral("none");
+            failed = &d->metrics.registry->counter("smtp_messages_failed_total",
+                "Messages failed, by the unexpected reply code.", "code=\"" % code % '"');
+        }
+        failed->increment();
+    }
+    return sent;
+}
 
 } // PRIVATE UTILITY NAMESPACE
 
@@ -239,7 +532,7 @@ const QString& Client::clientHost() const
 void Client::setConnectionType(ConnectionType connectionType)
 {
     // ensure this is called once
-    RT_CHECK(d->socket == nullptr);
+    RT_CHECK(d->device == nullptr);
     // ensure the connection type is valid
     RT_CHECK(connectionType != UnknownConnection);
 
@@ -255,14 +548,21 @@ void Client::setConnectionType(ConnectionType connectionType)
     } else if (connectionType == SslConnection || connectionType == TlsConnection) {
         // builds the socket
         d->socket = new QSslSocket(this);
+
+    // Local connection
+    } else if (connectionType == LocalConnection) {
+        // builds the socket
+        d->localSocket = new QLocalSocket(this);
     }
+    // the protocol is spoken over either socket
+    d->device = (d->socket != nullptr)? static_cast<QIODevice*>(d->socket) : d->localSocket;
 }
 
 void Client::setConnectionType(
     ConnectionType connectionType, QSslSocket::PeerVerifyMode vmode, bool ignoreSslErrors)
 {
     // ensure this is called once
-    RT_CHECK(d->socket == nullptr);
+    RT_CHECK(d->device == nullptr);
     // ensure the connection type is valid
     RT_CHECK(connectionType != UnknownConnection);
 
@@ -283,7 +583,14 @@ void Client::setConnectionType(
         // setup the socket to igore errors according to args
         if (ignoreSslErrors)
             static_cast<QSslSocket*>(d->socket)->ignoreSslErrors();
+
+    // Local connection
+    } else if (connectionType == LocalConnection) {
+        // builds the socket
+        d->localSocket = new QLocalSocket(this);
     }
+    // the protocol is spoken over either socket
+    d->device = (d->socket != nullptr)? static_cast<QIODevice*>(d->socket) : d->localSocket;
 }
 
 Client::ConnectionType Client::connectionType() const
@@ -291,6 +598,20 @@ Client::ConnectionType Client::connectionType() const
     return d->connectionType;
 }
 
+void Client::setProtocol(Protocol protocol)
+{
+    // ensure the client is disconnected
+    if (d->status != PrivateData::ST_Disconnected)
+        return;
+    // update setting
+    d->protocol = protocol;
+}
+
+Client::Protocol Client::protocol() const
+{
+    return d->protocol;
+}
+
 void Client::setAccountUser(const QString &user)
 {
     // ensure the client is disconnected
@@ -385,21 +706,47 @@ int Client::sendTimeout() const
     return d->sendTimeout;
 }
 
+void Client::setTransportFeatures(TransportFeatures features)
+{
+    d->transportFeatures = features;
+}
+
+TransportFeatures Client::transportFeatures() const
+{
+    return d->transportFeatures;
+}
+
+TransportFeatures Client::serverTransportFeatures() const
+{
+    return d->serverFeatures;
+}
+
 void Client::setSocketTrafficLogEnabled(bool on)
 {
     d->logSocketTraffic = on;
 }
 
+void Client::setTrafficCapture(int bufferSize, int dataBudget)
+{
+    d->capture.setCapacity(bufferSize);
+    d->capture.setDataBudget(dataBudget);
+}
+
+QByteArray Client::capturedTraffic() const
+{
+    return d->capture.contents();
+}
+
 bool Client::connectToServer()
 {
     // ensure it is disconnected
     if (d->status != PrivateData::ST_Disconnected)
         return pn_fail("connection not allowed, client is already connected", CALL_CONTEXT);
     // ensure the connection type was set
-    if (d->socket == nullptr)
+    if (d->device == nullptr)
         return pn_fail("unable to connect, call setConnectionType first", CALL_CONTEXT);
-    // ensure server host and port were set
-    if (serverHost().isEmpty() || serverPort() == 0)
+    // ensure server host and port were set (the path only, for local connections)
+    if (serverHost().isEmpty() || (serverPort() == 0 && d->connectionType != LocalConnection))
         return pn_fail("unable to connect, missing server host / port", CALL_CONTEXT);
     // ensure client host was set
     if (clientHost().isEmpty())
@@ -408,32 +755,120 @@ bool Client::connectToServer()
     if (authMethod() != AuthNone && (accountUsername().isEmpty() || accountPassword().isEmpty()))
         return pn_fail("unable to connect, missing account credentials", CALL_CONTEXT);
 
-    // encrypted connection
-    if (d->connectionType == SslConnection) {
-        // tries connecting to the host
-        static_cast<QSslSocket*>(d->socket)->connectToHostEncrypted(serverHost(), serverPort());
-    // standard connection
-    } else {
-        // tries connecting to the host
-        d->socket->connectToHost(serverHost(), serverPort());
+    // a client connecting again after a previous session
+    if (d->hasConnected && d->metrics.registry != nullptr)
+        d->metrics.reconnects->increment();
+    // tries opening the session
+    pn_clearFailure(d);
+    if (!openSession()) {
+        if (d->metrics.registry != nullptr)
+            d->metrics.connectionFailures->increment();
+        return false;
+    }
+
+    // client is now connected
+    d->status = PrivateData::ST_Connected;
+    d->hasConnected = true;
+    if (d->metrics.registry != nullptr)
+        d->metrics.connections->increment();
+    // success
+    return true;
+}
+
+bool Client::openSession()
+{
+    // new session, new capture
+    d->capture.clear();
+    // start timing the session phases
+    d->timings.clear();
+    d->phaseTimer.start();
+
+    // local connections just connect to the socket path
+    if (d->connectionType == LocalConnection) {
+        d->localSocket->connectToServer(serverHost());
+        if (!d->localSocket->waitForConnected(connectionTimeout()))
+            return pn_fail(QStringLiteral("unable to connect to %1, error: %2")
+                .arg(serverHost(), d->localSocket->errorString()), CALL_CONTEXT);
+        pn_endPhase(d, SessionTimings::PhaseConnect);
+        return openProtocolSession();
     }
-    // wait for the socket to be connected
-    if (!d->socket->waitForConnected(connectionTimeout()))
+
+    // resolve the server host name, on its own to time it
+    const QHostInfo hostInfo = QHostInfo::fromName(serverHost());
+    if (hostInfo.error() != QHostInfo::NoError || hostInfo.addresses().isEmpty())
+        return pn_fail(QStringLiteral("unable to connect, cannot resolve host %1, error: %2")
+            .arg(serverHost(), hostInfo.errorString()), CALL_CONTEXT);
+    pn_endPhase(d, SessionTimings::PhaseDns);
+
+    // tries connecting to the resolved addresses in order, within the connection timeout
+    bool connected = false;
+    for (const auto &address : hostInfo.addresses()) {
+        // encrypted connection, verifying the peer against the host name
+        if (d->connectionType == SslConnection) {
+            static_cast<QSslSocket*>(d->socket)->connectToHostEncrypted(
+                address.toString(), serverPort(), serverHost());
+        // standard connection, STARTTLS verifying the peer against the host name as well
+        } else {
+            if (d->connectionType == TlsConnection)
+                static_cast<QSslSocket*>(d->socket)->setPeerVerifyName(serverHost());
+            d->socket->connectToHost(address, serverPort());
+        }
+        // wait for the socket to be connected
+        const int remainingTime = connectionTimeout() - int(d->phaseTimer.elapsed());
+        if (remainingTime > 0 && d->socket->waitForConnected(remainingTime)) {
+            connected = true;
+            break;
+        }
+        d->socket->abort();
+    }
+    if (!connected)
         return pn_fail(QStringLiteral("unable to connect, connection timeout with error: %1")
             .arg(d->socket->errorString()), CALL_CONTEXT);
+    pn_endPhase(d, SessionTimings::PhaseConnect);
+    // commands are coalesced per protocol step, so there is no reason to delay them
+    d->socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
+    // wait for the encrypted mode of SSL connections
+    if (d->connectionType == SslConnection) {
+        if (!static_cast<QSslSocket*>(d->socket)->waitForEncrypted(connectionTimeout())) {
+            // report the error
+            pn_fail(QStringLiteral("unable to establish the encrypted connection, error: %1")
+                .arg(d->socket->errorString()), CALL_CONTEXT);
+            // close and fail
+            return pn_closeAndFail(d);
+        }
+        pn_endPhase(d, SessionTimings::PhaseTlsHandshake);
+    }
+
+    // speak the protocol over the connection
+    return openProtocolSession();
+}
+
+bool Client::openProtocolSession()
+{
     // now wait for the server response
-    if (!pn_waitForResponse(d, "220"))
+    if (!pn_waitForResponse(d, 220))
         return pn_closeAndFail(d);
+    pn_endPhase(d, SessionTimings::PhaseGreeting);
 
-    // send a EHLO/HELO message to the server
-    if (!pn_sendAndWaitFor(d, QByteArrayLiteral("EHLO ") % clientHost().toLatin1(), "250"))
+    // send a EHLO message to the server
+    if (!pn_sendEhlo(d))
         return pn_closeAndFail(d);
+    pn_endPhase(d, SessionTimings::PhaseEhlo);
 
     // TLS connections now need to upgrato into encrypted
     if (d->connectionType == TlsConnection) {
         // send a request to start TLS handshake
-        if (!pn_sendAndWaitFor(d, QByteArrayLiteral("STARTTLS"), "220"))
+        if (!pn_sendAndWaitFor(d, QByteArrayLiteral("STARTTLS"), 220))
+            return pn_closeAndFail(d);
+        // plain text data received after the STARTTLS reply must never be read as encrypted
+        if (d->rxOffset < d->rxBuffer.size()) {
+            // report the error
+            pn_fail("unexpected data received after STARTTLS reply", CALL_CONTEXT);
+            // close and fail
             return pn_closeAndFail(d);
+        }
+        pn_endPhase(d, SessionTimings::PhaseStartTls);
         // tries to start encrypted connection
         static_cast<QSslSocket*>(d->socket)->startClientEncryption();
         // wait for encrypted mode
@@ -444,33 +879,37 @@ bool Client::connectToServer()
             // close and fail
             return pn_closeAndFail(d);
         }
+        pn_endPhase(d, SessionTimings::PhaseTlsHandshake);
 
-        // another EHLO for the encrypted mode
-        if (!pn_sendAndWaitFor(d, QByteArrayLiteral("EHLO ") % clientHost().toLatin1(), "250"))
+        // another EHLO for the encrypted mode, extensions may differ
+        if (!pn_sendEhlo(d))
             return pn_closeAndFail(d);
+        pn_endPhase(d, SessionTimings::PhaseEhlo);
     }
 
     // connection to the server succeeded, not try logging in
     // switching over the choosed authentication mode
+    // \note Credentials are never captured
+    d->captureRedacted = true;
 
     // AuthPlain
     if (authMethod() == AuthPlain) {
         // sending command: AUTH PLAIN base64('\0' + username + '\0' + password)
         auto encodedUserAndPswd = QString(QLatin1Char('\0') % accountUsername()
             % QLatin1Char('\0') + accountPassword()).toLatin1().toBase64();
-        if (!pn_sendAndWaitFor(d, QByteArrayLiteral("AUTH PLAIN ") % encodedUserAndPswd, "235"))
+        if (!pn_sendAndWaitFor(d, QByteArrayLiteral("AUTH PLAIN ") % encodedUserAndPswd, 235))
             return pn_closeAndFail(d);
 
     // AuthLogin
     } else if (authMethod() == AuthLogin) {
         // sending command: AUTH LOGIN
-        if (!pn_sendAndWaitFor(d, QByteArrayLiteral("AUTH LOGIN"), "334"))
+        if (!pn_sendAndWaitFor(d, QByteArrayLiteral("AUTH LOGIN"), 334))
             return pn_closeAndFail(d);
         // send the username as base-64 encoded
-        if (!pn_sendAndWaitFor(d, accountUsername().toLatin1().toBase64(), "334"))
+        if (!pn_sendAndWaitFor(d, accountUsername().toLatin1().toBase64(), 334))
             return pn_closeAndFail(d);
         // send the password as base-64 encoded
-        if (!pn_sendAndWaitFor(d, accountPassword().toUtf8().toBase64(), "235"))
+        if (!pn_sendAndWaitFor(d, accountPassword().toUtf8().toBase64(), 235))
             return pn_closeAndFail(d);
 
     // AuthCramMd5
@@ -479,9 +918,10 @@ bool Client::connectToServer()
         if (!pn_sendMessage(d, QByteArrayLiteral("AUTH CRAM-MD5")))
             return pn_closeAndFail(d);
         // wait for server ack, reading the message which will be the challenge value
-        QByteArray msgBody;
-        if (!pn_waitForResponse(d, "334", msgBody))
+        Reply challengeReply;
+        if (!pn_waitForResponse(d, 334, challengeReply) || challengeReply.lines.isEmpty())
             return pn_closeAndFail(d);
+        const QByteArray msgBody = challengeReply.lines.last().toByteArray();
         // compute the message autentication code
         QMessageAuthenticationCode authCode (QCryptographicHash::Md5);
         authCode.setKey(accountPassword().toLatin1());
@@ -489,27 +929,101 @@ bool Client::connectToServer()
         // compute authentication token to send: "<username> <auth-code>"
         QByteArray authToken = accountUsername().toLatin1() % ' ' % authCode.result().toHex();
         // send it as base-64 encoded
-        if (!pn_sendAndWaitFor(d, authToken.toBase64(), "235"))
+        if (!pn_sendAndWaitFor(d, authToken.toBase64(), 235))
             return pn_closeAndFail(d);
     }
+    d->captureRedacted = false;
+    if (authMethod() != AuthNone)
+        pn_endPhase(d, SessionTimings::PhaseAuth);
 
-    // client is now connected
-    d->status = PrivateData::ST_Connected;
     // success
     return true;
 }
 
+const SessionTimings& Client::lastTimings() const
+{
+    return d->timings;
+}
+
+const SessionLatencies& Client::latencies() const
+{
+    return d->latencies;
+}
+
+void Client::setSharedLatencies(SessionLatencies *latencies)
+{
+    d->sharedLatencies = latencies;
+}
+
+void Client::setMetricsRegistry(MetricsRegistry *registry)
+{
+    // reset all instruments
+    d->metrics = PrivateData::Metrics();
+    // fast return whether metrics are disabled
+    if (registry == nullptr)
+        return;
+    // register all instruments
+    d->metrics.registry = registry;
+    d->metrics.messagesSent = &registry->counter(
+        "smtp_messages_sent_total", "Messages accepted by the server.");
+    d->metrics.bytesWritten = &registry->counter(
+        "smtp_bytes_written_total", "Bytes written to the server, commands and message data.");
+    d->metrics.commandsIssued = &registry->counter(
+        "smtp_commands_total", "SMTP commands issued.");
+    d->metrics.connections = &registry->counter(
+        "smtp_connections_total", "Sessions opened, connected and authenticated.");
+    d->metrics.connectionFailures = &registry->counter(
+        "smtp_connection_failures_total", "Sessions failed to open.");
+    d->metrics.reconnects = &registry->counter(
+        "smtp_reconnects_total", "Sessions opened by clients connected before.");
+    for (int ix = 0; ix < SessionTimings::PhaseCount; ++ix)
+        d->metrics.phases[ix] = &registry->histogram("smtp_session_phase_seconds",
+            "Duration of the SMTP session phases.",
+            QByteArrayLiteral("phase=\"") % SessionTimings::phaseName(SessionTimings::Phase(ix)) % '"');
+}
+
 void Client::closeConnection()
 {
     // ensure the client is connected
     if (d->status != PrivateData::ST_Connected)
         return;
     // just close the connection resetting the status
-    pn_closeAndFail(d);
+    pn_close(d);
+}
+
+bool Client::open()
+{
+    return connectToServer();
+}
+
+void Client::close()
+{
+    closeConnection();
+}
+
+bool Client::isOpen() const
+{
+    return (d->status == PrivateData::ST_Connected);
+}
+
+const RecipientStatuses& Client::recipientStatuses() const
+{
+    return d->recipientStatuses;
+}
+
+int Client::lastFailureCode() const
+{
+    return d->failureReplyCode;
+}
+
+ReplySeverity Client::lastFailureSeverity() const
+{
+    return classifyReply(d->failureReplyCode, d->failureEnhancedCode);
 }
 
 bool Client::sendMessage(const MimeMessage &msg) const
 {
+    SMTP_ALLOCATION_SCOPE(MessageSend);
     // ensure the message is valid
     if (!msg.isValid())
         return pn_fail("unable to send, message is not valid", CALL_CONTEXT);
@@ -517,38 +1031,137 @@ bool Client::sendMessage(const MimeMessage &msg) const
     if (d->status != PrivateData::ST_Connected)
         return pn_fail("unable to send, client is not connected", CALL_CONTEXT);
 
-    // send the sender
-    auto senderMsg = QStringLiteral("MAIL FROM:<%1>").arg(msg.senderAddress().email()).toLatin1();
-    if (!pn_sendAndWaitFor(d, senderMsg, "250"))
-        return pn_closeAndFail(d);
-    // iterate over all "To" recipient
-    for (const auto &to : msg.toRecipients()) {
-        // compute the message
-        auto toMsg = QStringLiteral("RCPT TO:<%1>").arg(to.email()).toLatin1();
-        if (!pn_sendAndWaitFor(d, toMsg, "250"))
-            return pn_closeAndFail(d);
+    // computes the transport features to use: allowed and supported ones,
+    // using SMTPUTF8 only whether the message really needs it
+    const auto envelope = Envelope::fromMessage(msg, d->transportFeatures & d->serverFeatures);
+
+    // sends it, tracking the outcome
+    pn_clearFailure(d);
+    const bool sent = sendTransaction(envelope, &msg, nullptr);
+    pn_settleStatuses(d, sent);
+    return pn_trackOutcome(d, sent);
+}
+
+bool Client::sendMessage(const Envelope &envelope, QIODevice &encodedData) const
+{
+    // ensure the envelope is valid
+    if (envelope.sender.isEmpty() || envelope.recipients.isEmpty())
+        return pn_fail("unable to send, envelope is not valid", CALL_CONTEXT);
+    // the statuses are those of this message, whatever the outcome
+    d->recipientStatuses = envelope.pendingStatuses();
+    d->settledStatuses = 0;
+    pn_clearFailure(d);
+    // ensure the client is connected
+    if (d->status != PrivateData::ST_Connected)
+        return pn_fail("unable to send, client is not connected", CALL_CONTEXT);
+    // ensure the features required by the data are allowed and supported,
+    // failing permanently as the server would ("conversion required but not supported")
+    if ((envelope.features & d->transportFeatures & d->serverFeatures) != envelope.features) {
+        d->failureReplyCode = 554;
+        d->failureEnhancedCode = { 5, 6, 3 };
+        pn_settleStatuses(d, false);
+        return pn_fail("unable to send, the data requires transport features the server does not support",
+            CALL_CONTEXT);
     }
-    // iterate over all "Cc" recipient
-    for (const auto &cc : msg.ccRecipients()) {
+
+    // sends it, tracking the outcome
+    const bool sent = sendTransaction(envelope, nullptr, &encodedData);
+    pn_settleStatuses(d, sent);
+    return pn_trackOutcome(d, sent);
+}
+
+bool Client::sendTransaction(const Envelope &envelope, const MimeMessage *msg, QIODevice *encodedData) const
+{
+    const auto features = envelope.features;
+    const bool utf8 = features.testFlag(TransportSmtpUtf8);
+
+    // start timing the message phases
+    d->timings.clearSendPhases();
+    d->phaseTimer.start();
+    d->recipientStatuses = envelope.pendingStatuses();
+    d->settledStatuses = 0;
+
+    // send the sender, declaring the used transport features
+    QByteArray senderMsg = QByteArrayLiteral("MAIL FROM:<")
+        % (utf8 ? envelope.sender.toUtf8() : envelope.sender.toLatin1())
+        % '>';
+    if (features.testFlag(Transport8BitMime))
+        senderMsg += QByteArrayLiteral(" BODY=8BITMIME");
+    if (utf8)
+        senderMsg += QByteArrayLiteral(" SMTPUTF8");
+    // when the server supports it, the envelope and DATA commands are sent at once
+    // and their responses read afterwards, saving a round trip per command
+    const bool pipelining = d->serverExtensions.contains("PIPELINING");
+    if (!pn_sendMessage(d, senderMsg) || (!pipelining && !pn_waitForResponse(d, 250)))
+        return pn_closeAndFail(d);
+    // iterate over all "To" and "Cc" recipients, tracking their statuses
+    for (auto &status : d->recipientStatuses) {
         // compute the message
-        auto ccMsg = QStringLiteral("RCPT TO:<%1>").arg(cc.email()).toLatin1();
-        if (!pn_sendAndWaitFor(d, ccMsg, "250"))
+        QByteArray rcptMsg = QByteArrayLiteral("RCPT TO:<")
+            % (utf8 ? status.address.toUtf8() : status.address.toLatin1()) % '>';
+        if (!pn_sendMessage(d, rcptMsg) || (!pipelining && !pn_waitForRecipientResponse(d, status)))
             return pn_closeAndFail(d);
     }
 
     // data command to start sending the message
-    if (!pn_sendAndWaitFor(d, QByteArrayLiteral("DATA"), "354"))
+    if (!pn_sendMessage(d, QByteArrayLiteral("DATA")))
+        return pn_closeAndFail(d);
+    // read the pending envelope responses, in order
+    if (pipelining) {
+        if (!pn_waitForResponse(d, 250))
+            return pn_closeAndFail(d);
+        for (auto &status : d->recipientStatuses)
+            if (!pn_waitForRecipientResponse(d, status))
+                return pn_closeAndFail(d);
+    }
+    // wait for the server to accept the data
+    if (!pn_waitForResponse(d, 354))
         return pn_closeAndFail(d);
+    pn_endPhase(d, SessionTimings::PhaseEnvelope);
     // writes the mime-message to the socket
-    if (!pn_sendMessage(d, msg)) {
+    if (!pn_sendMessage(d, msg, encodedData, features)) {
         // report the error
         pn_fail("unexpected error, unable to write msg to socket", CALL_CONTEXT);
         // close and fail
         return pn_closeAndFail(d);
     }
-    // wait for the server ack
-    if (!pn_waitForResponse(d, "250"))
+
+    // LMTP replies once per recipient, each one accepted or rejected on its own
+    if (d->protocol == LmtpProtocol) {
+        int rejected = 0;
+        for (auto &status : d->recipientStatuses) {
+            Reply reply;
+            if (!pn_readReply(d, reply))
+                return pn_closeAndFail(d);
+            status.code = reply.code;
+            status.enhancedCode = reply.enhancedCode;
+            status.text = reply.text();
+            ++d->settledStatuses;
+            if (!status.isAccepted()) {
+                d->failureReplyCode = reply.code;
+                d->failureEnhancedCode = reply.enhancedCode;
+                ++rejected;
+            }
+        }
+        pn_endPhase(d, SessionTimings::PhaseDataAck);
+        // the session is still in sync, whatever the outcome
+        if (rejected > 0)
+            return pn_fail(QStringLiteral("message rejected for %1 of %2 recipients")
+                .arg(rejected).arg(d->recipientStatuses.size()), CALL_CONTEXT);
+        // success
+        return true;
+    }
+    // wait for the server ack, for all recipients
+    Reply dataReply;
+    if (!pn_waitForResponse(d, 250, dataReply))
         return pn_closeAndFail(d);
+    for (auto &status : d->recipientStatuses) {
+        status.code = dataReply.code;
+        status.enhancedCode = dataReply.enhancedCode;
+        status.text = dataReply.text();
+    }
+    d->settledStatuses = d->recipientStatuses.size();
+    pn_endPhase(d, SessionTimings::PhaseDataAck);
 
     // success
     return true;
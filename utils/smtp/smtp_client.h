@@ -3,7 +3,11 @@
 
 #include <QObject>
 #include <QSslSocket>
+#include "utils/smtp/smtp_capture.h"
 #include "utils/smtp/smtp_mime.h"
+#include "utils/smtp/smtp_metrics.h"
+#include "utils/smtp/smtp_timings.h"
+#include "utils/smtp/smtp_transport.h"
 #include "utils/macros.h"
 
 // > Smpt NS
@@ -11,7 +15,8 @@ namespace Smtp {
 
 
 /// Basic Client
-class Client : public QObject
+/// \note Speaks SMTP or LMTP, over TCP (plain, SSL or STARTTLS) or over a local socket
+class Client : public QObject, public Transport
 {
     Q_OBJECT
 
@@ -31,7 +36,14 @@ public:
         UnknownConnection,
         TcpConnection,
         SslConnection,
-        TlsConnection
+        TlsConnection,
+        LocalConnection ///< local (unix domain) socket, the server host being its path
+    };
+    /// Supported Protocols
+    enum Protocol
+    {
+        SmtpProtocol,
+        LmtpProtocol ///< LMTP, replying to the message data once per recipient
     };
 
 // construction
@@ -43,12 +55,13 @@ public:
 
 // public interface
 public:
-    /// Sets the server hostname
+    /// Sets the server hostname, or the socket path for local connections
     void setServerHost(const QString &host);
     /// Gets the server hostname
     const QString& serverHost() const;
 
     /// Sets the server port
+    /// \note Not used by local connections
     void setServerPort(quint16 port);
     /// Gets the server port
     quint16 serverPort() const;
@@ -69,6 +82,12 @@ public:
     /// Gets the used connection-type
     ConnectionType connectionType() const;
 
+    /// Sets the protocol to speak
+    /// \default As default SMTP
+    void setProtocol(Protocol protocol);
+    /// Gets the protocol to speak
+    Protocol protocol() const;
+
     /// Sets the username of the mail account
     /// \note Whether "AuthNone" this will set the AuthMode to "AuthPlain"
     void setAccountUser(const QString &user);
@@ -103,8 +122,36 @@ public:
     /// Gets the send timout interval
     int sendTimeout() const;
 
+    /// Sets the transport features the client is allowed to use, whether supported by the server
+    /// \default As default all features are allowed
+    void setTransportFeatures(TransportFeatures features);
+    /// Gets the transport features the client is allowed to use
+    TransportFeatures transportFeatures() const;
+    /// Gets the transport features supported by the server, as advertised on connection
+    TransportFeatures serverTransportFeatures() const;
+
     /// Enable/Disable Socket Traffic Log
     void setSocketTrafficLogEnabled(bool on);
+    /// Sets the traffic capture of each session, logged whether the session fails
+    /// \param bufferSize Size of the ring buffer keeping the latest traffic, zero to disable it
+    /// \param dataBudget Max amount of message data bytes captured per message
+    /// \default As default the capture is disabled
+    void setTrafficCapture(int bufferSize, int dataBudget = 1024);
+    /// Gets the traffic captured for the current (or last) session, oldest first
+    QByteArray capturedTraffic() const;
+
+    /// Gets the phase durations of the current connection and of the last sent message
+    const SessionTimings& lastTimings() const;
+    /// Gets the phase latencies aggregated over all the sessions of the client
+    const SessionLatencies& latencies() const;
+    /// Sets an additional aggregator of the phase latencies, to be shared by multiple clients
+    /// \note The aggregator is not owned and must outlive the client, nullptr to unset it
+    void setSharedLatencies(SessionLatencies *latencies);
+    /// Sets the metrics registry the client reports to (messages, bytes, commands, connections
+    ///     and session phase latencies), nullptr to disable metrics
+    /// \note The registry is not owned and must outlive the client
+    /// \default As default no metrics are reported
+    void setMetricsRegistry(MetricsRegistry *registry);
 
     /// Tries to connect and authenticate to the server
     /// \return True on success, False otherwise
@@ -113,12 +160,45 @@ public:
     /// Tries sending a mime-message
     /// \warning Whether an smtp protocol failure occur, the client will be disconnected
     ///     in order to avoid errors due to following misbehaving interactions
+    /// \note With LMTP the message may be accepted for part of the recipients only,
+    ///     in such case False is returned and the client stays connected
     /// \return True on success, False otherwise
-    bool sendMessage(const MimeMessage &msg) const;
+    bool sendMessage(const MimeMessage &msg) const override;
+    /// Tries sending an already encoded message, read from the given device up to its end
+    /// \note The data must not be dot-stuffed, and must require only the transport features
+    ///     declared by the envelope (failing whether not supported by the server)
+    /// \warning As for mime-messages, a protocol failure disconnects the client
+    /// \return True on success, False otherwise
+    bool sendMessage(const Envelope &envelope, QIODevice &encodedData) const;
+    /// Gets the status of each recipient of the last sent message
+    /// \note Whether the message failed, recipients not delivered to carry the failure reply,
+    ///     or no reply at all (transient) whether not attempted because of another recipient
+    const RecipientStatuses& recipientStatuses() const override;
+    /// Gets the code of the unexpected reply which failed the last connection or message,
+    ///     zero whether none (ex: connection failures, timeouts)
+    int lastFailureCode() const;
+    /// Gets the severity of the last failure, telling whether retrying later is worth it
+    /// \note Failures with no reply (ex: timeouts) are transient, as are 421 and 451
+    ReplySeverity lastFailureSeverity() const;
     /// Closes the open connection (if any)
     /// \note Whether connected, the client will disconnect itself on destruction
     void closeConnection();
 
+    /// Transport interface, as connectToServer() and closeConnection()
+    bool open() override;
+    void close() override;
+    bool isOpen() const override;
+
+// private interface
+private:
+    /// Connects, upgrades to encrypted mode and authenticates, the client being validated already
+    bool openSession();
+    /// Greets the server and authenticates, the client being connected (and encrypted whether SSL)
+    bool openProtocolSession();
+    /// Sends the message transaction, the client being connected and the envelope valid
+    /// \note The data is either the given message (encoded on the fly), or the encoded one
+    bool sendTransaction(const Envelope &envelope, const MimeMessage *msg, QIODevice *encodedData) const;
+
 // private members
 private:
     PRIVATE_DATA_PTR(d)
@@ -0,0 +1,147 @@
+#include "smtp_concurrency.h"
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <cmath>
+#include "utils/smtp/smtp_metrics.h"
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Weight of a new latency sample into the smoothed latency
+constexpr double pn_latencySmoothing = 0.2;
+// Weight of the smoothed latency into the baseline, whether above it
+constexpr double pn_baselineDrift = 0.01;
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+// ConcurrencyLimiter
+
+struct Smtp::ConcurrencyLimiter::PrivateData
+{
+    mutable QMutex mutex;
+    Settings settings;
+    double window = 2.0; // fractional limit
+    int inFlight = 0;
+    double smoothedLatency = -1.0; // nsecs, negative whether no sample yet
+    double baselineLatency = -1.0; // nsecs, negative whether no sample yet
+    QElapsedTimer lastDecrease; // invalid whether never decreased
+    MetricGauge *limitGauge = nullptr;
+    MetricGauge *inFlightGauge = nullptr;
+
+    // Gets the current limit
+    inline int limit() const
+    {
+        return qBound(settings.minLimit, int(std::floor(window)), settings.maxLimit);
+    }
+    // Shrinks the window, once per cooldown
+    void decrease()
+    {
+        if (lastDecrease.isValid() && lastDecrease.elapsed() < settings.cooldown)
+            return;
+        window = qMax(double(settings.minLimit), window * settings.decrease);
+        lastDecrease.start();
+    }
+    // Reports the gauges, whether any
+    void report()
+    {
+        if (limitGauge == nullptr)
+            return;
+        limitGauge->set(limit());
+        inFlightGauge->set(inFlight);
+    }
+};
+
+ConcurrencyLimiter::ConcurrencyLimiter(const Settings &settings)
+    : d(new PrivateData())
+{
+    d->settings = settings;
+    d->settings.minLimit = qMax(settings.minLimit, 1);
+    d->settings.maxLimit = qMax(settings.maxLimit, d->settings.minLimit);
+    d->window = qBound(d->settings.minLimit, settings.initialLimit, d->settings.maxLimit);
+}
+
+ConcurrencyLimiter::~ConcurrencyLimiter()
+{
+    // free resources
+    delete d;
+}
+
+const ConcurrencyLimiter::Settings& ConcurrencyLimiter::settings() const
+{
+    return d->settings;
+}
+
+void ConcurrencyLimiter::setMetricsRegistry(MetricsRegistry *registry, const QByteArray &labels)
+{
+    QMutexLocker locker (&d->mutex);
+    d->limitGauge = nullptr;
+    d->inFlightGauge = nullptr;
+    // fast return whether metrics are disabled
+    if (registry == nullptr)
+        return;
+    d->limitGauge = &registry->gauge("smtp_concurrency_limit",
+        "Concurrent message transactions allowed by the adaptive limiter.", labels);
+    d->inFlightGauge = &registry->gauge("smtp_concurrency_in_flight",
+        "Message transactions in flight.", labels);
+    d->report();
+}
+
+bool ConcurrencyLimiter::tryAcquire()
+{
+    QMutexLocker locker (&d->mutex);
+    if (d->inFlight >= d->limit())
+        return false;
+    ++d->inFlight;
+    d->report();
+    return true;
+}
+
+void ConcurrencyLimiter::release(Outcome outcome, qint64 latencyNsecs)
+{
+    QMutexLocker locker (&d->mutex);
+    d->inFlight = qMax(d->inFlight - 1, 0);
+    if (outcome == Throttled) {
+        d->decrease();
+    } else if (outcome == Accepted) {
+        // a latency rising beyond the tolerance is congestion as well
+        bool congested = false;
+        if (latencyNsecs >= 0) {
+            d->smoothedLatency = (d->smoothedLatency < 0.0)? double(latencyNsecs)
+                : d->smoothedLatency + pn_latencySmoothing * (double(latencyNsecs) - d->smoothedLatency);
+            d->baselineLatency = (d->baselineLatency < 0.0 || d->smoothedLatency < d->baselineLatency)?
+                d->smoothedLatency : d->baselineLatency + pn_baselineDrift * (d->smoothedLatency - d->baselineLatency);
+            congested = (d->smoothedLatency > d->baselineLatency * d->settings.latencyTolerance);
+        }
+        if (congested)
+            d->decrease();
+        else
+            d->window = qMin(double(d->settings.maxLimit), d->window + d->settings.increase / d->window);
+    }
+    d->report();
+}
+
+int ConcurrencyLimiter::limit() const
+{
+    QMutexLocker locker (&d->mutex);
+    return d->limit();
+}
+
+int ConcurrencyLimiter::inFlight() const
+{
+    QMutexLocker locker (&d->mutex);
+    return d->inFlight;
+}
+
+bool ConcurrencyLimiter::isThrottling(int code, const EnhancedStatusCode &enhancedCode)
+{
+    // service not available, local error in processing, or a transient policy rejection
+    return (code == 421 || code == 451)
+        || (code / 100 == 4 && enhancedCode.statusClass == 4 && enhancedCode.subject == 7);
+}
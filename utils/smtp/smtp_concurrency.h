@@ -0,0 +1,85 @@
+#ifndef SMTP_CONCURRENCY_H
+#define SMTP_CONCURRENCY_H
+
+#include <QByteArray>
+#include "utils/smtp/smtp_reply.h"
+#include "utils/macros.h"
+
+// > Smtp NS
+namespace Smtp {
+
+// fwd declarations
+class MetricsRegistry;
+
+
+/// Adaptive Concurrency Limiter of a destination, as AIMD (additive increase, multiplicative decrease)
+/// \note Each accepted message widens the limit by `increase / limit`, so by `increase` per full window,
+///     while throttling replies (421, 451, 4.7.x) or a latency beyond `latencyTolerance` times its
+///     baseline shrink it by `decrease`, once per `cooldown` msecs at most
+/// \note The latency baseline is the lowest smoothed latency, drifting slowly towards the current one
+/// \note Thread-safe
+class ConcurrencyLimiter
+{
+// public definitions
+public:
+    /// Limiter Settings
+    struct Settings
+    {
+        int minLimit = 1;
+        int maxLimit = 32;
+        int initialLimit = 2;
+        double increase = 1.0; ///< limit growth per window of accepted messages
+        double decrease = 0.5; ///< limit factor on congestion
+        double latencyTolerance = 2.0; ///< smoothed over baseline latency ratio taken as congestion
+        int cooldown = 1000; ///< min msecs between decreases, one congestion cutting once
+    };
+    /// Outcomes of a Message Transaction
+    enum Outcome
+    {
+        Accepted, ///< accepted by the server, its latency being meaningful
+        Throttled, ///< rejected or dropped because of the server load
+        Ignored ///< failed for other reasons (e.g. permanent rejections), not affecting the limit
+    };
+
+// construction
+public:
+    /// Builds a limiter with the given settings
+    explicit ConcurrencyLimiter(const Settings &settings = Settings());
+    /// Dtor
+    ~ConcurrencyLimiter();
+    /// Not copyable
+    Q_DISABLE_COPY(ConcurrencyLimiter)
+
+// public interface
+public:
+    /// Gets the settings
+    const Settings& settings() const;
+    /// Reports the limit and the messages in flight as gauges of the given registry, labeled with
+    ///     the given labels (nullptr to disable them)
+    /// \note The registry is not owned and must outlive the limiter
+    void setMetricsRegistry(MetricsRegistry *registry, const QByteArray &labels);
+
+    /// Tries starting a message transaction, whether the limit allows it
+    /// \return True on success (to be released), False whether at the limit
+    bool tryAcquire();
+    /// Ends a message transaction, adapting the limit to its outcome
+    /// \param latencyNsecs Duration of an accepted transaction, negative whether unknown
+    void release(Outcome outcome, qint64 latencyNsecs = -1);
+
+    /// Gets the current limit
+    int limit() const;
+    /// Gets the amount of transactions in flight
+    int inFlight() const;
+
+    /// Checks whether the given reply tells the server is throttling the client
+    static bool isThrottling(int code, const EnhancedStatusCode &enhancedCode = EnhancedStatusCode());
+
+// private members
+private:
+    PRIVATE_DATA_PTR(d)
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_CONCURRENCY_H
@@ -0,0 +1,118 @@
+#include "smtp_datadevice.h"
+#include "smtp_capture.h"
+
+#include <QElapsedTimer>
+#include <cstring>
+
+// namespace usage
+using namespace Smtp;
+
+
+
+// DataDevice
+
+DataDevice::DataDevice(QIODevice *target, QObject *parent)
+    : QIODevice(parent), d_target(target) {}
+
+DataDevice::~DataDevice() = default;
+
+void DataDevice::setHighWaterMark(qint64 bytes, int waitTimeout)
+{
+    d_highWaterMark = bytes;
+    d_waitTimeout = waitTimeout;
+}
+
+bool DataDevice::finish()
+{
+    // whether the data does not end with a line break, close the last line
+    if (d_lastByte != '\n' && !forward("\r\n", 2))
+        return false;
+    // writes the terminator
+    if (!forward(".\r\n", 3))
+        return false;
+    // reset the state for further messages
+    d_atLineStart = true;
+    d_lastByte = '\n';
+    // success
+    return true;
+}
+
+qint64 DataDevice::readData(char *data, qint64 maxSize)
+{
+    Q_UNUSED(data)
+    Q_UNUSED(maxSize)
+    // not supported
+    return -1;
+}
+
+qint64 DataDevice::writeData(const char *data, qint64 size)
+{
+    // iterate over all given data, line by line
+    const char *cursor = data;
+    const char *end = data + size;
+    while (cursor < end) {
+        // handles dot-stuffing at the beginning of lines
+        if (d_atLineStart) {
+            if (*cursor == '.' && !forward(".", 1))
+                return -1;
+            d_atLineStart = false;
+        }
+        // look for the end of the current line
+        const auto *lineFeed = static_cast<const char*>(std::memchr(cursor, '\n', size_t(end - cursor)));
+        // whether the line does not end here, forward everything
+        if (lineFeed == nullptr) {
+            if (!forward(cursor, end - cursor))
+                return -1;
+            d_lastByte = *(end - 1);
+            break;
+        }
+        // forward the line content, followed by a CRLF line break
+        const char previousByte = (lineFeed > cursor)? *(lineFeed - 1) : d_lastByte;
+        if (lineFeed > cursor && !forward(cursor, lineFeed - cursor))
+            return -1;
+        if (previousByte == '\r') {
+            if (!forward("\n", 1))
+                return -1;
+        } else {
+            if (!forward("\r\n", 2))
+                return -1;
+        }
+        // move to the next line
+        d_lastByte = '\n';
+        d_atLineStart = true;
+        cursor = lineFeed + 1;
+    }
+    // all data consumed
+    return size;
+}
+
+bool DataDevice::forward(const char *data, qint64 size)
+{
+    // ensure there is a target
+    if (d_target == nullptr) {
+        setErrorString(QStringLiteral("no target device"));
+        return false;
+    }
+    // writes the data
+    if (d_target->write(data, size) != size) {
+        setErrorString(d_target->errorString());
+        return false;
+    }
+    d_forwardedBytes += size;
+    if (d_capture != nullptr)
+        d_capture->recordData(data, size);
+    // whether the target buffered too much, wait for it to write some data
+    if (d_highWaterMark > 0 && d_target->bytesToWrite() > d_highWaterMark) {
+        QElapsedTimer waitTimer;
+        waitTimer.start();
+        do {
+            if (!d_target->waitForBytesWritten(d_waitTimeout)) {
+                setErrorString(d_target->errorString());
+                return false;
+            }
+        } while (d_target->bytesToWrite() > d_highWaterMark);
+        d_waitedNsecs += waitTimer.nsecsElapsed();
+    }
+    // success
+    return true;
+}
@@ -0,0 +1,77 @@
+#ifndef SMTP_DATADEVICE_H
+#define SMTP_DATADEVICE_H
+
+#include <QIODevice>
+
+// > Smtp NS
+namespace Smtp {
+
+class TrafficCapture;
+
+
+/// Write-Only Device Adaptor for the SMTP DATA stream
+/// \note Data written into this device is forwarded to the target device as it comes,
+///     doubling the dots at the beginning of lines (dot-stuffing) and converting bare LF
+///     line breaks into CRLF, without buffering the whole message
+/// \note Call `finish()` once the whole message has been written, to append the terminator
+class DataDevice : public QIODevice
+{
+    Q_OBJECT
+
+// construction
+public:
+    /// Builds the adaptor writing into the given target device
+    explicit DataDevice(QIODevice *target, QObject *parent = nullptr);
+    /// Dtor
+    ~DataDevice() override;
+
+// public interface
+public:
+    /// Sets the max amount of bytes the target may buffer before waiting for them to be written
+    /// \note Use it with sockets, to avoid collecting the whole message into the socket buffer
+    /// \param waitTimeout Timeout (in msecs) for the target to write its buffered bytes
+    void setHighWaterMark(qint64 bytes, int waitTimeout);
+
+    /// Sets the capture recording the forwarded data, nullptr for none
+    inline void setCapture(TrafficCapture *capture) { d_capture = capture; }
+
+    /// Gets the amount of bytes written into the target so far
+    inline qint64 forwardedBytes() const { return d_forwardedBytes; }
+    /// Gets the time spent waiting for the target to write its buffered bytes, in nanoseconds
+    inline qint64 waitedNsecs() const { return d_waitedNsecs; }
+
+    /// Writes the end-of-data terminator, ensuring the data ends with a line break
+    /// \return True on success, False otherwise
+    bool finish();
+
+    /// Sequential device
+    bool isSequential() const override { return true; }
+
+// protected interface
+protected:
+    /// Reading is not supported
+    qint64 readData(char *data, qint64 maxSize) override;
+    /// Filters and forwards the given data into the target
+    qint64 writeData(const char *data, qint64 size) override;
+
+// private interface
+private:
+    /// Forwards the given bytes into the target, applying the flow control
+    bool forward(const char *data, qint64 size);
+
+// private members
+private:
+    QIODevice *d_target = nullptr;
+    TrafficCapture *d_capture = nullptr;
+    qint64 d_highWaterMark = 0;
+    int d_waitTimeout = 0;
+    qint64 d_forwardedBytes = 0;
+    qint64 d_waitedNsecs = 0;
+    bool d_atLineStart = true;
+    char d_lastByte = '\n';
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_DATADEVICE_H
@@ -0,0 +1,398 @@
+#include "smtp_dispatcher.h"
+
+#include <QDateTime>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QScopedPointer>
+#include "utils/smtp/smtp_client.h"
+#include "utils/smtp/smtp_pool.h"
+#include "utils/smtp/smtp_ratelimit.h"
+#include "utils/smtp/smtp_spool.h"
+#include "utils/rtloghandler.h"
+
+// namespace usage
+using namespace Smtp;
+
+// Dispatcher
+
+struct Smtp::Dispatcher::PrivateData
+{
+    Spool *spool = nullptr;
+    Client *client = nullptr; // whether sending through a single client
+    SessionPool *pool = nullptr; // whether sending through a session pool
+    RetryPolicy policy;
+    qint64 hostBackoff = 30 * 1000;
+    int batchSize = 100;
+    RateLimiter *rateLimiter = nullptr;
+
+    // shared with the pool workers
+    mutable QMutex mutex;
+    RetryWheel wheel;
+    quint64 lastSpooledId = 0; // last spooled message scheduled
+    qint64 hostBackoffUntil = 0; // msecs since epoch the server is backed off until
+    Stats stats;
+};
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Counts into the given statistic
+inline void pn_count(Smtp::Dispatcher::PrivateData *d, qint64 Dispatcher::Stats::*counter)
+{
+    QMutexLocker locker (&d->mutex);
+    ++(d->stats.*counter);
+}
+
+// Schedules the messages spooled since the last round, at their next attempt
+// \note The ones already scheduled (respooled by a pool worker) keep their schedule, being
+//     possibly in flight meanwhile
+void pn_scheduleSpooled(Smtp::Dispatcher::PrivateData *d)
+{
+    QMutexLocker locker (&d->mutex);
+    for (const auto &entry : d->spool->pendingAfter(d->lastSpooledId)) {
+        if (!d->wheel.contains(entry.id))
+            d->wheel.schedule(entry.id, entry.nextAttemptMsecs);
+        d->lastSpooledId = entry.id;
+    }
+}
+
+// Schedules the given due messages, from the given one on, at the given time
+void pn_reschedule(Smtp::Dispatcher::PrivateData *d, const QList<quint64> &due, int from, qint64 dueMsecs)
+{
+    QMutexLocker locker (&d->mutex);
+    for (int ix = from; ix < due.size(); ++ix)
+        d->wheel.schedule(due.at(ix), dueMsecs);
+}
+
+// Backs the server off, the given due messages (from the given one on) waiting for it
+// with no attempt counted
+void pn_backOffHost(Smtp::Dispatcher::PrivateData *d, const Client &client,
+    const QList<quint64> &due, int from, qint64 nowMsecs)
+{
+    RT_WARNING("dispatcher: server unavailable (reply %1), delaying %2 messages")
+        % QString::number(client.lastFailureCode()) % QString::number(due.size() - from);
+    {
+        QMutexLocker locker (&d->mutex);
+        d->hostBackoffUntil = qMax(d->hostBackoffUntil, nowMsecs + d->hostBackoff);
+        ++d->stats.hostBackoffs;
+    }
+    pn_reschedule(d, due, from, nowMsecs + d->hostBackoff);
+}
+
+// Checks whether the client lost its session because of the server (421, or no reply)
+inline bool pn_isHostUnavailable(const Client &client)
+{
+    const int failureCode = client.lastFailureCode();
+    return !client.isOpen() && (failureCode == 421 || failureCode == 0);
+}
+
+// Gets the msecs the given transaction waits for the rate limits, zero whether allowed (and taken)
+qint64 pn_rateDelay(Smtp::Dispatcher::PrivateData *d, const QString &host, const QString &user,
+    const Spool::Entry &entry, qint64 nowMsecs)
+{
+    // fast return whether not limited
+    if (d->rateLimiter == nullptr)
+        return 0;
+    const qint64 delay = d->rateLimiter->tryAcquire(
+        host, user, entry.envelope.recipients.size(), entry.size, nowMsecs);
+    if (delay > 0)
+        pn_count(d, &Dispatcher::Stats::rateLimited);
+    return delay;
+}
+// Gives back the rate tokens of the given transaction, which did not take place
+inline void pn_rateRelease(Smtp::Dispatcher::PrivateData *d, const QString &host, const QString &user,
+    const Spool::Entry &entry)
+{
+    if (d->rateLimiter != nullptr)
+        d->rateLimiter->release(host, user, entry.envelope.recipients.size(), entry.size);
+}
+
+// Defers the given message to its next attempt
+bool pn_defer(Smtp::Dispatcher::PrivateData *d, quint64 id, int attempts, qint64 nowMsecs)
+{
+    const qint64 nextAttemptMsecs = nowMsecs + d->policy.delay(attempts + 1);
+    if (!d->spool->defer(id, nextAttemptMsecs, attempts + 1))
+        return false;
+    QMutexLocker locker (&d->mutex);
+    d->wheel.schedule(id, nextAttemptMsecs);
+    ++d->stats.deferred;
+    return true;
+}
+
+// Spools the given message again for the given recipients only, deferring it with the attempts
+//     and creation time of the original
+// \note Spooled and scheduled at once, so that no round picks it up in between
+// \return The id of the new message, zero on failure
+quint64 pn_respool(Smtp::Dispatcher::PrivateData *d, const Spool::Entry &entry,
+    const QStringList &recipients, qint64 nowMsecs)
+{
+    QScopedPointer<QIODevice> data (d->spool->openData(entry.id));
+    if (data.isNull())
+        return 0;
+    Envelope envelope = entry.envelope;
+    envelope.recipients = recipients;
+    const QByteArray encodedData = data->readAll();
+    const qint64 nextAttemptMsecs = nowMsecs + d->policy.delay(entry.attempts + 1);
+    QMutexLocker locker (&d->mutex);
+    const quint64 id = d->spool->enqueue(envelope, encodedData, entry.createdMsecs);
+    if (id == 0 || !d->spool->defer(id, nextAttemptMsecs, entry.attempts + 1))
+        return 0;
+    d->wheel.schedule(id, nextAttemptMsecs);
+    ++d->stats.deferred;
+    return id;
+}
+
+// Sends the given due message through the given open client, then settles its recipients
+// \return True whether settled (delivered or given up, for all or part of the recipients),
+//     False whether deferred
+bool pn_dispatch(Dispatcher *dispatcher, Smtp::Dispatcher::PrivateData *d,
+    Client &client, const Spool::Entry &entry, qint64 nowMsecs)
+{
+    // send it, streaming the spooled data
+    QScopedPointer<QIODevice> data (d->spool->openData(entry.id));
+    if (!data.isNull() && client.sendMessage(entry.envelope, *data)) {
+        d->spool->complete(entry.id);
+        pn_count(d, &Dispatcher::Stats::delivered);
+        emit dispatcher->messageDelivered(entry.id);
+        return true;
+    }
+    RecipientStatuses statuses = client.recipientStatuses();
+    // unreadable data, given up as no attempt can succeed
+    if (data.isNull()) {
+        statuses = entry.envelope.pendingStatuses();
+        for (auto &status : statuses) {
+            status.code = 554;
+            status.enhancedCode = { 5, 3, 0 };
+            status.text = QByteArrayLiteral("Unable to read the spooled message");
+        }
+    }
+    data.reset();
+
+    // settle each recipient by its reply severity
+    QStringList retry;
+    bool failed = false;
+    for (const auto &status : statuses) {
+        const auto severity = status.severity();
+        if (severity == ReplyTransient)
+            retry.append(status.address);
+        failed = failed || (severity == ReplyPermanent);
+    }
+    if (!retry.isEmpty() && d->policy.isExhausted(entry.attempts + 1, nowMsecs - entry.createdMsecs)) {
+        retry.clear();
+        failed = true;
+    }
+    if (failed) {
+        pn_count(d, &Dispatcher::Stats::failed);
+        emit dispatcher->messageFailed(entry.id, statuses);
+    }
+
+    // retry all the recipients
+    if (retry.size() == statuses.size()) {
+        pn_defer(d, entry.id, entry.attempts, nowMsecs);
+        return false;
+    }
+    // or spool the ones to retry again, retrying all of them on failure rather than losing some
+    if (!retry.isEmpty()) {
+        if (pn_respool(d, entry, retry, nowMsecs) == 0) {
+            pn_defer(d, entry.id, entry.attempts, nowMsecs);
+            return false;
+        }
+        pn_count(d, &Dispatcher::Stats::respooled);
+    }
+    // settled
+    d->spool->complete(entry.id);
+    return true;
+}
+
+// Gets the outcome of the last transaction of the given client, as for the concurrency limiter
+ConcurrencyLimiter::Outcome pn_outcome(const Client &client)
+{
+    bool accepted = true;
+    bool throttled = ConcurrencyLimiter::isThrottling(client.lastFailureCode());
+    for (const auto &status : client.recipientStatuses()) {
+        accepted = accepted && status.isAccepted();
+        throttled = throttled || ConcurrencyLimiter::isThrottling(status.code, status.enhancedCode);
+    }
+    if (accepted && client.isOpen())
+        return ConcurrencyLimiter::Accepted;
+    // a lost session (e.g. timeouts) is taken as load as well
+    return (throttled || pn_isHostUnavailable(client))? ConcurrencyLimiter::Throttled : ConcurrencyLimiter::Ignored;
+}
+
+// Pool Task, sending a due message through the session of a worker
+class pn_DispatchTask : public SessionTask
+{
+public:
+    pn_DispatchTask(Dispatcher *dispatcher, Smtp::Dispatcher::PrivateData *d, const Spool::Entry &entry)
+        : d_dispatcher(dispatcher), d_data(d), d_entry(entry) {}
+
+    void run(Client &client) override
+    {
+        auto &limiter = d_data->pool->limiter();
+        const qint64 nowMsecs = QDateTime::currentMSecsSinceEpoch();
+        // ensure the client is open, backing off the server whether unavailable
+        if (!client.isOpen() && !client.open()) {
+            limiter.release(ConcurrencyLimiter::Throttled);
+            pn_rateRelease(d_data, d_data->pool->destination().host, d_data->pool->destination().user, d_entry);
+            pn_backOffHost(d_data, client, { d_entry.id }, 0, nowMsecs);
+            return;
+        }
+        // send it, the outcome adapting the concurrency by the sending time (spool syncs excluded)
+        pn_dispatch(d_dispatcher, d_data, client, d_entry, nowMsecs);
+        limiter.release(pn_outcome(client), client.lastTimings().sendDuration());
+        if (pn_isHostUnavailable(client))
+            pn_backOffHost(d_data, client, QList<quint64>(), 0, nowMsecs);
+    }
+    void cancel() override
+    {
+        // give back the concurrency slot and the rate tokens, the message being due again
+        d_data->pool->limiter().release(ConcurrencyLimiter::Ignored);
+        pn_rateRelease(d_data, d_data->pool->destination().host, d_data->pool->destination().user, d_entry);
+        pn_reschedule(d_data, { d_entry.id }, 0, QDateTime::currentMSecsSinceEpoch());
+    }
+
+private:
+    Dispatcher *d_dispatcher = nullptr;
+    Smtp::Dispatcher::PrivateData *d_data = nullptr;
+    Spool::Entry d_entry;
+};
+
+} // PRIVATE UTILITY NAMESPACE
+
+Dispatcher::Dispatcher(Spool &spool, Client &client, QObject *parent)
+    : QObject(parent), d(new PrivateData())
+{
+    qRegisterMetaType<Smtp::RecipientStatuses>();
+    d->spool = &spool;
+    d->client = &client;
+}
+
+Dispatcher::Dispatcher(Spool &spool, SessionPool &pool, QObject *parent)
+    : QObject(parent), d(new PrivateData())
+{
+    qRegisterMetaType<Smtp::RecipientStatuses>();
+    d->spool = &spool;
+    d->pool = &pool;
+}
+
+Dispatcher::~Dispatcher()
+{
+    // the pool tasks reference the dispatcher
+    if (d->pool != nullptr)
+        d->pool->waitForDone();
+    // free resources
+    delete d;
+}
+
+void Dispatcher::setRetryPolicy(const RetryPolicy &policy)
+{
+    d->policy = policy;
+}
+
+const RetryPolicy& Dispatcher::retryPolicy() const
+{
+    return d->policy;
+}
+
+void Dispatcher::setHostBackoff(qint64 msecs)
+{
+    d->hostBackoff = qMax<qint64>(msecs, 0);
+}
+
+void Dispatcher::setBatchSize(int messages)
+{
+    d->batchSize = qMax(messages, 1);
+}
+
+void Dispatcher::setRateLimiter(RateLimiter *limiter)
+{
+    d->rateLimiter = limiter;
+}
+
+int Dispatcher::scheduledCount() const
+{
+    QMutexLocker locker (&d->mutex);
+    return d->wheel.count();
+}
+
+Dispatcher::Stats Dispatcher::stats() const
+{
+    QMutexLocker locker (&d->mutex);
+    return d->stats;
+}
+
+int Dispatcher::dispatchDue(qint64 nowMsecs)
+{
+    if (nowMsecs < 0)
+        nowMsecs = QDateTime::currentMSecsSinceEpoch();
+    // pick the due messages, the spooled ones included
+    pn_scheduleSpooled(d);
+    QList<quint64> due;
+    qint64 hostBackoffUntil = 0;
+    {
+        QMutexLocker locker (&d->mutex);
+        due = d->wheel.advance(nowMsecs);
+        hostBackoffUntil = d->hostBackoffUntil;
+    }
+    // fast return whether the server is backed off
+    if (nowMsecs < hostBackoffUntil) {
+        pn_reschedule(d, due, 0, hostBackoffUntil);
+        return 0;
+    }
+
+    int dispatched = 0;
+    for (int ix = 0; ix < due.size(); ++ix) {
+        // beyond the batch, due next round
+        if (ix >= d->batchSize) {
+            pn_reschedule(d, due, ix, nowMsecs);
+            break;
+        }
+        // skip messages completed meanwhile
+        Spool::Entry entry;
+        if (!d->spool->entry(due.at(ix), entry))
+            continue;
+
+        // hand it to the pool, up to the concurrency and the rate limits
+        if (d->pool != nullptr) {
+            if (!d->pool->limiter().tryAcquire()) {
+                pn_reschedule(d, due, ix, nowMsecs);
+                break;
+            }
+            const qint64 rateDelay = pn_rateDelay(d, d->pool->destination().host,
+                d->pool->destination().user, entry, nowMsecs);
+            if (rateDelay > 0) {
+                d->pool->limiter().release(ConcurrencyLimiter::Ignored);
+                pn_reschedule(d, due, ix, nowMsecs + rateDelay);
+                break;
+            }
+            if (!d->pool->submit(new pn_DispatchTask(this, d, entry))) {
+                d->pool->limiter().release(ConcurrencyLimiter::Ignored);
+                pn_rateRelease(d, d->pool->destination().host, d->pool->destination().user, entry);
+                pn_reschedule(d, due, ix, nowMsecs);
+                break;
+            }
+            ++dispatched;
+            continue;
+        }
+        // or send it: ensure the client is open, backing off the server whether unavailable
+        if (!d->client->isOpen() && !d->client->open()) {
+            pn_backOffHost(d, *d->client, due, ix, nowMsecs);
+            break;
+        }
+        // up to the rate limits, taken only once the server is reachable
+        const qint64 rateDelay = pn_rateDelay(d, d->client->serverHost(), d->client->accountUsername(),
+            entry, nowMsecs);
+        if (rateDelay > 0) {
+            pn_reschedule(d, due, ix, nowMsecs + rateDelay);
+            break;
+        }
+        if (pn_dispatch(this, d, *d->client, entry, nowMsecs))
+            ++dispatched;
+        // the server closed the session on its own (421), or the connection was lost
+        if (pn_isHostUnavailable(*d->client)) {
+            pn_backOffHost(d, *d->client, due, ix + 1, nowMsecs);
+            break;
+        }
+    }
+    return dispatched;
+}
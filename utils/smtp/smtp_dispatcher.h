@@ -0,0 +1,103 @@
+#ifndef SMTP_DISPATCHER_H
+#define SMTP_DISPATCHER_H
+
+#include <QObject>
+#include "utils/smtp/smtp_retry.h"
+#include "utils/smtp/smtp_transport.h"
+#include "utils/macros.h"
+
+// > Smtp NS
+namespace Smtp {
+
+// fwd declarations
+class Client;
+class RateLimiter;
+class SessionPool;
+class Spool;
+
+
+/// Spool Dispatcher, delivering the spooled messages through a client (or a session pool)
+///     and retrying the failed ones
+/// \note Each recipient is settled by the severity of its reply: delivered (2xx), failed (5xx)
+///     or retried (4xx and missing replies) with the backoff of the retry policy
+/// \note Recipients to retry, of a message settled for others, are spooled again as a new message
+/// \note Whether the server is unavailable (connection failures, 421) the due messages are delayed
+///     by the host backoff, not counting as an attempt
+/// \note With a session pool the messages are sent concurrently, as many as the concurrency limiter
+///     of the destination allows: each outcome adapts the limit (see Smtp::ConcurrencyLimiter)
+/// \note With a rate limiter, each transaction waits for the tokens of the server host and account,
+///     the due messages being delayed rather than sent into a rejection; the tokens of transactions
+///     not reaching the server are given back
+/// \warning Rounds are to be dispatched by a single thread, the spool can be fed by others meanwhile;
+///     with a session pool, signals are emitted by the pool workers
+class Dispatcher : public QObject
+{
+    Q_OBJECT
+
+// public definitions
+public:
+    /// Dispatch Statistics
+    struct Stats
+    {
+        qint64 delivered = 0; ///< messages delivered to all their recipients (settled ones excluded)
+        qint64 failed = 0; ///< messages given up, for permanent failures or exhausted retries
+        qint64 deferred = 0; ///< failed attempts to be retried
+        qint64 respooled = 0; ///< messages spooled again for part of their recipients
+        qint64 hostBackoffs = 0; ///< times the server was found unavailable
+        qint64 rateLimited = 0; ///< rounds stopped by the rate limiter
+    };
+
+// construction
+public:
+    /// Builds a dispatcher of the given spool, sending through the given client
+    /// \note Spool and client are not owned and must outlive the dispatcher
+    Dispatcher(Spool &spool, Client &client, QObject *parent = nullptr);
+    /// Builds a dispatcher of the given spool, sending through the sessions of the given pool
+    /// \note Spool and pool are not owned and must outlive the dispatcher
+    Dispatcher(Spool &spool, SessionPool &pool, QObject *parent = nullptr);
+    /// Dtor
+    ~Dispatcher() override;
+
+// public interface
+public:
+    /// Sets the retry policy
+    void setRetryPolicy(const RetryPolicy &policy);
+    /// Gets the retry policy
+    const RetryPolicy& retryPolicy() const;
+    /// Sets the delay (msecs) of the due messages whether the server is unavailable
+    /// \default As default 30 seconds
+    void setHostBackoff(qint64 msecs);
+    /// Sets the max amount of messages sent per dispatch round, the others being due next round
+    /// \default As default 100
+    void setBatchSize(int messages);
+    /// Sets the rate limiter consulted before each transaction, nullptr for no rate limit
+    /// \note The limiter is not owned and must outlive the dispatcher, it can be shared by dispatchers
+    void setRateLimiter(RateLimiter *limiter);
+
+    /// Sends the messages due at the given time (msecs since epoch, negative for now)
+    /// \note With a session pool, the due messages beyond the concurrency limit are due next round
+    /// \return The amount of messages settled (delivered or given up), or handed to the pool
+    int dispatchDue(qint64 nowMsecs = -1);
+    /// Gets the amount of messages scheduled for a later round
+    int scheduledCount() const;
+    /// Gets the statistics so far
+    Stats stats() const;
+
+// signals
+signals:
+    /// Emitted once a message was delivered to all its (remaining) recipients
+    void messageDelivered(quint64 id);
+    /// Emitted once a message was given up for some recipients, with the statuses of all of them
+    void messageFailed(quint64 id, const Smtp::RecipientStatuses &statuses);
+
+// private members
+private:
+    PRIVATE_DATA_PTR(d)
+};
+
+
+} // < Smtp NS
+
+Q_DECLARE_METATYPE(Smtp::RecipientStatuses)
+
+#endif // SMTP_DISPATCHER_H
@@ -0,0 +1,175 @@
+#include "smtp_metrics.h"
+
+#include <QMutexLocker>
+#include <QStringBuilder>
+#include "utils/rtloghandler.h"
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Quantiles rendered for the histograms
+constexpr double pn_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// Append a sample line: name{labels} value
+void pn_appendSample(QByteArray &out, const QByteArray &name, const QByteArray &labels,
+    const QByteArray &value)
+{
+    out += name;
+    if (!labels.isEmpty())
+        out += '{' % labels % '}';
+    out += ' ' % value % '\n';
+}
+// Gets the given microseconds as seconds
+inline QByteArray pn_seconds(qint64 usecs)
+{
+    return QByteArray::number(double(usecs) / 1000000.0, 'g', 9);
+}
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+// MetricsRegistry::Family
+
+struct MetricsRegistry::Family
+{
+    MetricType type;
+    QByteArray name, help;
+    QList<QByteArray> labels; // labels of each instrument, same order of the lists below
+    ScopedPtrList<MetricCounter> counters;
+    ScopedPtrList<MetricGauge> gauges;
+    ScopedPtrList<LatencyHistogram> histograms;
+};
+
+
+
+// MetricsRegistry
+
+MetricsRegistry::MetricsRegistry() = default;
+
+MetricsRegistry::~MetricsRegistry() = default;
+
+MetricCounter& MetricsRegistry::counter(
+    const QByteArray &name, const QByteArray &help, const QByteArray &labels)
+{
+    QMutexLocker locker (&d_mutex);
+    // look for the family and the instrument into it
+    auto *f = family(CounterMetric, name, help);
+    // a name of another type gets an instrument not rendered
+    if (f == nullptr)
+        return d_unregisteredCounter;
+    const int index = f->labels.indexOf(labels);
+    if (index >= 0)
+        return *f->counters.at(index);
+    // allocate a new one
+    f->labels.append(labels);
+    return *f->counters.appendNew();
+}
+
+MetricGauge& MetricsRegistry::gauge(
+    const QByteArray &name, const QByteArray &help, const QByteArray &labels)
+{
+    QMutexLocker locker (&d_mutex);
+    // look for the family and the instrument into it
+    auto *f = family(GaugeMetric, name, help);
+    // a name of another type gets an instrument not rendered
+    if (f == nullptr)
+        return d_unregisteredGauge;
+    const int index = f->labels.indexOf(labels);
+    if (index >= 0)
+        return *f->gauges.at(index);
+    // allocate a new one
+    f->labels.append(labels);
+    return *f->gauges.appendNew();
+}
+
+LatencyHistogram& MetricsRegistry::histogram(
+    const QByteArray &name, const QByteArray &help, const QByteArray &labels)
+{
+    QMutexLocker locker (&d_mutex);
+    // look for the family and the instrument into it
+    auto *f = family(HistogramMetric, name, help);
+    // a name of another type gets an instrument not rendered
+    if (f == nullptr)
+        return d_unregisteredHistogram;
+    const int index = f->labels.indexOf(labels);
+    if (index >= 0)
+        return *f->histograms.at(index);
+    // allocate a new one
+    f->labels.append(labels);
+    return *f->histograms.appendNew();
+}
+
+QByteArray MetricsRegistry::renderPrometheus() const
+{
+    QMutexLocker locker (&d_mutex);
+    QByteArray out;
+    out.reserve(4096);
+    // iterate over all families
+    for (const auto *f : d_families) {
+        // family header, escaping the help text
+        QByteArray help = f->help;
+        help.replace('\\', "\\\\").replace('\n', "\\n");
+        out += "# HELP " % f->name % ' ' % help % '\n';
+        switch (f->type) {
+        case CounterMetric: out += "# TYPE " % f->name % " counter\n"; break;
+        case GaugeMetric: out += "# TYPE " % f->name % " gauge\n"; break;
+        case HistogramMetric: out += "# TYPE " % f->name % " summary\n"; break;
+        }
+        // samples of all instruments
+        for (int ix = 0, max = f->labels.size(); ix < max; ++ix) {
+            const QByteArray &labels = f->labels.at(ix);
+            switch (f->type) {
+            case CounterMetric:
+                pn_appendSample(out, f->name, labels, QByteArray::number(f->counters.at(ix)->value()));
+                break;
+            case GaugeMetric:
+                pn_appendSample(out, f->name, labels, QByteArray::number(f->gauges.at(ix)->value()));
+                break;
+            case HistogramMetric: {
+                const auto *histogram = f->histograms.at(ix);
+                const QByteArray labelsPrefix = labels.isEmpty()? labels : labels + ',';
+                for (double quantile : pn_quantiles)
+                    pn_appendSample(out, f->name,
+                        labelsPrefix % "quantile=\"" % QByteArray::number(quantile) % '"',
+                        pn_seconds(histogram->percentile(quantile * 100.0)));
+                pn_appendSample(out, f->name + "_sum", labels, pn_seconds(histogram->sum()));
+                pn_appendSample(out, f->name + "_count", labels, QByteArray::number(histogram->count()));
+                break;
+            }
+            }
+        }
+    }
+    return out;
+}
+
+MetricsRegistry& MetricsRegistry::global()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsRegistry::Family* MetricsRegistry::family(
+    MetricType type, const QByteArray &name, const QByteArray &help)
+{
+    // look for an existing family, names being unique across types
+    for (auto *f : d_families) {
+        if (f->name != name)
+            continue;
+        if (f->type != type) {
+            RT_WARNING("metrics: %1 is registered with another type, ignoring it") % QString::fromUtf8(name);
+            return nullptr;
+        }
+        return f;
+    }
+    Q_ASSERT_X(!name.isEmpty(), "MetricsRegistry", "metric name required");
+    // allocate a new one
+    auto *f = d_families.appendNew();
+    f->type = type;
+    f->name = name;
+    f->help = help;
+    return f;
+}
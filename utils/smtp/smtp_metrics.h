@@ -0,0 +1,120 @@
+#ifndef SMTP_METRICS_H
+#define SMTP_METRICS_H
+
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QMutex>
+#include "utils/smtp/smtp_timings.h"
+#include "utils/pointers/scopedptrlist.h"
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// Lock-Free Counter, only increasing
+class MetricCounter
+{
+// public interface
+public:
+    /// Increments the counter
+    inline void increment(quint64 amount = 1) { d_value.fetchAndAddRelaxed(amount); }
+    /// Gets the counter value
+    inline quint64 value() const { return d_value.load(); }
+
+// private members
+private:
+    QAtomicInteger<quint64> d_value;
+};
+
+
+
+/// Lock-Free Gauge, going up and down
+class MetricGauge
+{
+// public interface
+public:
+    /// Sets the gauge value
+    inline void set(qint64 value) { d_value.store(value); }
+    /// Adds the given amount to the gauge value
+    inline void add(qint64 amount) { d_value.fetchAndAddRelaxed(amount); }
+    /// Subtracts the given amount from the gauge value
+    inline void sub(qint64 amount) { d_value.fetchAndSubRelaxed(amount); }
+    /// Gets the gauge value
+    inline qint64 value() const { return d_value.load(); }
+
+// private members
+private:
+    QAtomicInteger<qint64> d_value;
+};
+
+
+
+/// Metrics Registry, rendering the Prometheus text exposition format
+/// \note Registering an instrument takes a lock, while updating it is lock-free: register
+///     instruments once and keep the references, which are valid as long as the registry is
+/// \note Names and labels follow the Prometheus syntax, labels as `key="value",key2="value2"`;
+///     the same name and labels always return the same instrument, a name being of a single type
+///     (registering it with another type gets an instrument which is never rendered)
+/// \note Histograms record microseconds and are rendered as summaries in seconds
+class MetricsRegistry
+{
+// construction
+public:
+    /// Builds an empty registry
+    MetricsRegistry();
+    /// Not copyable
+    MetricsRegistry(const MetricsRegistry&) = delete;
+    MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+    /// Dtor
+    ~MetricsRegistry();
+
+// public interface
+public:
+    /// Registers (or gets) a counter
+    MetricCounter& counter(
+        const QByteArray &name, const QByteArray &help, const QByteArray &labels = QByteArray());
+    /// Registers (or gets) a gauge
+    MetricGauge& gauge(
+        const QByteArray &name, const QByteArray &help, const QByteArray &labels = QByteArray());
+    /// Registers (or gets) a latency histogram
+    LatencyHistogram& histogram(
+        const QByteArray &name, const QByteArray &help, const QByteArray &labels = QByteArray());
+
+    /// Renders all registered instruments in the Prometheus text exposition format
+    QByteArray renderPrometheus() const;
+
+    /// Gets the process-wide registry
+    static MetricsRegistry& global();
+
+// private definitions
+private:
+    /// Instrument Type
+    enum MetricType
+    {
+        CounterMetric,
+        GaugeMetric,
+        HistogramMetric
+    };
+    /// Instruments sharing the same name
+    struct Family;
+
+// private interface
+private:
+    /// Gets the family with the given name, allocating it whether missing
+    /// \return The family, nullptr whether the name is registered with another type
+    Family* family(MetricType type, const QByteArray &name, const QByteArray &help);
+
+// private members
+private:
+    mutable QMutex d_mutex;
+    ScopedPtrList<Family> d_families;
+    // Instruments given for names registered with another type, never rendered
+    MetricCounter d_unregisteredCounter;
+    MetricGauge d_unregisteredGauge;
+    LatencyHistogram d_unregisteredHistogram;
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_METRICS_H
@@ -6,8 +6,13 @@
 #include <QStringBuilder>
 #include <QDateTime>
 #include <QRegularExpression>
+#include <QtAlgorithms>
 #include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "utils/rexpatterns.h"
+#include "utils/smtp/smtp_allocations.h"
 
 // namespace usage
 using namespace Smtp;
@@ -56,6 +61,103 @@ QStringList pn_splitTextIntoChunks(const QString &text, int maxChunkSize)
     // return computed chunks
     return chunks;
 }
+// Checks whether the given bytes are a valid utf8 sequence
+// \note Rejects overlong forms, surrogates and code-points above U+10FFFF
+bool pn_isValidUtf8(const char *data, int size)
+{
+    // access raw data as unsigned bytes
+    const auto *bytes = reinterpret_cast<const unsigned char*>(data);
+    // iterate over all bytes
+    int ix = 0;
+    while (ix < size) {
+#ifdef __SSE2__
+        // skip blocks of 16 ascii bytes at once (no byte with the high bit set)
+        while (ix + 16 <= size) {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + ix));
+            if (_mm_movemask_epi8(block) != 0)
+                break;
+            ix += 16;
+        }
+        // ensure there is still something to check
+        if (ix >= size)
+            break;
+#endif
+        // handles single ascii bytes
+        const unsigned char lead = bytes[ix];
+        if (lead < 0x80) {
+            ix += 1;
+            continue;
+        }
+        // computes the sequence length and the allowed range for the 2nd byte
+        int sequenceSize = 0;
+        unsigned char minSecond = 0x80, maxSecond = 0xBF;
+        if (lead >= 0xC2 && lead <= 0xDF) {
+            sequenceSize = 2;
+        } else if (lead >= 0xE0 && lead <= 0xEF) {
+            sequenceSize = 3;
+            if (lead == 0xE0) // overlong
+                minSecond = 0xA0;
+            else if (lead == 0xED) // surrogates
+                maxSecond = 0x9F;
+        } else if (lead >= 0xF0 && lead <= 0xF4) {
+            sequenceSize = 4;
+            if (lead == 0xF0) // overlong
+                minSecond = 0x90;
+            else if (lead == 0xF4) // above U+10FFFF
+                maxSecond = 0x8F;
+        } else { // invalid lead byte
+            return false;
+        }
+        // ensure the sequence is complete and valid
+        if (ix + sequenceSize > size)
+            return false;
+        if (bytes[ix + 1] < minSecond || bytes[ix + 1] > maxSecond)
+            return false;
+        for (int jx = 2; jx < sequenceSize; ++jx)
+            if ((bytes[ix + jx] & 0xC0) != 0x80)
+                return false;
+        // consume the sequence
+        ix += sequenceSize;
+    }
+    // valid
+    return true;
+}
+// Converts the given header text to utf8, replacing line breaks to avoid header injections
+QByteArray pn_toUtf8HeaderText(const QString &text)
+{
+    // convert it
+    QByteArray utf8 = text.toUtf8();
+    // then replace line breaks with spaces
+    utf8.replace('\r', ' ').replace('\n', ' ');
+    // return it
+    return utf8;
+}
+// Checks whether the given text contains non-ascii characters
+bool pn_hasNonAsciiChars(const QString &text)
+{
+    // iterate over all chars
+    for (const auto charVal : text)
+        if (charVal.unicode() >= 0x80)
+            return true;
+    // fallback
+    return false;
+}
+// Estimates the size of the given content once quoted-printable encoded and formatted into lines
+qint64 pn_estimateQuotedPrintableSize(const MimeUtils::ContentStats &stats)
+{
+    // each escaped byte takes 3 bytes ("=XX")
+    const qint64 encodedSize = qint64(stats.size) + 2 * qint64(stats.escapedBytes);
+    // each line takes up to "max-line-size - 1" bytes plus the soft line break "=CRLF"
+    return encodedSize + (encodedSize / (MimeUtils::MaxLineSize - 1)) * 3;
+}
+// Estimates the size of the given content once base64 encoded and formatted into lines
+qint64 pn_estimateBase64Size(const MimeUtils::ContentStats &stats)
+{
+    // each 3 bytes block is encoded into 4 bytes
+    const qint64 encodedSize = ((qint64(stats.size) + 2) / 3) * 4;
+    // each line takes up to "max-line-size" bytes plus the line break "CRLF"
+    return encodedSize + (encodedSize / MimeUtils::MaxLineSize) * 2;
+}
 
 } // PRIVATE UTILITY NAMESPACE
 
@@ -78,16 +180,20 @@ bool EmailAddress::isValid() const
 
 QByteArray MimeUtils::encodeQuotedPrintable(const QString &text)
 {
-    // fast return for empty strings
-    if (text.isEmpty())
+    // encode the given text into utf8 and then encode it
+    return encodeQuotedPrintable(text.toUtf8());
+}
+
+QByteArray MimeUtils::encodeQuotedPrintable(const QByteArray &utf8Text)
+{
+    // fast return for empty arrays
+    if (utf8Text.isEmpty())
         return QByteArray();
 
-    // encode the given text into utf8
-    auto utf8Encoded = text.toUtf8();
     // allocate resulting array
     QByteArray output;
     // iterate over all utf8-encoded bytes
-    for (const qint8 inputChar : utf8Encoded) {
+    for (const qint8 inputChar : utf8Text) {
         // handles charts that needs to be escaped, encoding them with '=' + HEX value
         if (pn_needEscapeForQuotedPrintableEncoding(inputChar))
             output.append('=' % QByteArray(1, inputChar).toHex().toUpper());
@@ -298,6 +404,160 @@ QByteArray MimeUtils::encodeEmailAddresses(const EmailAddresses &emails, int max
     return encoded;
 }
 
+MimeUtils::ContentStats MimeUtils::analyzeContent(const QByteArray &data)
+{
+    // allocate resulting stats
+    ContentStats stats;
+    stats.size = data.size();
+
+    // access raw data as unsigned bytes
+    const auto *bytes = reinterpret_cast<const unsigned char*>(data.constData());
+    const int size = data.size();
+    // allocate line-tracking vars
+    int lineSize = 0;
+    bool atLineStart = true;
+    // iterate over all bytes
+    int ix = 0;
+    while (ix < size) {
+#ifdef __SSE2__
+        // handles blocks of 16 printable ascii bytes at once, counting the ones to escape
+        const __m128i controlLimit = _mm_set1_epi8(0x20);
+        while (ix + 16 <= size) {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + ix));
+            // control chars and 8bit bytes (negative as signed) need the per-byte path
+            if (_mm_movemask_epi8(_mm_cmplt_epi8(block, controlLimit)) != 0)
+                break;
+            // computes the mask of the [0-9A-Za-z] bytes, not escaped by quoted-printable
+            const __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('0' - 1)),
+                _mm_cmplt_epi8(block, _mm_set1_epi8('9' + 1)));
+            const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('A' - 1)),
+                _mm_cmplt_epi8(block, _mm_set1_epi8('Z' + 1)));
+            const __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('a' - 1)),
+                _mm_cmplt_epi8(block, _mm_set1_epi8('z' + 1)));
+            const int alnumMask = _mm_movemask_epi8(_mm_or_si128(digits, _mm_or_si128(upper, lower)));
+            // update stats
+            if (atLineStart && bytes[ix] == '.')
+                stats.dotLines += 1;
+            atLineStart = false;
+            lineSize += 16;
+            stats.escapedBytes += 16 - int(qPopulationCount(quint32(alnumMask)));
+            ix += 16;
+        }
+        // ensure there is still something to check
+        if (ix >= size)
+            break;
+#endif
+        // handles line breaks
+        const unsigned char byteVal = bytes[ix];
+        if (byteVal == '\r' || byteVal == '\n') {
+            // CRLF pair
+            if (byteVal == '\r' && ix + 1 < size && bytes[ix + 1] == '\n') {
+                stats.escapedBytes += 2;
+                ix += 2;
+            // bare CR or LF
+            } else {
+                if (byteVal == '\r')
+                    stats.bareCRs += 1;
+                else
+                    stats.bareLFs += 1;
+                stats.escapedBytes += 1;
+                ix += 1;
+            }
+            // close the current line
+            stats.maxLineSize = std::max(stats.maxLineSize, lineSize);
+            lineSize = 0;
+            atLineStart = true;
+            continue;
+        }
+        // handles any other byte
+        if (atLineStart && byteVal == '.')
+            stats.dotLines += 1;
+        atLineStart = false;
+        lineSize += 1;
+        if (byteVal & 0x80)
+            stats.eightBitBytes += 1;
+        else if (byteVal == 0)
+            stats.nulBytes += 1;
+        if (pn_needEscapeForQuotedPrintableEncoding(static_cast<qint8>(byteVal)))
+            stats.escapedBytes += 1;
+        ix += 1;
+    }
+    // close the last line
+    stats.maxLineSize = std::max(stats.maxLineSize, lineSize);
+    // return computed stats
+    return stats;
+}
+
+QByteArray MimeUtils::normalizeLineBreaks(const QByteArray &data)
+{
+    // allocate resulting array
+    QByteArray output;
+    output.reserve(data.size());
+    // iterate over all bytes
+    for (int ix = 0, max = data.size(); ix < max; ++ix) {
+        const char byteVal = data.at(ix);
+        // CR, optionally followed by LF
+        if (byteVal == '\r') {
+            output += QByteArrayLiteral("\r\n");
+            if (ix + 1 < max && data.at(ix + 1) == '\n')
+                ix += 1;
+        // bare LF
+        } else if (byteVal == '\n') {
+            output += QByteArrayLiteral("\r\n");
+        // any other byte
+        } else {
+            output.append(byteVal);
+        }
+    }
+    // return normalized data
+    return output;
+}
+
+bool MimeUtils::isValidUtf8(const QByteArray &data)
+{
+    return pn_isValidUtf8(data.constData(), data.size());
+}
+
+QByteArray MimeUtils::formatEmailAddressUtf8(const EmailAddress &email)
+{
+    // ensure it is valid
+    if (!email.isValid())
+        return QByteArray();
+    // whether there is no owner name, just use the email address
+    if (email.ownerName().isEmpty())
+        return email.email().toUtf8();
+
+    // write the owner name as a quoted-string, escaping quotes and backslashes
+    QByteArray name = pn_toUtf8HeaderText(email.ownerName());
+    name.replace('\\', QByteArrayLiteral("\\\\")).replace('"', QByteArrayLiteral("\\\""));
+    // then append the email address wrapped by "<>" brackets
+    return QByteArrayLiteral("\"") % name % QByteArrayLiteral("\" <") % email.email().toUtf8() % '>';
+}
+
+QByteArray MimeUtils::formatEmailAddressesUtf8(const EmailAddresses &emails)
+{
+    // ensure the list is not empty
+    if (emails.isEmpty())
+        return QByteArray();
+    // ensure all emails are valid
+    for (const auto &email : emails)
+        if (!email.isValid())
+            return QByteArray();
+
+    // allocate resulting data
+    QByteArray formatted;
+    // starts formatting all emails
+    for (int ix = 0, max = emails.size(); ix < max; ++ix) {
+        // adds a prefix after the first one
+        if (ix >= 1)
+            formatted += QByteArrayLiteral(",\r\n ");
+        // format the email
+        formatted += formatEmailAddressUtf8(emails.at(ix));
+    }
+    // return formatted data
+    return formatted;
+}
+
 bool MimeUtils::writeDataToDev(QIODevice &dev, const QByteArray &data)
 {
     return (dev.write(data) == data.size());
@@ -307,8 +567,8 @@ bool MimeUtils::writeDataToDev(QIODevice &dev, const QByteArray &data)
 
 // MimePart
 
-MimePart::MimePart(const QByteArray &contentType)
-    : d_contentType(contentType) {}
+MimePart::MimePart(QByteArray contentType)
+    : d_contentType(std::move(contentType)) {}
 
 MimePart::~MimePart() = default;
 
@@ -322,7 +582,60 @@ void MimePart::setContentName(const QString &name)
     d_contentName = parsed.toUtf8();
 }
 
-bool MimePart::writeStdHeadersToDev(QIODevice &dev, const QByteArray &boundary) const
+MimePart::ContentTransferEncoding MimePart::selectTransferEncoding(
+    const MimeUtils::ContentStats &stats, TransportFeatures features)
+{
+    // checks whether the content can be sent as-is: no NULs, only CRLF line breaks and short lines
+    // \note Lines starting with a dot are fine, since the DATA stream gets dot-stuffed
+    const bool asIsAllowed = (stats.nulBytes == 0 && stats.bareCRs == 0 && stats.bareLFs == 0
+        && stats.maxLineSize <= MimeUtils::MaxNotEncodedLineSize);
+    // 7bit content
+    if (asIsAllowed && stats.eightBitBytes == 0)
+        return ContentNotEncoded;
+    // 8bit content, whether the transport allows it
+    if (asIsAllowed && features.testFlag(Transport8BitMime))
+        return Content8BitEncoded;
+    // otherwise use the encoding producing the smallest output
+    if (pn_estimateQuotedPrintableSize(stats) <= pn_estimateBase64Size(stats))
+        return ContentQuotedPrintableEncoded;
+    return ContentBase64Encoded;
+}
+
+MimePart::ContentTransferEncoding MimePart::resolveTransferEncoding(
+    const MimeUtils::ContentStats &stats, TransportFeatures features) const
+{
+    // select it whether required, or whether 8bit is not supported by the transport
+    if (contentTransferEncoding() == ContentAutoEncoded
+        || (contentTransferEncoding() == Content8BitEncoded && !features.testFlag(Transport8BitMime)))
+        return selectTransferEncoding(stats, features);
+    // fallback to the given one
+    return contentTransferEncoding();
+}
+
+MimePart::ContentTransferEncoding MimePart::writtenTransferEncoding(TransportFeatures features) const
+{
+    Q_UNUSED(features)
+    return contentTransferEncoding();
+}
+
+QByteArray MimePart::encodeContent(
+    const QByteArray &content, const MimeUtils::ContentStats &stats, ContentTransferEncoding encoding)
+{
+    // switch over the given encoding
+    switch (encoding) {
+        case ContentBase64Encoded:
+            return MimeUtils::formatDataIntoLines(content.toBase64());
+        case ContentQuotedPrintableEncoded:
+            return MimeUtils::formatQuotedPrintableIntoLines(MimeUtils::encodeQuotedPrintable(content));
+        default: // as-is, with CRLF line breaks only
+            if (stats.bareCRs > 0 || stats.bareLFs > 0)
+                return MimeUtils::normalizeLineBreaks(content);
+            return content;
+    }
+}
+
+bool MimePart::writeStdHeadersToDev(
+    QIODevice &dev, ContentTransferEncoding encoding, const QByteArray &boundary) const
 {
     // ensure the content-type is valid
     if (contentType().isEmpty())
@@ -346,14 +659,16 @@ bool MimePart::writeStdHeadersToDev(QIODevice &dev, const QByteArray &boundary)
         return false;
 
     // computes the content-transfer-encoding value
-    QByteArray encoding; // default none
-    // switch over the current encoding
-    if (contentTransferEncoding() == ContentBase64Encoded)
-        encoding = QByteArrayLiteral("Content-Transfer-Encoding: base64\r\n");
-    else if (contentTransferEncoding() == ContentQuotedPrintableEncoded)
-        encoding = QByteArrayLiteral("Content-Transfer-Encoding: quoted-printable\r\n");
+    QByteArray encodingVal; // default none
+    // switch over the given encoding
+    if (encoding == ContentBase64Encoded)
+        encodingVal = QByteArrayLiteral("Content-Transfer-Encoding: base64\r\n");
+    else if (encoding == ContentQuotedPrintableEncoded)
+        encodingVal = QByteArrayLiteral("Content-Transfer-Encoding: quoted-printable\r\n");
+    else if (encoding == Content8BitEncoded)
+        encodingVal = QByteArrayLiteral("Content-Transfer-Encoding: 8bit\r\n");
     // whether relevant, tries writing it
-    if (!encoding.isEmpty() && !MimeUtils::writeDataToDev(dev, encoding))
+    if (!encodingVal.isEmpty() && !MimeUtils::writeDataToDev(dev, encodingVal))
         return false;
 
     // success
@@ -362,33 +677,71 @@ bool MimePart::writeStdHeadersToDev(QIODevice &dev, const QByteArray &boundary)
 
 
 
-// MimeText
+// MimeTextualPart
 
-MimeText::MimeText(const QString &text)
-    : MimePart("text/plain"), d_text(text)
+MimeTextualPart::MimeTextualPart(QByteArray contentType, QByteArray utf8Content)
+    : MimePart(std::move(contentType)), d_content(std::move(utf8Content))
+    , d_contentStats(MimeUtils::analyzeContent(d_content))
 {
     // apply the used charset
     setContentCharset("UTF-8");
     // sets transfer encoding
-    setContentTransferEncoding(ContentQuotedPrintableEncoded);
+    setContentTransferEncoding(ContentAutoEncoded);
+}
+
+const QByteArray& MimeTextualPart::encodedContent(TransportFeatures features) const
+{
+    // whether the source was released, only the encoded content is available
+    if (d_content.isEmpty())
+        return d_encodedContent;
+
+    // resolves the encoding to use
+    const auto encoding = writtenTransferEncoding(features);
+    // whether not computed yet (or computed with another encoding), encode the source content
+    if (d_encodedContent.isEmpty() || d_encodedAs != encoding) {
+        d_encodedContent = encodeContent(d_content, d_contentStats, encoding);
+        d_encodedAs = encoding;
+    }
+    // return it
+    return d_encodedContent;
+}
+
+MimePart::ContentTransferEncoding MimeTextualPart::writtenTransferEncoding(TransportFeatures features) const
+{
+    // whether the source was released, the encoded content is written as-is
+    if (d_content.isEmpty())
+        return d_encodedAs;
+    // ignoring bare line breaks since text gets normalized
+    auto stats = d_contentStats;
+    stats.bareCRs = stats.bareLFs = 0;
+    return resolveTransferEncoding(stats, features);
 }
 
-bool MimeText::writeToDev(QIODevice &dev) const
+void MimeTextualPart::releaseSourceContent()
 {
-    // ensure the text is valid
-    if (text().isEmpty())
+    // ensure the encoded content is computed
+    encodedContent();
+    // then drop the source
+    d_content = QByteArray();
+}
+
+bool MimeTextualPart::writeToDev(QIODevice &dev, TransportFeatures features) const
+{
+    // ensure the content is valid
+    if (isEmpty())
         return false;
 
+    // computes (or reuses) the encoded content
+    const QByteArray encoded = encodedContent(features);
     // writes standard headers
-    if (!writeStdHeadersToDev(dev))
+    if (!writeStdHeadersToDev(dev, d_encodedAs))
         return false;
 
     // header-to-content separator
     if (!MimeUtils::writeDataToDev(dev, QByteArrayLiteral("\r\n")))
         return false;
-    // writes file content
-    auto encodedText = MimeUtils::encodeQuotedPrintable(text());
-    if (!MimeUtils::writeDataToDev(dev, MimeUtils::formatQuotedPrintableIntoLines(encodedText)))
+    // writes the encoded content (shared, computed once)
+    if (!MimeUtils::writeDataToDev(dev, encoded))
         return false;
     // ending new line
     if (!MimeUtils::writeDataToDev(dev, QByteArrayLiteral("\r\n")))
@@ -397,54 +750,57 @@ bool MimeText::writeToDev(QIODevice &dev) const
     return true;
 }
 
+bool MimeTextualPart::setUtf8Content(QByteArray utf8Content, bool validate)
+{
+    // whether requested, ensure the given content is valid utf8
+    if (validate && !MimeUtils::isValidUtf8(utf8Content))
+        return false;
+    // apply it, dropping the previously encoded content
+    d_content = std::move(utf8Content);
+    d_contentStats = MimeUtils::analyzeContent(d_content);
+    d_encodedContent = QByteArray();
+    // success
+    return true;
+}
+
+
+
+// MimeText
+
+MimeText::MimeText(const QString &text)
+    : MimeTextualPart("text/plain", text.toUtf8()) {}
+
+MimeText::MimeText(QByteArray utf8Text)
+    : MimeTextualPart("text/plain", std::move(utf8Text)) {}
+
+MimeText::MimeText(const char *utf8Text)
+    : MimeTextualPart("text/plain", QByteArray(utf8Text)) {}
+
 
 
 // MimeHtml
 
 MimeHtml::MimeHtml(const QString &html)
-    : MimePart("text/html"), d_html(html)
-{
-    // apply the used charset
-    setContentCharset("UTF-8");
-    // sets transfer encoding
-    setContentTransferEncoding(ContentQuotedPrintableEncoded);
-}
+    : MimeTextualPart("text/html", html.toUtf8()) {}
 
-bool MimeHtml::writeToDev(QIODevice &dev) const
-{
-    // ensure the html is valid
-    if (html().isEmpty())
-        return false;
+MimeHtml::MimeHtml(QByteArray utf8Html)
+    : MimeTextualPart("text/html", std::move(utf8Html)) {}
 
-    // writes standard headers
-    if (!writeStdHeadersToDev(dev))
-        return false;
-
-    // header-to-content separator
-    if (!MimeUtils::writeDataToDev(dev, QByteArrayLiteral("\r\n")))
-        return false;
-    // writes file content
-    auto encodedText = MimeUtils::encodeQuotedPrintable(html());
-    if (!MimeUtils::writeDataToDev(dev, MimeUtils::formatQuotedPrintableIntoLines(encodedText)))
-        return false;
-    // ending new line
-    if (!MimeUtils::writeDataToDev(dev, QByteArrayLiteral("\r\n")))
-        return false;
-    // success
-    return true;
-}
+MimeHtml::MimeHtml(const char *utf8Html)
+    : MimeTextualPart("text/html", QByteArray(utf8Html)) {}
 
 
 
 // MimeFile
 
-MimeFile::MimeFile(const QByteArray &fileContent, const QString &fileName)
-    : MimePart("application/octet-stream"), d_fileContent(fileContent)
+MimeFile::MimeFile(QByteArray fileContent, const QString &fileName)
+    : MimePart("application/octet-stream"), d_fileContent(std::move(fileContent))
+    , d_contentStats(MimeUtils::analyzeContent(d_fileContent))
 {
     // sets the file name
     setContentName(fileName);
     // sets transfer encoding
-    setContentTransferEncoding(ContentBase64Encoded);
+    setContentTransferEncoding(ContentAutoEncoded);
 
     // tries applying a more appropriate content-type based on the file name
     auto typesFromFileName = QMimeDatabase().mimeTypesForFileName(contentName());
@@ -452,14 +808,25 @@ MimeFile::MimeFile(const QByteArray &fileContent, const QString &fileName)
         setContentType(typesFromFileName.first().name().toLatin1());
 }
 
-bool MimeFile::writeToDev(QIODevice &dev) const
+MimePart::ContentTransferEncoding MimeFile::writtenTransferEncoding(TransportFeatures features) const
+{
+    // ignoring bare line breaks for text files since they get normalized
+    auto stats = d_contentStats;
+    if (contentType().startsWith("text/"))
+        stats.bareCRs = stats.bareLFs = 0;
+    return resolveTransferEncoding(stats, features);
+}
+
+bool MimeFile::writeToDev(QIODevice &dev, TransportFeatures features) const
 {
     // ensure the file has a content and a name
     if (fileName().isEmpty() || fileContent().isEmpty())
         return false;
 
+    // resolves the encoding to use
+    const auto encoding = writtenTransferEncoding(features);
     // writes standard headers
-    if (!writeStdHeadersToDev(dev))
+    if (!writeStdHeadersToDev(dev, encoding))
         return false;
     // computes the disposition to encode
     QByteArray dispositionVal;
@@ -477,7 +844,7 @@ bool MimeFile::writeToDev(QIODevice &dev) const
     if (!MimeUtils::writeDataToDev(dev, QByteArrayLiteral("\r\n")))
         return false;
     // writes file content
-    if (!MimeUtils::writeDataToDev(dev, MimeUtils::formatDataIntoLines(fileContent().toBase64())))
+    if (!MimeUtils::writeDataToDev(dev, encodeContent(fileContent(), d_contentStats, encoding)))
         return false;
     // ending new line
     if (!MimeUtils::writeDataToDev(dev, QByteArrayLiteral("\r\n")))
@@ -490,8 +857,8 @@ bool MimeFile::writeToDev(QIODevice &dev) const
 
 // MimeInlineFile
 
-MimeInlineFile::MimeInlineFile(const QByteArray &fileContent, const QString &fileName)
-    : MimeFile(fileContent, fileName)
+MimeInlineFile::MimeInlineFile(QByteArray fileContent, const QString &fileName)
+    : MimeFile(std::move(fileContent), fileName)
 {
     // apply inline disposition
     setDisposition(DisposeInline);
@@ -501,8 +868,8 @@ MimeInlineFile::MimeInlineFile(const QByteArray &fileContent, const QString &fil
 
 // MimeAttachmentFile
 
-MimeAttachmentFile::MimeAttachmentFile(const QByteArray &fileContent, const QString &fileName)
-    : MimeFile(fileContent, fileName)
+MimeAttachmentFile::MimeAttachmentFile(QByteArray fileContent, const QString &fileName)
+    : MimeFile(std::move(fileContent), fileName)
 {
     // apply attachment disposition
     setDisposition(DisposeAsAttachment);
@@ -515,7 +882,19 @@ MimeAttachmentFile::MimeAttachmentFile(const QByteArray &fileContent, const QStr
 MimeMultiPartMixed::MimeMultiPartMixed()
     : MimePart("multipart/mixed") {}
 
-bool MimeMultiPartMixed::writeToDev(QIODevice &dev) const
+MimePart::ContentTransferEncoding MimeMultiPartMixed::writtenTransferEncoding(TransportFeatures features) const
+{
+    // whether a single part exists, it is written in place of the multi-part
+    if (d_parts.size() == 1)
+        return d_parts.first()->writtenTransferEncoding(features);
+    // the widest encoding of the parts
+    for (const auto *part : d_parts)
+        if (part->writtenTransferEncoding(features) == Content8BitEncoded)
+            return Content8BitEncoded;
+    return ContentNotEncoded;
+}
+
+bool MimeMultiPartMixed::writeToDev(QIODevice &dev, TransportFeatures features) const
 {
     // ensure the multipart is not empty
     if (isEmpty())
@@ -523,14 +902,14 @@ bool MimeMultiPartMixed::writeToDev(QIODevice &dev) const
 
     // whether a single part exists, just encode it
     if (d_parts.size() == 1)
-        return d_parts.first()->writeToDev(dev);
+        return d_parts.first()->writeToDev(dev, features);
 
     // create a unique boundary
     QByteArray boundaryStr = QUuid::createUuid().toRfc4122().toHex();
     QByteArray boundaryPrefix = QByteArrayLiteral("--") % boundaryStr % QByteArrayLiteral("\r\n");
     QByteArray boundarySuffix = QByteArrayLiteral("--") % boundaryStr % QByteArrayLiteral("--\r\n");
     // tries encoding standard headers
-    if (!writeStdHeadersToDev(dev, boundaryStr))
+    if (!writeStdHeadersToDev(dev, writtenTransferEncoding(features), boundaryStr))
         return false;
 
     // header-to-content separator
@@ -542,7 +921,7 @@ bool MimeMultiPartMixed::writeToDev(QIODevice &dev) const
         if (!MimeUtils::writeDataToDev(dev, boundaryPrefix))
             return false;
         // writes the part
-        if (!part->writeToDev(dev))
+        if (!part->writeToDev(dev, features))
             return false;
     }
     // boundary suffix
@@ -556,20 +935,52 @@ bool MimeMultiPartMixed::writeToDev(QIODevice &dev) const
 
 // MimeMessage
 
+MimeMessage::MimeMessage(MimeMessage &&other)
+    : d_senderAddress(std::move(other.d_senderAddress))
+    , d_replyToAddress(std::move(other.d_replyToAddress))
+    , d_toAddresses(std::move(other.d_toAddresses))
+    , d_ccAddresses(std::move(other.d_ccAddresses))
+    , d_messageSubject(std::move(other.d_messageSubject))
+    , d_messageBody(other.d_messageBody)
+    , d_multiPart(std::move(other.d_multiPart))
+    , d_encodedHeaders(std::move(other.d_encodedHeaders))
+    , d_encodedHeadersUtf8(std::move(other.d_encodedHeadersUtf8))
+{
+    // the body is now owned by this multi-part
+    other.d_messageBody = nullptr;
+}
+
+MimeMessage& MimeMessage::operator=(MimeMessage &&other)
+{
+    // ensure it is not a self-assignment
+    if (this == &other)
+        return *this;
+    // move all members
+    d_senderAddress = std::move(other.d_senderAddress);
+    d_replyToAddress = std::move(other.d_replyToAddress);
+    d_toAddresses = std::move(other.d_toAddresses);
+    d_ccAddresses = std::move(other.d_ccAddresses);
+    d_messageSubject = std::move(other.d_messageSubject);
+    d_multiPart = std::move(other.d_multiPart);
+    d_encodedHeaders = std::move(other.d_encodedHeaders);
+    d_encodedHeadersUtf8 = std::move(other.d_encodedHeadersUtf8);
+    // the body is now owned by this multi-part
+    d_messageBody = other.d_messageBody;
+    other.d_messageBody = nullptr;
+    // allows concatenations
+    return *this;
+}
+
 void MimeMessage::setMessageBodyText(const QString &text)
 {
-    // whether a body already exists
-    if (d_messageBody) {
-        // drop it first
-        d_multiPart.parts().dropFirst();
-        d_messageBody = nullptr;
-    }
-    // whether a valid text is given
-    if (!text.isEmpty()) {
-        // create a new body part as first one into the multi-part
-        d_messageBody = new MimeText(text);
-        d_multiPart.parts().prepend(d_messageBody);
-    }
+    // whether a valid text is given, create a new body part
+    setMessageBody(!text.isEmpty() ? new MimeText(text) : nullptr);
+}
+
+void MimeMessage::setMessageBodyText(QByteArray utf8Text)
+{
+    // whether a valid text is given, create a new body part
+    setMessageBody(!utf8Text.isEmpty() ? new MimeText(std::move(utf8Text)) : nullptr);
 }
 
 QString MimeMessage::messageBodyText() const
@@ -582,6 +993,34 @@ QString MimeMessage::messageBodyText() const
 }
 
 void MimeMessage::setMessageBodyHtml(const QString &html)
+{
+    // whether a valid html is given, create a new body part
+    setMessageBody(!html.isEmpty() ? new MimeHtml(html) : nullptr);
+}
+
+void MimeMessage::setMessageBodyHtml(QByteArray utf8Html)
+{
+    // whether a valid html is given, create a new body part
+    setMessageBody(!utf8Html.isEmpty() ? new MimeHtml(std::move(utf8Html)) : nullptr);
+}
+
+QString MimeMessage::messageBodyHtml() const
+{
+    // tries upcasting the message body to a MimeHtml
+    if (auto *part = dynamic_cast<MimeHtml*>(d_messageBody))
+        return part->html();
+    // fallback
+    return QString();
+}
+
+void MimeMessage::releaseMessageBodySource()
+{
+    // whether a body exists, release its source
+    if (d_messageBody)
+        d_messageBody->releaseSourceContent();
+}
+
+void MimeMessage::setMessageBody(MimeTextualPart *body)
 {
     // whether a body already exists
     if (d_messageBody) {
@@ -589,21 +1028,32 @@ void MimeMessage::setMessageBodyHtml(const QString &html)
         d_multiPart.parts().dropFirst();
         d_messageBody = nullptr;
     }
-    // whether a valid html is given
-    if (!html.isEmpty()) {
-        // create a new body part as first one into the multi-part
-        d_messageBody = new MimeHtml(html);
+    // whether a new body is given
+    if (body) {
+        // apply it as first part into the multi-part
+        d_messageBody = body;
         d_multiPart.parts().prepend(d_messageBody);
     }
 }
 
-QString MimeMessage::messageBodyHtml() const
+bool MimeMessage::hasUtf8Headers() const
 {
-    // tries upcasting the message body to a MimeHtml
-    if (auto *part = dynamic_cast<MimeHtml*>(d_messageBody))
-        return part->html();
-    // fallback
-    return QString();
+    // checks the given address
+    auto hasUtf8Address = [](const EmailAddress &address) {
+        return pn_hasNonAsciiChars(address.email()) || pn_hasNonAsciiChars(address.ownerName());
+    };
+    // sender and reply-to
+    if (hasUtf8Address(d_senderAddress) || hasUtf8Address(d_replyToAddress))
+        return true;
+    // recipients
+    for (const auto &to : d_toAddresses)
+        if (hasUtf8Address(to))
+            return true;
+    for (const auto &cc : d_ccAddresses)
+        if (hasUtf8Address(cc))
+            return true;
+    // subject
+    return pn_hasNonAsciiChars(d_messageSubject);
 }
 
 bool MimeMessage::isValid() const
@@ -629,14 +1079,65 @@ bool MimeMessage::isValid() const
     if (d_messageSubject.isEmpty())
         return false;
     // ensure there is a valid body
-    if (messageBodyText().isEmpty() && messageBodyHtml().isEmpty())
+    if (!d_messageBody || d_messageBody->isEmpty())
         return false;
     // valid
     return true;
 }
 
-bool MimeMessage::writeToDev(QIODevice &dev) const
+const QByteArray& MimeMessage::encodedHeaders(TransportFeatures features) const
 {
+    // fast return whether already computed for the same mode
+    const bool utf8 = features.testFlag(TransportSmtpUtf8);
+    QByteArray &cache = utf8 ? d_encodedHeadersUtf8 : d_encodedHeaders;
+    if (!cache.isNull())
+        return cache;
+
+    // encoders for the chosen mode
+    auto encodeAddress = [utf8](const EmailAddress &address) {
+        return utf8 ? MimeUtils::formatEmailAddressUtf8(address)
+                    : MimeUtils::encodeEmailAddress(address);
+    };
+    auto encodeAddresses = [utf8](const EmailAddresses &addresses) {
+        return utf8 ? MimeUtils::formatEmailAddressesUtf8(addresses)
+                    : MimeUtils::encodeEmailAddresses(addresses);
+    };
+
+    // allocate resulting header block (not-null even when empty, to mark it as computed)
+    QByteArray encoded ("");
+    // whether valid, encode the "From"
+    if (!d_senderAddress.isEmpty())
+        encoded += QByteArrayLiteral("From: ")
+            % encodeAddress(d_senderAddress) % QByteArrayLiteral("\r\n");
+    // whether valid, encode the "Reply-To"
+    if (!d_replyToAddress.isEmpty())
+        encoded += QByteArrayLiteral("Reply-To: ")
+            % encodeAddress(d_replyToAddress) % QByteArrayLiteral("\r\n");
+    // whether valid, encode the "To"
+    if (!d_toAddresses.isEmpty())
+        encoded += QByteArrayLiteral("To: ")
+            % encodeAddresses(d_toAddresses) % QByteArrayLiteral("\r\n");
+    // whether valid, encode the "Cc"
+    if (!d_ccAddresses.isEmpty())
+        encoded += QByteArrayLiteral("Cc: ")
+            % encodeAddresses(d_ccAddresses) % QByteArrayLiteral("\r\n");
+    // whether not empty, encode the subject
+    if (!d_messageSubject.isEmpty()) {
+        // raw utf8 whether allowed and fitting a single line, otherwise mime-words
+        QByteArray subject = utf8 ? pn_toUtf8HeaderText(d_messageSubject) : QByteArray();
+        if (subject.isEmpty() || subject.size() > MimeUtils::MaxNotEncodedLineSize - 9)
+            subject = MimeUtils::encodeMimeWordQ(d_messageSubject);
+        encoded += QByteArrayLiteral("Subject: ") % subject % QByteArrayLiteral("\r\n");
+    }
+
+    // store it and return
+    cache = encoded;
+    return cache;
+}
+
+bool MimeMessage::writeToDev(QIODevice &dev, TransportFeatures features) const
+{
+    SMTP_ALLOCATION_SCOPE(MessageWrite);
     // ensure this message is valid
     if (!isValid())
         return false;
@@ -647,35 +1148,14 @@ bool MimeMessage::writeToDev(QIODevice &dev) const
     msgHeader += QByteArrayLiteral("Date: ")
         % QDateTime::currentDateTime().toString(Qt::RFC2822Date).toLatin1()
         % QByteArrayLiteral("\r\n");
-    // whether valid, encode the "From"
-    if (!d_senderAddress.isEmpty())
-        msgHeader += QByteArrayLiteral("From: ")
-            % MimeUtils::encodeEmailAddress(d_senderAddress) % QByteArrayLiteral("\r\n");
-    // whether valid, encode the "Reply-To"
-    if (!d_replyToAddress.isEmpty())
-        msgHeader += QByteArrayLiteral("Reply-To: ")
-            % MimeUtils::encodeEmailAddress(d_replyToAddress) % QByteArrayLiteral("\r\n");
-    // whether valid, encode the "To"
-    if (!d_toAddresses.isEmpty())
-        msgHeader += QByteArrayLiteral("To: ")
-            % MimeUtils::encodeEmailAddresses(d_toAddresses) % QByteArrayLiteral("\r\n");
-    // whether valid, encode the "Cc"
-    if (!d_ccAddresses.isEmpty())
-        msgHeader += QByteArrayLiteral("Cc: ")
-            % MimeUtils::encodeEmailAddresses(d_ccAddresses) % QByteArrayLiteral("\r\n");
-    // whether not empty, encode the subject
-    if (!d_messageSubject.isEmpty())
-        msgHeader += QByteArrayLiteral("Subject: ")
-            % MimeUtils::encodeMimeWordQ(d_messageSubject) % QByteArrayLiteral("\r\n");
+    // addresses and subject, encoded once and cached
+    msgHeader += encodedHeaders(features);
 
     // tries writing the header to dev
     if (!MimeUtils::writeDataToDev(dev, msgHeader))
         return false;
     // tries writing the multi-part content
-    if (!d_multiPart.writeToDev(dev))
-        return false;
-    // END of message
-    if (!MimeUtils::writeDataToDev(dev, QByteArrayLiteral("\r\n.\r\n")))
+    if (!d_multiPart.writeToDev(dev, features))
         return false;
 
     // success
@@ -3,6 +3,8 @@
 
 #include <QByteArray>
 #include <QString>
+#include <QFlags>
+#include <utility>
 #include "utils/pointers/scopedptrlist.h"
 
 // fwd declarations
@@ -20,14 +22,16 @@ public:
     /// Builds an Empty and Invalid Email
     EmailAddress() = default;
     /// Builds an Email address with no Name
-    EmailAddress(const QString &email)
-        : d_email(email) {}
+    EmailAddress(QString email)
+        : d_email(std::move(email)) {}
     /// Builds an Email with an optional Name
-    EmailAddress(const QString &email, const QString &ownerName)
-        : d_email(email), d_name(ownerName) {}
-    /// Allow Copy and Assignment
+    EmailAddress(QString email, QString ownerName)
+        : d_email(std::move(email)), d_name(std::move(ownerName)) {}
+    /// Allow Copy, Move and Assignment
     EmailAddress(const EmailAddress &other) = default;
+    EmailAddress(EmailAddress &&other) = default;
     EmailAddress& operator=(const EmailAddress &other) = default;
+    EmailAddress& operator=(EmailAddress &&other) = default;
 
 // public interface
 public:
@@ -51,6 +55,19 @@ using EmailAddresses = QList<EmailAddress>;
 
 
 
+/// Transport Features supported by the server, affecting how messages are written
+enum TransportFeature
+{
+    NoTransportFeatures = 0x00,
+    Transport8BitMime = 0x01, ///< 8bit bodies are accepted (8BITMIME)
+    TransportSmtpUtf8 = 0x02 ///< utf8 headers and addresses are accepted (SMTPUTF8)
+};
+Q_DECLARE_FLAGS(TransportFeatures, TransportFeature)
+Q_DECLARE_OPERATORS_FOR_FLAGS(TransportFeatures)
+
+
+
+
 // Wrapper for Encoding or General Purpose Utils
 // > MimeUtils NS
 namespace MimeUtils {
@@ -60,9 +77,31 @@ namespace MimeUtils {
 static constexpr const int MaxLineSize = 76;
 /// Max mime-word size, choosed to account extra header data
 static constexpr const int MaxMimeWordSize = 60;
+/// Max line size for not-encoded content, excluding the line break
+static constexpr const int MaxNotEncodedLineSize = 998;
+
+/// Content Statistics, used to choose the transfer-encoding
+struct ContentStats
+{
+    int size = 0; ///< amount of bytes
+    int eightBitBytes = 0; ///< bytes with the high bit set
+    int nulBytes = 0; ///< NUL bytes
+    int bareCRs = 0; ///< CR bytes not followed by a LF
+    int bareLFs = 0; ///< LF bytes not preceded by a CR
+    int maxLineSize = 0; ///< size of the longest line, excluding line breaks
+    int dotLines = 0; ///< lines starting with a dot
+    int escapedBytes = 0; ///< bytes escaped by the quoted-printable encoding
+};
+/// Scans the given content once, computing its statistics
+/// \note Printable ascii runs are processed 16 bytes at once whether SSE2 is available
+ContentStats analyzeContent(const QByteArray &data);
+/// Converts bare CR and LF line breaks into CRLF ones
+QByteArray normalizeLineBreaks(const QByteArray &data);
 
 /// Encode Quoted-Printable Text
 QByteArray encodeQuotedPrintable(const QString &text);
+/// Encode Quoted-Printable Text, given as utf8 data
+QByteArray encodeQuotedPrintable(const QByteArray &utf8Text);
 /// Format the given Quoted-Printable Text into Lines
 QByteArray formatQuotedPrintableIntoLines(const QByteArray &encoded, int maxLineSize = MaxLineSize);
 /// Format the given raw-data into Lines
@@ -78,6 +117,16 @@ QByteArray encodeEmailAddress(const EmailAddress &email, int maxWordSize = MaxMi
 /// Encode the given list of Email-Addresses splitting them over multiple lines if needed
 QByteArray encodeEmailAddresses(const EmailAddresses &emails, int maxWordSize = MaxMimeWordSize);
 
+/// Format the given Email-Address as raw utf8, for SMTPUTF8 transports
+/// \note The owner name is written as a quoted-string
+QByteArray formatEmailAddressUtf8(const EmailAddress &email);
+/// Format the given list of Email-Addresses as raw utf8, for SMTPUTF8 transports
+QByteArray formatEmailAddressesUtf8(const EmailAddresses &emails);
+
+/// Checks whether the given data is a valid utf8 sequence
+/// \note Ascii runs are skipped 16 bytes at once whether SSE2 is available
+bool isValidUtf8(const QByteArray &data);
+
 /// Writes given data into the given device
 /// \return True on success, False otherwise
 bool writeDataToDev(QIODevice &dev, const QByteArray &data);
@@ -97,15 +146,22 @@ public:
     {
         ContentNotEncoded,
         ContentBase64Encoded,
-        ContentQuotedPrintableEncoded
+        ContentQuotedPrintableEncoded,
+        Content8BitEncoded, ///< not encoded 8bit data, requires 8BITMIME
+        ContentAutoEncoded ///< chosen on write from the content statistics
     };
 
 // construction
 public:
     /// Builds a new Generic Mime-Part with the given Content-Type
-    explicit MimePart(const QByteArray &contentType);
+    explicit MimePart(QByteArray contentType);
     /// Builds a new Generic Mime-Part with no Content-Type
     MimePart() = default;
+    /// Allow Copy, Move and Assignment
+    MimePart(const MimePart &other) = default;
+    MimePart(MimePart &&other) = default;
+    MimePart& operator=(const MimePart &other) = default;
+    MimePart& operator=(MimePart &&other) = default;
     /// Virtual Destruction
     virtual ~MimePart();
 
@@ -114,7 +170,7 @@ public:
     /// Gets the content-type
     inline const QByteArray& contentType() const { return d_contentType; }
     /// Sets the content-type
-    inline void setContentType(const QByteArray &type) { d_contentType = type; }
+    inline void setContentType(QByteArray type) { d_contentType = std::move(type); }
 
     /// Gets the content-name
     inline const QByteArray& contentName() const { return d_contentName; }
@@ -124,22 +180,39 @@ public:
     /// Gets the content-charset
     inline const QByteArray& contentCharset() const { return d_contentCharset; }
     /// Sets the content-charset
-    inline void setContentCharset(const QByteArray &charset) { d_contentCharset = charset; }
+    inline void setContentCharset(QByteArray charset) { d_contentCharset = std::move(charset); }
 
     /// Gets the content-transfer-encoding
     inline ContentTransferEncoding contentTransferEncoding() const { return d_contentEncoding; }
     /// Sets the content-transfer-encoding
     inline void setContentTransferEncoding(ContentTransferEncoding enc) { d_contentEncoding = enc; }
 
+    /// Gets the transfer-encoding the part is written with, given the transport features
+    virtual ContentTransferEncoding writtenTransferEncoding(TransportFeatures features = NoTransportFeatures) const;
     /// Writes mime data into the given device
+    /// \param features Transport features allowed while writing (ex: 8bit bodies)
     /// \return True on success, False otherwise
-    virtual bool writeToDev(QIODevice &dev) const = 0;
+    virtual bool writeToDev(QIODevice &dev, TransportFeatures features = NoTransportFeatures) const = 0;
+
+    /// Selects the transfer-encoding producing the smallest output for the given content
+    /// \note Not encoded 7bit or 8bit content is preferred whenever allowed
+    static ContentTransferEncoding selectTransferEncoding(
+        const MimeUtils::ContentStats &stats, TransportFeatures features);
 
 // protected interface
 protected:
-    /// Writes standard headers into the given device
+    /// Resolves the transfer-encoding to use for a content with the given statistics
+    /// \note An "auto" encoding, or an 8bit one not supported by the transport, gets selected
+    ContentTransferEncoding resolveTransferEncoding(
+        const MimeUtils::ContentStats &stats, TransportFeatures features) const;
+    /// Encodes the given content with the given transfer-encoding, formatted into lines
+    static QByteArray encodeContent(const QByteArray &content,
+        const MimeUtils::ContentStats &stats, ContentTransferEncoding encoding);
+
+    /// Writes standard headers into the given device, using the given transfer-encoding
     /// \return True on success, False otherwise
-    bool writeStdHeadersToDev(QIODevice &dev, const QByteArray &boundary = QByteArray()) const;
+    bool writeStdHeadersToDev(QIODevice &dev, ContentTransferEncoding encoding,
+        const QByteArray &boundary = QByteArray()) const;
 
 // private members
 private:
@@ -154,49 +227,123 @@ using MimeParts = ScopedPtrList<MimePart>;
 
 
 
+/// Generic Text
+/// \note The content is stored as utf8, which is its canonical representation
+/// \note The transfer-encoding is chosen analyzing the content, normalizing its line breaks
+///     whether it is not encoded at all
+/// \note The encoded content is computed on the first write and kept as an implicitly
+///     shared array, so following writes will only reference it
+class MimeTextualPart : public MimePart
+{
+// construction
+protected:
+    /// Builds a Text part with the given Content-Type and utf8 Text-Content
+    MimeTextualPart(QByteArray contentType, QByteArray utf8Content);
+
+// public interface
+public:
+    /// Checks whether the part has no content
+    inline bool isEmpty() const { return (d_content.isEmpty() && d_encodedContent.isEmpty()); }
+
+    /// Gets the encoded content, computing it whether not done yet
+    /// \note Whether the source content was released, the encoded one is returned as-is
+    /// \warning The encoded content is computed lazily: when sharing a part between threads
+    ///     call this once before, so that concurrent writes will only read it
+    const QByteArray& encodedContent(TransportFeatures features = NoTransportFeatures) const;
+    /// Gets the transfer-encoding used by the last encoded content
+    inline ContentTransferEncoding encodedContentTransferEncoding() const { return d_encodedAs; }
+    /// Computes the encoded content (whether not done yet) and drops the source content
+    /// \note Use it to save memory on parts that will only be written from now on
+    void releaseSourceContent();
+
+    /// Gets the transfer-encoding the part is written with, given the transport features
+    ContentTransferEncoding writtenTransferEncoding(TransportFeatures features = NoTransportFeatures) const override;
+    /// Writes the mime data to the device
+    bool writeToDev(QIODevice &dev, TransportFeatures features = NoTransportFeatures) const override;
+
+// protected interface
+protected:
+    /// Gets the utf8 source content
+    inline const QByteArray& utf8Content() const { return d_content; }
+    /// Sets the utf8 source content, dropping the encoded one
+    /// \param validate True to ensure the content is valid utf8 before applying it
+    /// \return False whether the validation failed, leaving the content unchanged
+    bool setUtf8Content(QByteArray utf8Content, bool validate = false);
+
+// private members
+private:
+    QByteArray d_content;
+    MimeUtils::ContentStats d_contentStats;
+    mutable QByteArray d_encodedContent;
+    mutable ContentTransferEncoding d_encodedAs = ContentAutoEncoded;
+};
+
+
+
+
 /// Text
-class MimeText : public MimePart
+class MimeText : public MimeTextualPart
 {
 // construction
 public:
     /// Builds a Text part with the given Text-Content
     explicit MimeText(const QString &text);
+    /// Builds a Text part with the given utf8 Text-Content
+    explicit MimeText(QByteArray utf8Text);
+    /// Builds a Text part with the given utf8 Text-Content
+    explicit MimeText(const char *utf8Text);
 
 // public interface
 public:
     /// Gets the text
-    inline const QString& text() const { return d_text; }
-
-    /// Writes the mime data to the device
-    bool writeToDev(QIODevice &dev) const override;
-
-// private members
-private:
-    QString d_text;
+    /// \note The text is empty whether the source content was released
+    inline QString text() const { return QString::fromUtf8(utf8Content()); }
+    /// Gets the utf8 text
+    inline const QByteArray& utf8Text() const { return utf8Content(); }
+
+    /// Sets the text
+    inline void setText(const QString &text) { setUtf8Content(text.toUtf8()); }
+    /// Sets the utf8 text
+    /// \param validate True to ensure the text is valid utf8 before applying it
+    /// \return False whether the validation failed, leaving the text unchanged
+    inline bool setText(QByteArray utf8Text, bool validate = false)
+        { return setUtf8Content(std::move(utf8Text), validate); }
+    /// Sets the utf8 text
+    inline void setText(const char *utf8Text) { setUtf8Content(QByteArray(utf8Text)); }
 };
 
 
 
 
 /// HTML
-class MimeHtml : public MimePart
+class MimeHtml : public MimeTextualPart
 {
 // construction
 public:
     /// Builds a HTML part with the given Html-Content
     explicit MimeHtml(const QString &html);
+    /// Builds a HTML part with the given utf8 Html-Content
+    explicit MimeHtml(QByteArray utf8Html);
+    /// Builds a HTML part with the given utf8 Html-Content
+    explicit MimeHtml(const char *utf8Html);
 
 // public interface
 public:
     /// Gets the html
-    inline const QString& html() const { return d_html; }
-
-    /// Writes the mime data to the device
-    bool writeToDev(QIODevice &dev) const override;
-
-// private members
-private:
-    QString d_html;
+    /// \note The html is empty whether the source content was released
+    inline QString html() const { return QString::fromUtf8(utf8Content()); }
+    /// Gets the utf8 html
+    inline const QByteArray& utf8Html() const { return utf8Content(); }
+
+    /// Sets the html
+    inline void setHtml(const QString &html) { setUtf8Content(html.toUtf8()); }
+    /// Sets the utf8 html
+    /// \param validate True to ensure the html is valid utf8 before applying it
+    /// \return False whether the validation failed, leaving the html unchanged
+    inline bool setHtml(QByteArray utf8Html, bool validate = false)
+        { return setUtf8Content(std::move(utf8Html), validate); }
+    /// Sets the utf8 html
+    inline void setHtml(const char *utf8Html) { setUtf8Content(QByteArray(utf8Html)); }
 };
 
 
@@ -218,7 +365,7 @@ public:
 // construction
 public:
     /// Standard Construction giving File-Content and Name
-    MimeFile(const QByteArray &fileContent, const QString &fileName);
+    MimeFile(QByteArray fileContent, const QString &fileName);
 
 // public interface
 public:
@@ -232,12 +379,15 @@ public:
     /// Sets the current disposition
     inline void setDisposition(Disposition d) { d_disposition = d; }
 
+    /// Gets the transfer-encoding the part is written with, given the transport features
+    ContentTransferEncoding writtenTransferEncoding(TransportFeatures features = NoTransportFeatures) const override;
     /// Writes the mime data to the device
-    bool writeToDev(QIODevice &dev) const override;
+    bool writeToDev(QIODevice &dev, TransportFeatures features = NoTransportFeatures) const override;
 
 // private members
 private:
     QByteArray d_fileContent;
+    MimeUtils::ContentStats d_contentStats;
     Disposition d_disposition = NoDisposition;
 };
 
@@ -250,7 +400,7 @@ class MimeInlineFile : public MimeFile
 // construction
 public:
     /// Build an Inline-Disposition File
-    MimeInlineFile(const QByteArray &fileContent, const QString &fileName);
+    MimeInlineFile(QByteArray fileContent, const QString &fileName);
 };
 
 
@@ -262,7 +412,7 @@ class MimeAttachmentFile : public MimeFile
 // construction
 public:
     /// Build an Inline-Disposition File
-    MimeAttachmentFile(const QByteArray &fileContent, const QString &fileName);
+    MimeAttachmentFile(QByteArray fileContent, const QString &fileName);
 };
 
 
@@ -277,6 +427,9 @@ public:
     MimeMultiPartMixed();
     /// Disable Copy and Assignment
     Q_DISABLE_COPY(MimeMultiPartMixed)
+    /// Allow Move
+    MimeMultiPartMixed(MimeMultiPartMixed &&other) = default;
+    MimeMultiPartMixed& operator=(MimeMultiPartMixed &&other) = default;
 
 // public interface
 public:
@@ -289,10 +442,14 @@ public:
     inline MimeParts& parts() { return d_parts; }
     inline const MimeParts& parts() const { return d_parts; }
 
+    /// Gets the transfer-encoding the multi-part is written with, given the transport features
+    /// \note The widest one of the parts: 8bit whether any part is written as 8bit, 7bit otherwise
+    ///     (RFC 2045 §6.4, composite types cannot be encoded)
+    ContentTransferEncoding writtenTransferEncoding(TransportFeatures features = NoTransportFeatures) const override;
     /// Writes the mime data to the device
     /// \warning An empty multi-part will return false
     /// \note A multi-part with a single part, equals to having such part only
-    bool writeToDev(QIODevice &dev) const override;
+    bool writeToDev(QIODevice &dev, TransportFeatures features = NoTransportFeatures) const override;
 
 // private members
 private:
@@ -311,59 +468,103 @@ public:
     MimeMessage() = default;
     /// Disable Copy and Assignment
     Q_DISABLE_COPY(MimeMessage)
+    /// Allow Move
+    MimeMessage(MimeMessage &&other);
+    MimeMessage& operator=(MimeMessage &&other);
 
 // public interface
 public:
     /// Sets the sender address
-    inline void setSenderAddress(const EmailAddress &sender) { d_senderAddress = sender; }
+    inline void setSenderAddress(EmailAddress sender)
+        { d_senderAddress = std::move(sender); invalidateEncodedHeaders(); }
     /// Gets the sender address
     inline const EmailAddress& senderAddress() const { return d_senderAddress; }
 
     /// Sets the reply-to address
-    inline void setReplyToAddress(const EmailAddress &replyTo) { d_replyToAddress = replyTo; }
+    inline void setReplyToAddress(EmailAddress replyTo)
+        { d_replyToAddress = std::move(replyTo); invalidateEncodedHeaders(); }
     /// Gets the reply-to address
     inline const EmailAddress& replyToAddress() const { return d_replyToAddress; }
 
     /// Sets the list of "To" recipients
-    inline void setToRecipients(const EmailAddresses &to) { d_toAddresses = to; }
+    inline void setToRecipients(EmailAddresses to)
+        { d_toAddresses = std::move(to); invalidateEncodedHeaders(); }
     /// Adds an address to the list of "To" recipients
-    inline void addToRecipient(const EmailAddress &to) { d_toAddresses.append(to); }
+    inline void addToRecipient(EmailAddress to)
+        { d_toAddresses.append(std::move(to)); invalidateEncodedHeaders(); }
     /// Gets the list of "To" recipients
     inline const EmailAddresses& toRecipients() const { return d_toAddresses; }
 
     /// Sets the list of "Cc" recipients
-    inline void setCcRecipients(const EmailAddresses &cc) { d_ccAddresses = cc; }
+    inline void setCcRecipients(EmailAddresses cc)
+        { d_ccAddresses = std::move(cc); invalidateEncodedHeaders(); }
     /// Adds an address to the list of "Cc" recipients
-    inline void addCcRecipient(const EmailAddress &cc) { d_ccAddresses.append(cc); }
+    inline void addCcRecipient(EmailAddress cc)
+        { d_ccAddresses.append(std::move(cc)); invalidateEncodedHeaders(); }
     /// Gets the list of "Cc" recipients
     inline const EmailAddresses& ccRecipients() const { return d_ccAddresses; }
 
     /// Sets the message subject
-    inline void setMessageSubject(const QString &text) { d_messageSubject = text; }
+    inline void setMessageSubject(QString text)
+        { d_messageSubject = std::move(text); invalidateEncodedHeaders(); }
     /// Gets the message subject
     inline const QString& messageSubject() const { return d_messageSubject; }
 
     /// Sets the message body as a plan text
     void setMessageBodyText(const QString &text);
+    /// Sets the message body as a plan utf8 text
+    void setMessageBodyText(QByteArray utf8Text);
+    /// Sets the message body as a plan utf8 text
+    inline void setMessageBodyText(const char *utf8Text) { setMessageBodyText(QByteArray(utf8Text)); }
     /// Gets the plain-text message body
     QString messageBodyText() const;
     /// Sets the message body as html text
     void setMessageBodyHtml(const QString &html);
+    /// Sets the message body as utf8 html text
+    void setMessageBodyHtml(QByteArray utf8Html);
+    /// Sets the message body as utf8 html text
+    inline void setMessageBodyHtml(const char *utf8Html) { setMessageBodyHtml(QByteArray(utf8Html)); }
     /// Gets the html message body
     QString messageBodyHtml() const;
+    /// Encodes the message body and drops its source text to save memory
+    /// \note Once released, the body text and html getters will return empty strings
+    void releaseMessageBodySource();
 
     /// Adds a new mime part to the message
     /// \note The message takes ownership of the given part
     inline void addMimePart(MimePart *part) { d_multiPart.appendPart(part); }
 
+    /// Checks whether any address or the subject contains non-ascii characters
+    /// \note Such a message benefits from the SMTPUTF8 transport feature
+    bool hasUtf8Headers() const;
+
     /// Checks whether the message is valid
     /// \note To be valid a message must have valid addresses with at least one sender
     ///     and a "To" recipient, a valid subject, and a valid message body
     bool isValid() const;
 
+    /// Gets the encoded address and subject header lines (From, Reply-To, To, Cc, Subject)
+    /// \note The block is computed once and cached until one of those fields changes,
+    ///     so only volatile headers like the "Date" are computed on each write
+    /// \note Whether the SMTPUTF8 feature is given, headers are written as raw utf8, each mode
+    ///     having its own cache
+    /// \warning The caches are filled lazily: when sharing a message between threads
+    ///     call this once before for each mode, so that concurrent writes will only read them
+    const QByteArray& encodedHeaders(TransportFeatures features = NoTransportFeatures) const;
+
     /// Writes the mime message data to the device
+    /// \param features Transport features allowed while writing (ex: 8bit bodies)
+    /// \note Only the message is written: dot-stuffing and the end-of-data terminator
+    ///     are left to the transport (see Smtp::DataDevice)
     /// \warning An invalid message will return false
-    bool writeToDev(QIODevice &dev) const;
+    bool writeToDev(QIODevice &dev, TransportFeatures features = NoTransportFeatures) const;
+
+// private interface
+private:
+    /// Drops the cached encoded headers
+    inline void invalidateEncodedHeaders() { d_encodedHeaders.clear(); d_encodedHeadersUtf8.clear(); }
+    /// Replaces the message body with the given one (taking ownership), or drops it on nullptr
+    void setMessageBody(MimeTextualPart *body);
 
 // private members
 private:
@@ -372,8 +573,10 @@ private:
     EmailAddresses d_toAddresses;
     EmailAddresses d_ccAddresses;
     QString d_messageSubject;
-    MimePart *d_messageBody = nullptr;
+    MimeTextualPart *d_messageBody = nullptr;
     MimeMultiPartMixed d_multiPart;
+    mutable QByteArray d_encodedHeaders; // null whether not computed
+    mutable QByteArray d_encodedHeadersUtf8; // as for SMTPUTF8, null whether not computed
 };
 
 
@@ -0,0 +1,227 @@
+#include "smtp_pool.h"
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QQueue>
+#include <QStringBuilder>
+#include <QThread>
+#include <QWaitCondition>
+#include <climits>
+#include "utils/smtp/smtp_metrics.h"
+
+// namespace usage
+using namespace Smtp;
+
+// Destination
+
+QString Destination::key() const
+{
+    if (connectionType == Client::LocalConnection)
+        return host;
+    return host % ':' % QString::number(port);
+}
+
+void Destination::setup(Client &client) const
+{
+    client.setServerHost(host);
+    client.setServerPort(port);
+    client.setConnectionType(connectionType);
+    client.setProtocol(protocol);
+    if (!user.isEmpty()) {
+        client.setAccountUser(user);
+        client.setAccountPassword(password);
+    }
+    // after the credentials, which default it
+    client.setAuthMethod(authMethod);
+    if (!clientHost.isEmpty())
+        client.setClientHost(clientHost);
+    client.setTransportFeatures(features);
+}
+
+
+
+// SessionPool
+
+struct Smtp::SessionPool::PrivateData
+{
+    explicit PrivateData(const ConcurrencyLimiter::Settings &settings)
+        : limiter(settings) {}
+
+    Destination destination;
+    ConcurrencyLimiter limiter;
+    MetricsRegistry *registry = nullptr;
+    MetricGauge *queuedGauge = nullptr;
+    MetricGauge *workersGauge = nullptr;
+
+    mutable QMutex mutex;
+    QWaitCondition taskQueued; // signaled on new tasks and on stop
+    QWaitCondition tasksDone; // signaled once no task is queued or running
+    QQueue<SessionTask*> queue;
+    QList<QThread*> workers;
+    int busyWorkers = 0;
+    bool stopping = false;
+
+    // Reports the gauges, whether any
+    void report()
+    {
+        if (queuedGauge == nullptr)
+            return;
+        queuedGauge->set(queue.size());
+        workersGauge->set(workers.size());
+    }
+};
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Pool Worker, owning its client
+class pn_Worker : public QThread
+{
+public:
+    explicit pn_Worker(Smtp::SessionPool::PrivateData *d)
+        : d_pool(d) {}
+
+protected:
+    void run() override
+    {
+        // the client lives in the worker thread
+        Client client;
+        d_pool->destination.setup(client);
+        client.setMetricsRegistry(d_pool->registry);
+        // run the tasks until stopped
+        while (true) {
+            SessionTask *task = nullptr;
+            {
+                QMutexLocker locker (&d_pool->mutex);
+                while (d_pool->queue.isEmpty() && !d_pool->stopping)
+                    d_pool->taskQueued.wait(&d_pool->mutex);
+                if (d_pool->stopping)
+                    break;
+                task = d_pool->queue.dequeue();
+                ++d_pool->busyWorkers;
+                d_pool->report();
+            }
+            task->run(client);
+            delete task;
+            {
+                QMutexLocker locker (&d_pool->mutex);
+                --d_pool->busyWorkers;
+                if (d_pool->queue.isEmpty() && d_pool->busyWorkers == 0)
+                    d_pool->tasksDone.wakeAll();
+            }
+        }
+        client.close();
+    }
+
+private:
+    Smtp::SessionPool::PrivateData *d_pool = nullptr;
+};
+
+} // PRIVATE UTILITY NAMESPACE
+
+SessionPool::SessionPool(const Destination &destination, const ConcurrencyLimiter::Settings &settings)
+    : d(new PrivateData(settings))
+{
+    d->destination = destination;
+}
+
+SessionPool::~SessionPool()
+{
+    // stop the workers, taking the queued tasks
+    QQueue<SessionTask*> dropped;
+    {
+        QMutexLocker locker (&d->mutex);
+        d->stopping = true;
+        dropped.swap(d->queue);
+        d->taskQueued.wakeAll();
+        d->tasksDone.wakeAll();
+    }
+    for (auto *worker : d->workers) {
+        worker->wait();
+        delete worker;
+    }
+    // cancel the queued tasks, out of the lock
+    for (auto *task : dropped) {
+        task->cancel();
+        delete task;
+    }
+    // free resources
+    delete d;
+}
+
+const Destination& SessionPool::destination() const
+{
+    return d->destination;
+}
+
+ConcurrencyLimiter& SessionPool::limiter()
+{
+    return d->limiter;
+}
+
+void SessionPool::setMetricsRegistry(MetricsRegistry *registry)
+{
+    const QByteArray labels = "destination=\"" % d->destination.key().toUtf8() % '"';
+    d->limiter.setMetricsRegistry(registry, labels);
+    QMutexLocker locker (&d->mutex);
+    d->registry = registry;
+    d->queuedGauge = nullptr;
+    d->workersGauge = nullptr;
+    // fast return whether metrics are disabled
+    if (registry == nullptr)
+        return;
+    d->queuedGauge = &registry->gauge("smtp_pool_queued_tasks",
+        "Tasks waiting for a session of the pool.", labels);
+    d->workersGauge = &registry->gauge("smtp_pool_workers",
+        "Workers of the pool, each owning a session.", labels);
+    d->report();
+}
+
+bool SessionPool::submit(SessionTask *task)
+{
+    QMutexLocker locker (&d->mutex);
+    // ensure it is not stopping
+    if (d->stopping) {
+        delete task;
+        return false;
+    }
+    d->queue.enqueue(task);
+    // start a worker whether none is free
+    const int freeWorkers = d->workers.size() - d->busyWorkers;
+    if (d->queue.size() > freeWorkers && d->workers.size() < d->limiter.settings().maxLimit) {
+        auto *worker = new pn_Worker(d);
+        d->workers.append(worker);
+        worker->start();
+    }
+    d->report();
+    d->taskQueued.wakeOne();
+    return true;
+}
+
+bool SessionPool::waitForDone(int msecs)
+{
+    QElapsedTimer timer;
+    timer.start();
+    QMutexLocker locker (&d->mutex);
+    while ((!d->queue.isEmpty() || d->busyWorkers > 0) && !d->stopping) {
+        const qint64 remaining = (msecs < 0)? -1 : msecs - timer.elapsed();
+        if (msecs >= 0 && remaining <= 0)
+            return false;
+        d->tasksDone.wait(&d->mutex, (remaining < 0)? ULONG_MAX : (unsigned long)remaining);
+    }
+    return true;
+}
+
+int SessionPool::queuedCount() const
+{
+    QMutexLocker locker (&d->mutex);
+    return d->queue.size();
+}
+
+int SessionPool::workerCount() const
+{
+    QMutexLocker locker (&d->mutex);
+    return d->workers.size();
+}
@@ -0,0 +1,103 @@
+#ifndef SMTP_POOL_H
+#define SMTP_POOL_H
+
+#include <QString>
+#include "utils/smtp/smtp_client.h"
+#include "utils/smtp/smtp_concurrency.h"
+#include "utils/macros.h"
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// Mail Server Destination, setting up the clients of a session pool
+struct Destination
+{
+    QString host; ///< server hostname, or the socket path for local connections
+    quint16 port = 25;
+    Client::ConnectionType connectionType = Client::TcpConnection;
+    Client::Protocol protocol = Client::SmtpProtocol;
+    Client::AuthMethod authMethod = Client::AuthNone;
+    QString user, password;
+    QString clientHost; ///< empty for the local hostname
+    TransportFeatures features = Transport8BitMime | TransportSmtpUtf8; ///< allowed transport features
+
+    /// Gets the destination key, as "host:port" (the path for local connections)
+    QString key() const;
+    /// Sets the given client up for the destination
+    void setup(Client &client) const;
+};
+
+
+
+/// Task run by a worker of a session pool
+class SessionTask
+{
+// construction
+public:
+    /// Dtor
+    virtual ~SessionTask() = default;
+
+// public interface
+public:
+    /// Runs the task, with the client owned by the worker (open or not)
+    virtual void run(Client &client) = 0;
+    /// Cancels the task, dropped by a stopping pool before being run
+    /// \note Releases what the submitter acquired for the task (e.g. the limiter)
+    virtual void cancel() {}
+};
+
+
+
+/// Pool of Sessions to a destination, each one owned by its worker thread
+/// \note Workers are started on demand up to the max limit of the concurrency limiter, and keep
+///     their session open between tasks; tasks are run in submission order by the free workers
+/// \note The pool does not acquire the limiter: callers acquire it before submitting the tasks,
+///     and the tasks release it with their outcome (see `ConcurrencyLimiter::release()`)
+/// \note Thread-safe
+class SessionPool
+{
+// construction
+public:
+    /// Builds a pool of sessions to the given destination, adapting its concurrency with the
+    ///     given limiter settings
+    explicit SessionPool(const Destination &destination,
+        const ConcurrencyLimiter::Settings &settings = ConcurrencyLimiter::Settings());
+    /// Dtor, stopping the workers (the queued tasks are cancelled and dropped)
+    ~SessionPool();
+    /// Not copyable
+    Q_DISABLE_COPY(SessionPool)
+
+// public interface
+public:
+    /// Gets the destination
+    const Destination& destination() const;
+    /// Gets the concurrency limiter of the destination
+    ConcurrencyLimiter& limiter();
+    /// Sets the metrics registry the clients and the pool report to (limit, transactions in flight,
+    ///     queued tasks and workers), labeled with the destination; nullptr to disable metrics
+    /// \note The registry is not owned and must outlive the pool
+    /// \note To be set before submitting any task
+    void setMetricsRegistry(MetricsRegistry *registry);
+
+    /// Queues the given task, taking its ownership
+    /// \return True on success, False whether the pool is stopping (the task being deleted,
+    ///     not cancelled)
+    bool submit(SessionTask *task);
+    /// Waits for the queued and running tasks to be done, up to the given msecs (negative for ever)
+    /// \return True whether done, False on timeout
+    bool waitForDone(int msecs = -1);
+    /// Gets the amount of tasks waiting for a worker
+    int queuedCount() const;
+    /// Gets the amount of started workers
+    int workerCount() const;
+
+// private members
+private:
+    PRIVATE_DATA_PTR(d)
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_POOL_H
@@ -0,0 +1,169 @@
+#include "smtp_ratelimit.h"
+
+#include <QDateTime>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPair>
+#include <cmath>
+
+// namespace usage
+using namespace Smtp;
+
+// TokenBucket
+
+TokenBucket::TokenBucket(double capacity, double ratePerSecond)
+    : d_capacity(qMax(capacity, 0.0)), d_rate(qMax(ratePerSecond, 0.0) / 1000.0), d_tokens(d_capacity) {}
+
+void TokenBucket::refill(qint64 nowMsecs)
+{
+    if (d_refillMsecs >= 0 && nowMsecs > d_refillMsecs)
+        d_tokens = qMin(d_capacity, d_tokens + double(nowMsecs - d_refillMsecs) * d_rate);
+    d_refillMsecs = qMax(d_refillMsecs, nowMsecs);
+}
+
+qint64 TokenBucket::delay(double amount, qint64 nowMsecs)
+{
+    // fast return whether unlimited
+    if (isUnlimited())
+        return 0;
+    refill(nowMsecs);
+    // amounts beyond the capacity wait for a full bucket
+    const double required = qMin(amount, d_capacity);
+    if (d_tokens >= required)
+        return 0;
+    return qint64(std::ceil((required - d_tokens) / d_rate));
+}
+
+void TokenBucket::take(double amount, qint64 nowMsecs)
+{
+    // fast return whether unlimited
+    if (isUnlimited())
+        return;
+    refill(nowMsecs);
+    d_tokens -= amount;
+}
+
+void TokenBucket::giveBack(double amount)
+{
+    // fast return whether unlimited
+    if (isUnlimited())
+        return;
+    d_tokens = qMin(d_capacity, d_tokens + amount);
+}
+
+
+
+// RateLimiter
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Token Buckets of a host or account
+struct pn_Buckets
+{
+    TokenBucket messages, recipients, bytes;
+
+    pn_Buckets() = default;
+    explicit pn_Buckets(const RateLimits &limits)
+    {
+        const double period = double(qMax<qint64>(limits.period, 1)) / 1000.0;
+        const double burst = qMax(limits.burst, 0.0);
+        // the capacity lets a single message through at least
+        if (limits.messages > 0.0)
+            messages = TokenBucket(qMax(1.0, limits.messages * burst), limits.messages / period);
+        if (limits.recipients > 0.0)
+            recipients = TokenBucket(qMax(1.0, limits.recipients * burst), limits.recipients / period);
+        if (limits.bytes > 0.0)
+            bytes = TokenBucket(qMax(1.0, limits.bytes * burst), limits.bytes / period);
+    }
+
+    // Gets the msecs to wait for the given transaction, zero whether allowed now
+    qint64 delay(int recipientCount, qint64 byteCount, qint64 nowMsecs)
+    {
+        return qMax(messages.delay(1.0, nowMsecs), qMax(recipients.delay(recipientCount, nowMsecs),
+            bytes.delay(double(byteCount), nowMsecs)));
+    }
+    // Takes the given transaction
+    void take(int recipientCount, qint64 byteCount, qint64 nowMsecs)
+    {
+        messages.take(1.0, nowMsecs);
+        recipients.take(recipientCount, nowMsecs);
+        bytes.take(double(byteCount), nowMsecs);
+    }
+    // Gives back the given transaction
+    void giveBack(int recipientCount, qint64 byteCount)
+    {
+        messages.giveBack(1.0);
+        recipients.giveBack(recipientCount);
+        bytes.giveBack(double(byteCount));
+    }
+};
+
+// Account Key, the host and the user
+typedef QPair<QString, QString> pn_AccountKey;
+
+} // PRIVATE UTILITY NAMESPACE
+
+struct Smtp::RateLimiter::PrivateData
+{
+    QMutex mutex;
+    QHash<QString, pn_Buckets> hosts;
+    QHash<pn_AccountKey, pn_Buckets> accounts;
+};
+
+RateLimiter::RateLimiter()
+    : d(new PrivateData()) {}
+
+RateLimiter::~RateLimiter()
+{
+    // free resources
+    delete d;
+}
+
+void RateLimiter::setHostLimits(const QString &host, const RateLimits &limits)
+{
+    QMutexLocker locker (&d->mutex);
+    d->hosts.insert(host.toLower(), pn_Buckets(limits));
+}
+
+void RateLimiter::setAccountLimits(const QString &host, const QString &user, const RateLimits &limits)
+{
+    QMutexLocker locker (&d->mutex);
+    d->accounts.insert(pn_AccountKey(host.toLower(), user), pn_Buckets(limits));
+}
+
+qint64 RateLimiter::tryAcquire(const QString &host, const QString &user, int recipients, qint64 bytes,
+    qint64 nowMsecs)
+{
+    if (nowMsecs < 0)
+        nowMsecs = QDateTime::currentMSecsSinceEpoch();
+    QMutexLocker locker (&d->mutex);
+    auto hostIt = d->hosts.find(host.toLower());
+    auto accountIt = user.isEmpty()? d->accounts.end() : d->accounts.find(pn_AccountKey(host.toLower(), user));
+    // all the buckets must allow it
+    qint64 delay = 0;
+    if (hostIt != d->hosts.end())
+        delay = qMax(delay, hostIt->delay(recipients, bytes, nowMsecs));
+    if (accountIt != d->accounts.end())
+        delay = qMax(delay, accountIt->delay(recipients, bytes, nowMsecs));
+    if (delay > 0)
+        return delay;
+    // take them all
+    if (hostIt != d->hosts.end())
+        hostIt->take(recipients, bytes, nowMsecs);
+    if (accountIt != d->accounts.end())
+        accountIt->take(recipients, bytes, nowMsecs);
+    return 0;
+}
+
+void RateLimiter::release(const QString &host, const QString &user, int recipients, qint64 bytes)
+{
+    QMutexLocker locker (&d->mutex);
+    auto hostIt = d->hosts.find(host.toLower());
+    if (hostIt != d->hosts.end())
+        hostIt->giveBack(recipients, bytes);
+    auto accountIt = user.isEmpty()? d->accounts.end() : d->accounts.find(pn_AccountKey(host.toLower(), user));
+    if (accountIt != d->accounts.end())
+        accountIt->giveBack(recipients, bytes);
+}
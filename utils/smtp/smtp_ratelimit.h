@@ -0,0 +1,103 @@
+#ifndef SMTP_RATELIMIT_H
+#define SMTP_RATELIMIT_H
+
+#include <QString>
+#include "utils/macros.h"
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// Token Bucket, refilled continuously up to its capacity
+/// \note Taking more tokens than available leaves a debt, so that amounts beyond the capacity
+///     (e.g. big messages) are let through once the bucket is full, then paid back over time
+/// \warning Not thread-safe
+class TokenBucket
+{
+// construction
+public:
+    /// Builds a bucket of the given capacity, refilled by the given tokens per second
+    /// \note Zero rate for an unlimited bucket
+    explicit TokenBucket(double capacity = 0.0, double ratePerSecond = 0.0);
+
+// public interface
+public:
+    /// Checks whether the bucket is unlimited
+    inline bool isUnlimited() const { return (d_rate <= 0.0); }
+    /// Gets the msecs to wait (since the given time, msecs since epoch) for the given amount
+    /// \return Zero whether available now
+    qint64 delay(double amount, qint64 nowMsecs);
+    /// Takes the given amount at the given time (msecs since epoch), whether available or not
+    void take(double amount, qint64 nowMsecs);
+    /// Gives back the given amount, taken by a transaction which did not take place
+    void giveBack(double amount);
+
+// private interface
+private:
+    /// Refills the bucket up to the given time
+    void refill(qint64 nowMsecs);
+
+// private members
+private:
+    double d_capacity = 0.0;
+    double d_rate = 0.0; // tokens per msec
+    double d_tokens = 0.0;
+    qint64 d_refillMsecs = -1; // last refill time, -1 whether never refilled
+};
+
+
+
+/// Rate Limits of a server host or of an account, as amounts per period
+struct RateLimits
+{
+    double messages = 0.0; ///< messages per period, zero for no limit
+    double recipients = 0.0; ///< recipients per period, zero for no limit
+    double bytes = 0.0; ///< encoded message bytes per period, zero for no limit
+    qint64 period = 60 * 1000; ///< msecs
+    double burst = 0.1; ///< bucket capacity, as a fraction of the amounts per period (one message at least)
+};
+
+
+
+/// Rate Limiter of the message transactions, by server host and by account user of a host
+/// \note Each host and account has its token buckets of messages, recipients and bytes: a
+///     transaction starts only when all the buckets of its host and account allow it
+/// \note Accounts are told apart by host, the same user of different hosts being different accounts
+/// \note Thread-safe
+class RateLimiter
+{
+// construction
+public:
+    /// Ctor
+    RateLimiter();
+    /// Dtor
+    ~RateLimiter();
+    /// Not copyable
+    Q_DISABLE_COPY(RateLimiter)
+
+// public interface
+public:
+    /// Sets the limits of the given server host, resetting its buckets
+    void setHostLimits(const QString &host, const RateLimits &limits);
+    /// Sets the limits of the given account user of the given server host, resetting its buckets
+    void setAccountLimits(const QString &host, const QString &user, const RateLimits &limits);
+
+    /// Tries starting a transaction of the given recipients and bytes, to the given host with the
+    ///     given account (empty whether none), at the given time (msecs since epoch, negative for now)
+    /// \return Zero whether allowed (the tokens being taken), otherwise the msecs to wait
+    ///     before trying again (no token being taken)
+    qint64 tryAcquire(const QString &host, const QString &user, int recipients, qint64 bytes,
+        qint64 nowMsecs = -1);
+    /// Gives back the tokens of a transaction acquired by `tryAcquire(..)` which did not take place
+    ///     (e.g. the server being unavailable)
+    void release(const QString &host, const QString &user, int recipients, qint64 bytes);
+
+// private members
+private:
+    PRIVATE_DATA_PTR(d)
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_RATELIMIT_H
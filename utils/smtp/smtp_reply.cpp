@@ -0,0 +1,194 @@
+#include "smtp_reply.h"
+
+#include <cstring>
+
+// namespace usage
+using namespace Smtp;
+
+
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Checks whether the given char is a digit
+inline bool pn_isDigit(char c)
+{
+    return (c >= '0' && c <= '9');
+}
+// Parses a number of 1 up to 3 digits, returning the amount of consumed chars (0 on failure)
+int pn_parseSmallNumber(const char *data, int size, int &value)
+{
+    // parse up to 3 digits
+    int ix = 0;
+    value = 0;
+    while (ix < size && ix < 3 && pn_isDigit(data[ix])) {
+        value = value * 10 + (data[ix] - '0');
+        ix += 1;
+    }
+    // return consumed chars
+    return ix;
+}
+// Tries parsing an enhanced status code ("x.y.z ") at the beginning of the given text
+// \return The amount of consumed chars, the trailing space included (0 whether not found)
+int pn_parseEnhancedCode(const char *data, int size, int expectedClass, EnhancedStatusCode &code)
+{
+    // the class is a single digit, matching the reply class
+    if (size < 5 || !pn_isDigit(data[0]) || (data[0] - '0') != expectedClass || data[1] != '.')
+        return 0;
+    int ix = 2;
+    // subject
+    int subject = 0;
+    const int subjectSize = pn_parseSmallNumber(data + ix, size - ix, subject);
+    if (subjectSize == 0 || ix + subjectSize >= size || data[ix + subjectSize] != '.')
+        return 0;
+    ix += subjectSize + 1;
+    // detail
+    int detail = 0;
+    const int detailSize = pn_parseSmallNumber(data + ix, size - ix, detail);
+    if (detailSize == 0)
+        return 0;
+    ix += detailSize;
+    // must be followed by a space or by the end of the text
+    if (ix < size && data[ix] != ' ')
+        return 0;
+    // store it
+    code.statusClass = expectedClass;
+    code.subject = subject;
+    code.detail = detail;
+    // consume the trailing space too
+    return (ix < size)? ix + 1 : ix;
+}
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+// Reply Utils
+
+ReplySeverity Smtp::classifyReply(int code, const EnhancedStatusCode &enhancedCode)
+{
+    // no reply at all, the session failed before
+    if (code == 0)
+        return ReplyTransient;
+    if (code < 400)
+        return ReplyPositive;
+    if (code < 500)
+        return ReplyTransient;
+    // too many recipients, the remaining ones are to be sent in a later transaction
+    if (code == 552 && enhancedCode.subject == 5 && enhancedCode.detail == 3)
+        return ReplyTransient;
+    return ReplyPermanent;
+}
+
+
+
+// EnhancedStatusCode
+
+QByteArray EnhancedStatusCode::toByteArray() const
+{
+    // fast return for invalid codes
+    if (!isValid())
+        return QByteArray();
+    // compose it
+    return QByteArray::number(statusClass) + '.' + QByteArray::number(subject)
+        + '.' + QByteArray::number(detail);
+}
+
+
+
+// Reply
+
+QByteArray Reply::text() const
+{
+    // allocate resulting text
+    QByteArray joined;
+    // join all lines
+    for (int ix = 0, max = lines.size(); ix < max; ++ix) {
+        if (ix >= 1)
+            joined += '\n';
+        joined.append(lines.at(ix).data, lines.at(ix).size);
+    }
+    // return it
+    return joined;
+}
+
+void Reply::clear()
+{
+    code = 0;
+    enhancedCode = EnhancedStatusCode();
+    lines.clear();
+}
+
+
+
+// ReplyParser
+
+ReplyParser::Result ReplyParser::parse(const char *data, int size, Reply &reply, int &consumed)
+{
+    // parse all complete lines not parsed yet
+    while (d_scanned < size) {
+        // look for the end of the line
+        const char *lineStart = data + d_scanned;
+        const auto *lineFeed = static_cast<const char*>(
+            std::memchr(lineStart, '\n', size_t(size - d_scanned)));
+        if (lineFeed == nullptr)
+            return ReplyIncomplete;
+        // computes the line size, excluding the line break
+        int lineSize = int(lineFeed - lineStart);
+        if (lineSize > 0 && lineStart[lineSize - 1] == '\r')
+            lineSize -= 1;
+
+        // the line starts with the 3-digits code
+        if (lineSize < 3 || !pn_isDigit(lineStart[0])
+            || !pn_isDigit(lineStart[1]) || !pn_isDigit(lineStart[2])) {
+            reset();
+            return ReplyMalformed;
+        }
+        const int code = (lineStart[0] - '0') * 100 + (lineStart[1] - '0') * 10 + (lineStart[2] - '0');
+        // all lines of a reply share the same code
+        if (!d_lines.isEmpty() && code != d_code) {
+            reset();
+            return ReplyMalformed;
+        }
+        d_code = code;
+        // followed by the separator: '-' for continuation lines, ' ' (or nothing) for the last line
+        const char separator = (lineSize > 3)? lineStart[3] : ' ';
+        if (separator != ' ' && separator != '-') {
+            reset();
+            return ReplyMalformed;
+        }
+
+        // the text, without an optional enhanced code
+        int textOffset = (lineSize > 3)? 4 : 3;
+        EnhancedStatusCode enhancedCode;
+        textOffset += pn_parseEnhancedCode(lineStart + textOffset, lineSize - textOffset,
+            code / 100, enhancedCode);
+        if (d_lines.isEmpty())
+            d_enhancedCode = enhancedCode;
+        d_lines.append(LineRef { d_scanned + textOffset, lineSize - textOffset });
+        // move to the next line
+        d_scanned = int(lineFeed - data) + 1;
+
+        // whether it is the last line, the reply is complete
+        if (separator == ' ') {
+            reply.code = d_code;
+            reply.enhancedCode = d_enhancedCode;
+            reply.lines.clear();
+            for (const auto &line : d_lines)
+                reply.lines.append(ReplyLine { data + line.offset, line.size });
+            consumed = d_scanned;
+            reset();
+            return ReplyComplete;
+        }
+    }
+    // wait for more data
+    return ReplyIncomplete;
+}
+
+void ReplyParser::reset()
+{
+    d_lines.clear();
+    d_enhancedCode = EnhancedStatusCode();
+    d_code = 0;
+    d_scanned = 0;
+}
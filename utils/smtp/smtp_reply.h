@@ -0,0 +1,112 @@
+#ifndef SMTP_REPLY_H
+#define SMTP_REPLY_H
+
+#include <QByteArray>
+#include <QVarLengthArray>
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// Non-Owning View over a Reply text line
+struct ReplyLine
+{
+    const char *data = nullptr; ///< first char of the text
+    int size = 0; ///< amount of chars of the text
+
+    /// Checks whether the text is empty
+    inline bool isEmpty() const { return (size == 0); }
+    /// Gets a deep copy of the text
+    inline QByteArray toByteArray() const { return QByteArray(data, size); }
+};
+
+
+
+/// Enhanced Mail System Status Code (RFC 3463), as "class.subject.detail"
+struct EnhancedStatusCode
+{
+    int statusClass = 0; ///< 2 (success), 4 (persistent transient failure) or 5 (permanent failure)
+    int subject = 0;
+    int detail = 0;
+
+    /// Checks whether the code was received
+    inline bool isValid() const { return (statusClass != 0); }
+    /// Gets the code as "class.subject.detail"
+    QByteArray toByteArray() const;
+};
+
+
+
+/// Reply Severities, as for retrying the failed command
+enum ReplySeverity
+{
+    ReplyPositive, ///< 2xx and 3xx replies
+    ReplyTransient, ///< 4xx replies and missing ones (ex: connection failures), worth retrying later
+    ReplyPermanent ///< 5xx replies, not worth retrying
+};
+/// Classifies the given reply code, refined by the enhanced code whether received
+/// \note "Too many recipients" (552 with X.5.3) is transient, as for RFC 5321 (4.5.3.1.10)
+ReplySeverity classifyReply(int code, const EnhancedStatusCode &enhancedCode = EnhancedStatusCode());
+
+
+
+/// Server Reply, possibly made of multiple lines
+/// \warning Text lines reference the parsed buffer: they are valid as long as it is not changed
+struct Reply
+{
+    int code = 0; ///< 3-digits reply code
+    EnhancedStatusCode enhancedCode; ///< enhanced code of the first line, whether any
+    QVarLengthArray<ReplyLine, 16> lines; ///< text lines, without code and enhanced code
+
+    /// Gets the reply class (the first digit of the code)
+    inline int codeClass() const { return code / 100; }
+    /// Gets the reply severity
+    inline ReplySeverity severity() const { return classifyReply(code, enhancedCode); }
+    /// Gets the text of all lines, joined by new-lines
+    QByteArray text() const;
+    /// Clears the reply
+    void clear();
+};
+
+
+
+/// Incremental Reply Parser
+/// \note The parser works in place over the given data, with no allocation per line,
+///     and does not rescan lines already parsed by a previous incomplete attempt
+/// \note Several replies (ex: pipelined ones) can be parsed from the same data, one by one
+class ReplyParser
+{
+// public definitions
+public:
+    /// Parse Results
+    enum Result
+    {
+        ReplyIncomplete, ///< more data is required
+        ReplyComplete, ///< a full reply was parsed
+        ReplyMalformed ///< the data is not a valid reply
+    };
+
+// public interface
+public:
+    /// Parses the reply starting at the given data
+    /// \param consumed On complete, the amount of bytes taken by the reply
+    /// \note After an incomplete result, call it again with the same data followed by new bytes
+    ///     (the data may be moved in memory, but its start must be the same)
+    Result parse(const char *data, int size, Reply &reply, int &consumed);
+    /// Resets the parser, dropping the state of the reply being parsed
+    void reset();
+
+// private members
+private:
+    /// Parsed line location, relative to the reply start
+    struct LineRef { int offset; int size; };
+    QVarLengthArray<LineRef, 16> d_lines;
+    EnhancedStatusCode d_enhancedCode;
+    int d_code = 0;
+    int d_scanned = 0;
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_REPLY_H
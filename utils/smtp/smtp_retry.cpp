@@ -0,0 +1,94 @@
+#include "smtp_retry.h"
+
+#include <cmath>
+#include <random>
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Gets a random number in [0, 1), from a generator of the calling thread
+double pn_random()
+{
+    thread_local std::mt19937_64 generator { std::random_device()() };
+    return std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+}
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+// RetryPolicy
+
+qint64 RetryPolicy::delay(int attempt) const
+{
+    // exponential backoff, bounded
+    const double backoff = qMin(double(maxDelay),
+        double(initialDelay) * std::pow(multiplier, double(qMax(attempt, 1) - 1)));
+    // randomize part of it away
+    const double jitterFraction = qBound(0.0, jitter, 1.0);
+    return qMax<qint64>(0, qint64(backoff * (1.0 - jitterFraction * pn_random())));
+}
+
+bool RetryPolicy::isExhausted(int attempts, qint64 age) const
+{
+    return (maxAttempts > 0 && attempts >= maxAttempts) || (maxAge > 0 && age >= maxAge);
+}
+
+
+
+// RetryWheel
+
+RetryWheel::RetryWheel(qint64 tick, int slotCount)
+    : d_slots(qMax(slotCount, 1)), d_tick(qMax<qint64>(tick, 1)) {}
+
+void RetryWheel::schedule(quint64 id, qint64 dueMsecs)
+{
+    // times already advanced over are due on the next tick
+    qint64 dueTick = dueMsecs / d_tick;
+    if (d_lastTick >= 0 && dueTick <= d_lastTick)
+        dueTick = d_lastTick + 1;
+    d_due.insert(id, dueMsecs);
+    d_slots[int(dueTick % d_slots.size())].append({ id, dueMsecs });
+}
+
+bool RetryWheel::cancel(quint64 id)
+{
+    // the timer is dropped from its slot once reached
+    return (d_due.remove(id) > 0);
+}
+
+QList<quint64> RetryWheel::advance(qint64 nowMsecs)
+{
+    QList<quint64> due;
+    const qint64 nowTick = nowMsecs / d_tick;
+    // fast return whether already advanced
+    if (d_lastTick >= nowTick)
+        return due;
+    // visit each slot once at most, from the one following the last tick
+    const qint64 slotCount = d_slots.size();
+    const qint64 firstTick = (d_lastTick < 0)? nowTick - slotCount + 1 : qMax(d_lastTick + 1, nowTick - slotCount + 1);
+    for (qint64 tick = firstTick; tick <= nowTick; ++tick) {
+        auto &slot = d_slots[int(((tick % slotCount) + slotCount) % slotCount)];
+        int kept = 0;
+        for (int ix = 0; ix < slot.size(); ++ix) {
+            const Timer timer = slot.at(ix);
+            const auto it = d_due.constFind(timer.id);
+            // drop cancelled and rescheduled timers
+            if (it == d_due.constEnd() || it.value() != timer.dueMsecs)
+                continue;
+            // due, or kept for a following turn
+            if (timer.dueMsecs / d_tick <= nowTick) {
+                due.append(timer.id);
+                d_due.remove(timer.id);
+            } else {
+                slot[kept++] = timer;
+            }
+        }
+        slot.resize(kept);
+    }
+    d_lastTick = nowTick;
+    return due;
+}
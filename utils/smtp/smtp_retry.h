@@ -0,0 +1,74 @@
+#ifndef SMTP_RETRY_H
+#define SMTP_RETRY_H
+
+#include <QHash>
+#include <QList>
+#include <QVector>
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// Retry Policy, delaying the attempts with exponential backoff and jitter
+struct RetryPolicy
+{
+    qint64 initialDelay = 60 * 1000; ///< msecs before the second attempt
+    qint64 maxDelay = 4 * 3600 * 1000; ///< max msecs between attempts
+    double multiplier = 2.0; ///< delay growth per failed attempt
+    double jitter = 0.5; ///< fraction of the delay randomized away, spreading the retries of a burst
+    int maxAttempts = 12; ///< attempts before giving up, zero for no limit
+    qint64 maxAge = 5LL * 24 * 3600 * 1000; ///< msecs since enqueue before giving up, zero for no limit
+
+    /// Gets the delay (msecs) after the given failed attempt (1 for the first one)
+    /// \note The delay is picked in [(1 - jitter) * backoff, backoff], backoff growing up to maxDelay
+    qint64 delay(int attempt) const;
+    /// Checks whether a message is to be given up after the given failed attempts and age (msecs)
+    bool isExhausted(int attempts, qint64 age) const;
+};
+
+
+
+/// Hashed Timer Wheel, tracking the due time of the scheduled retries
+/// \note Scheduling and cancelling cost O(1), advancing costs the ticks elapsed plus the due timers;
+///     timers beyond a wheel turn stay in their slot for the following turns
+/// \note Rescheduling an id replaces its previous due time, cancelled timers are dropped lazily
+/// \warning Not thread-safe
+class RetryWheel
+{
+// construction
+public:
+    /// Builds a wheel of the given tick (msecs) and amount of slots
+    explicit RetryWheel(qint64 tick = 1000, int slotCount = 512);
+
+// public interface
+public:
+    /// Gets the tick (msecs), the resolution of the due times
+    inline qint64 tick() const { return d_tick; }
+    /// Gets the amount of scheduled ids
+    inline int count() const { return d_due.size(); }
+    /// Checks whether the given id is scheduled
+    inline bool contains(quint64 id) const { return d_due.contains(id); }
+
+    /// Schedules the given id at the given due time (msecs since epoch)
+    void schedule(quint64 id, qint64 dueMsecs);
+    /// Cancels the given id
+    /// \return True whether it was scheduled, False otherwise
+    bool cancel(quint64 id);
+    /// Advances the wheel up to the given time (msecs since epoch), unscheduling the due ids
+    /// \return The due ids, by due tick
+    QList<quint64> advance(qint64 nowMsecs);
+
+// private members
+private:
+    /// Scheduled Timer
+    struct Timer { quint64 id; qint64 dueMsecs; };
+    QVector<QVector<Timer>> d_slots;
+    QHash<quint64, qint64> d_due; // due time of the scheduled ids
+    qint64 d_tick = 1000;
+    qint64 d_lastTick = -1; // last tick advanced to, -1 whether never advanced
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_RETRY_H
@@ -0,0 +1,793 @@
+#include "smtp_spool.h"
+
+#include <QBuffer>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QWaitCondition>
+#include <QtEndian>
+#include <algorithm>
+#include "utils/rtloghandler.h"
+
+#ifdef Q_OS_UNIX
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Record Types
+enum pn_RecordType : quint16
+{
+    MessageRecord = 1, // payload: meta size (u32), meta, encoded data
+    DeferRecord = 2, // payload: attempts (i32), next attempt msecs (i64)
+    CompleteRecord = 3 // no payload
+};
+// Record Header: magic (u32), type (u16), reserved (u16), id (u64), payload size (u32), crc32 (u32)
+// \note The CRC32 covers the header from the type on (crc excluded) and the payload
+constexpr quint32 pn_recordMagic = 0x4C505353; // "SSPL"
+constexpr int pn_headerSize = 24;
+constexpr int pn_crcOffset = 20;
+// Index: magic (u32), then a QDataStream of the index contents, then its crc32 (u32)
+constexpr quint32 pn_indexMagic = 0x58495353; // "SSIX"
+constexpr int pn_indexVersion = 1;
+
+// Log the error and fail (return false)
+bool pn_fail(const QString &err, const CallContext &ctx)
+{
+    // log the error as a warning
+    RTLogHandler(ctx, RTLogHandler::Warning, err);
+    // fail
+    return false;
+}
+
+// CRC32 Lookup Table (IEEE 802.3, reflected)
+struct pn_Crc32Table
+{
+    quint32 values[256];
+    pn_Crc32Table()
+    {
+        for (quint32 ix = 0; ix < 256; ++ix) {
+            quint32 crc = ix;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc & 1)? (crc >> 1) ^ 0xEDB88320u : (crc >> 1);
+            values[ix] = crc;
+        }
+    }
+};
+// Updates the given CRC32 (starting from zero) with the given data
+quint32 pn_crc32(quint32 crc, const char *data, qint64 size)
+{
+    static const pn_Crc32Table table;
+    crc = ~crc;
+    for (qint64 ix = 0; ix < size; ++ix)
+        crc = table.values[(crc ^ quint8(data[ix])) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Gets the file name of the given segment
+inline QString pn_segmentName(int segment)
+{
+    return QStringLiteral("segment-%1.log").arg(segment, 8, 10, QLatin1Char('0'));
+}
+// Syncs the given file (or directory) descriptor to disk
+bool pn_syncDescriptor(int fd)
+{
+#ifdef Q_OS_UNIX
+    return (::fsync(fd) == 0);
+#else
+    Q_UNUSED(fd)
+    return true;
+#endif
+}
+// Syncs the given directory to disk, making the created and renamed files durable
+void pn_syncDirectory(const QString &path)
+{
+#ifdef Q_OS_UNIX
+    const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+    if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+    }
+#else
+    Q_UNUSED(path)
+#endif
+}
+
+// Serializes the envelope and the creation time
+QByteArray pn_encodeMeta(const Envelope &envelope, qint64 createdMsecs)
+{
+    QByteArray meta;
+    QDataStream out (&meta, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << envelope.sender << envelope.recipients << qint32(envelope.features) << createdMsecs;
+    return meta;
+}
+// Deserializes the envelope and the creation time
+bool pn_decodeMeta(const QByteArray &meta, Envelope &envelope, qint64 &createdMsecs)
+{
+    QDataStream in (meta);
+    in.setVersion(QDataStream::Qt_5_0);
+    qint32 features = 0;
+    in >> envelope.sender >> envelope.recipients >> features >> createdMsecs;
+    envelope.features = TransportFeatures(QFlag(features));
+    return (in.status() == QDataStream::Ok);
+}
+
+// Device reading a range of a segment file
+class pn_RangeReader : public QIODevice
+{
+public:
+    pn_RangeReader(const QString &path, qint64 begin, qint64 size)
+        : d_file(path), d_begin(begin), d_size(size) {}
+
+    // Opens the file positioned at the range start
+    bool openRange()
+    {
+        return d_file.open(QIODevice::ReadOnly) && d_file.seek(d_begin) && open(QIODevice::ReadOnly);
+    }
+    bool isSequential() const override { return true; }
+    qint64 bytesAvailable() const override { return (d_size - d_read) + QIODevice::bytesAvailable(); }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        const qint64 toRead = qMin(maxSize, d_size - d_read);
+        if (toRead <= 0)
+            return (d_read >= d_size)? 0 : -1;
+        const qint64 read = d_file.read(data, toRead);
+        if (read <= 0)
+            return -1;
+        d_read += read;
+        return read;
+    }
+    qint64 writeData(const char*, qint64) override { return -1; }
+
+private:
+    QFile d_file;
+    qint64 d_begin = 0;
+    qint64 d_size = 0;
+    qint64 d_read = 0;
+};
+
+// Background Syncer, bounding the time a record stays unsynced with no following append
+class pn_SyncThread : public QThread
+{
+public:
+    pn_SyncThread(Spool *spool, int interval)
+        : d_spool(spool), d_interval(interval) {}
+
+    // Stops the thread, waiting for it
+    void stop()
+    {
+        {
+            QMutexLocker locker (&d_mutex);
+            d_stopping = true;
+            d_wakeUp.wakeAll();
+        }
+        wait();
+    }
+
+protected:
+    void run() override
+    {
+        QMutexLocker locker (&d_mutex);
+        while (!d_stopping) {
+            d_wakeUp.wait(&d_mutex, (unsigned long)d_interval);
+            if (d_stopping)
+                break;
+            // sync out of the lock, so that stopping does not wait for it
+            locker.unlock();
+            d_spool->sync();
+            locker.relock();
+        }
+    }
+
+private:
+    Spool *d_spool = nullptr;
+    int d_interval = 0;
+    QMutex d_mutex;
+    QWaitCondition d_wakeUp;
+    bool d_stopping = false;
+};
+
+// Spooled Message, with its location
+struct pn_SpoolEntry
+{
+    Spool::Entry entry;
+    int segment = 0;
+    qint64 dataOffset = 0;
+};
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+// Spool
+
+struct Smtp::Spool::PrivateData
+{
+    mutable QMutex mutex;
+    QString directory;
+    qint64 segmentSize = 64 * 1024 * 1024;
+    int syncRecords = 64;
+    int syncInterval = 50;
+
+    bool open = false;
+    QFile active; // segment being appended
+    int activeSegment = 0;
+    quint64 nextId = 1;
+    QMap<quint64, pn_SpoolEntry> entries; // pending messages, in enqueue order
+    QMap<int, int> segmentMessages; // pending messages of each segment
+    int unsyncedRecords = 0;
+    QElapsedTimer unsyncedTimer; // started on the first record not synced
+    pn_SyncThread *syncThread = nullptr; // running while open, whether syncing on an interval
+    int indexSegment = 0; // segment the index on disk replays from, zero whether no index
+
+    // Appends a record, syncing the batch whether due
+    bool append(pn_RecordType type, quint64 id, const QByteArray &head, const QByteArray &tail, qint64 *tailOffset);
+    // Syncs the appended records
+    bool syncActive();
+    // Opens the given segment for appending
+    bool openSegment(int segment);
+    // Replays the given segment from the given offset, truncating a torn tail whether the last one
+    void replaySegment(int segment, qint64 offset, bool isLast);
+    // Loads the index, getting the position to replay from
+    bool loadIndex(int &segment, qint64 &offset);
+    // Writes the index of the pending messages, replacing the previous one
+    bool writeIndex();
+    // Deletes the oldest segments with no pending message, but the active one
+    // \note The index is written again before deleting the segments it replays from
+    void dropSegments();
+};
+
+bool Spool::PrivateData::append(
+    pn_RecordType type, quint64 id, const QByteArray &head, const QByteArray &tail, qint64 *tailOffset)
+{
+    // rotate the segment whether full
+    if (active.size() >= segmentSize && !(syncActive() && openSegment(activeSegment + 1)))
+        return false;
+    // header, with the crc of the whole record
+    char header[pn_headerSize];
+    qToLittleEndian<quint32>(pn_recordMagic, header);
+    qToLittleEndian<quint16>(type, header + 4);
+    qToLittleEndian<quint16>(0, header + 6);
+    qToLittleEndian<quint64>(id, header + 8);
+    qToLittleEndian<quint32>(quint32(head.size() + tail.size()), header + 16);
+    quint32 crc = pn_crc32(0, header + 4, pn_crcOffset - 4);
+    crc = pn_crc32(crc, head.constData(), head.size());
+    crc = pn_crc32(crc, tail.constData(), tail.size());
+    qToLittleEndian<quint32>(crc, header + pn_crcOffset);
+    // write it, a torn write being dropped by the recovery
+    const qint64 offset = active.size();
+    if (active.write(header, pn_headerSize) != pn_headerSize
+            || active.write(head) != head.size() || active.write(tail) != tail.size()) {
+        active.resize(offset);
+        return pn_fail(QStringLiteral("unable to append to %1, error: %2")
+            .arg(active.fileName(), active.errorString()), CALL_CONTEXT);
+    }
+    if (tailOffset != nullptr)
+        *tailOffset = offset + pn_headerSize + head.size();
+    // sync the batch whether due
+    if (unsyncedRecords++ == 0)
+        unsyncedTimer.start();
+    if (unsyncedRecords >= syncRecords || unsyncedTimer.elapsed() >= syncInterval)
+        return syncActive();
+    // success
+    return true;
+}
+
+bool Spool::PrivateData::syncActive()
+{
+    // fast return whether there is nothing to sync
+    if (unsyncedRecords == 0)
+        return true;
+    if (!active.flush() || !pn_syncDescriptor(active.handle()))
+        return pn_fail(QStringLiteral("unable to sync %1, error: %2")
+            .arg(active.fileName(), active.errorString()), CALL_CONTEXT);
+    unsyncedRecords = 0;
+    return true;
+}
+
+bool Spool::PrivateData::openSegment(int segment)
+{
+    active.close();
+    active.setFileName(QDir(directory).filePath(pn_segmentName(segment)));
+    if (!active.open(QIODevice::ReadWrite | QIODevice::Append | QIODevice::Unbuffered))
+        return pn_fail(QStringLiteral("unable to open segment %1, error: %2")
+            .arg(active.fileName(), active.errorString()), CALL_CONTEXT);
+    activeSegment = segment;
+    segmentMessages.insert(segment, segmentMessages.value(segment));
+    // the segment name must survive a crash as well
+    pn_syncDirectory(directory);
+    // success
+    return true;
+}
+
+void Spool::PrivateData::replaySegment(int segment, qint64 offset, bool isLast)
+{
+    QFile file (QDir(directory).filePath(pn_segmentName(segment)));
+    if (!file.open(QIODevice::ReadOnly) || !file.seek(offset)) {
+        pn_fail(QStringLiteral("unable to replay segment %1").arg(file.fileName()), CALL_CONTEXT);
+        return;
+    }
+    QByteArray chunk;
+    while (true) {
+        // header
+        const qint64 recordOffset = file.pos();
+        char header[pn_headerSize];
+        if (file.read(header, pn_headerSize) != pn_headerSize) {
+            file.seek(recordOffset);
+            break;
+        }
+        const auto type = qFromLittleEndian<quint16>(header + 4);
+        const auto id = qFromLittleEndian<quint64>(header + 8);
+        const auto payloadSize = qint64(qFromLittleEndian<quint32>(header + 16));
+        if (qFromLittleEndian<quint32>(header) != pn_recordMagic || recordOffset + pn_headerSize + payloadSize > file.size()) {
+            file.seek(recordOffset);
+            break;
+        }
+        // payload, checking the crc chunk by chunk but keeping the meta only
+        quint32 crc = pn_crc32(0, header + 4, pn_crcOffset - 4);
+        QByteArray head;
+        qint64 remaining = payloadSize;
+        while (remaining > 0) {
+            chunk = file.read(qMin<qint64>(remaining, 1024 * 1024));
+            if (chunk.isEmpty())
+                break;
+            crc = pn_crc32(crc, chunk.constData(), chunk.size());
+            if (head.size() < 4096)
+                head += chunk.left(4096 - head.size());
+            remaining -= chunk.size();
+        }
+        if (remaining > 0 || crc != qFromLittleEndian<quint32>(header + pn_crcOffset)) {
+            file.seek(recordOffset);
+            break;
+        }
+        nextId = qMax(nextId, id + 1);
+
+        // apply the record
+        if (type == MessageRecord && head.size() >= 4) {
+            const auto metaSize = int(qFromLittleEndian<quint32>(head.constData()));
+            // the meta may exceed the kept head, read it again whether so
+            QByteArray meta = head.mid(4, metaSize);
+            if (meta.size() < metaSize) {
+                const qint64 resume = file.pos();
+                file.seek(recordOffset + pn_headerSize + 4);
+                meta = file.read(metaSize);
+                file.seek(resume);
+            }
+            pn_SpoolEntry spooled;
+            spooled.segment = segment;
+            spooled.dataOffset = recordOffset + pn_headerSize + 4 + metaSize;
+            spooled.entry.id = id;
+            spooled.entry.size = payloadSize - 4 - metaSize;
+            if (pn_decodeMeta(meta, spooled.entry.envelope, spooled.entry.createdMsecs) && !entries.contains(id)) {
+                entries.insert(id, spooled);
+                ++segmentMessages[segment];
+            }
+        } else if (type == DeferRecord && head.size() >= 12) {
+            auto it = entries.find(id);
+            if (it != entries.end()) {
+                it->entry.attempts = qFromLittleEndian<qint32>(head.constData());
+                it->entry.nextAttemptMsecs = qFromLittleEndian<qint64>(head.constData() + 4);
+            }
+        } else if (type == CompleteRecord) {
+            auto it = entries.find(id);
+            if (it != entries.end()) {
+                --segmentMessages[it->segment];
+                entries.erase(it);
+            }
+        }
+    }
+    // a torn or corrupted tail is dropped, so that appends follow the last valid record
+    if (!file.atEnd()) {
+        const qint64 validSize = file.pos();
+        if (isLast) {
+            RT_WARNING("spool: dropping %1 bytes of torn records from %2")
+                % QString::number(file.size() - validSize) % file.fileName();
+            file.close();
+            QFile::resize(file.fileName(), validSize);
+        } else {
+            RT_WARNING("spool: skipping corrupted records of %1 from offset %2")
+                % file.fileName() % QString::number(validSize);
+        }
+    }
+}
+
+bool Spool::PrivateData::loadIndex(int &segment, qint64 &offset)
+{
+    // read it whole
+    QFile file (QDir(directory).filePath("spool.index"));
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    const QByteArray data = file.readAll();
+    if (data.size() < 8 || qFromLittleEndian<quint32>(data.constData()) != pn_indexMagic)
+        return false;
+    const int contentsSize = data.size() - 8;
+    if (pn_crc32(0, data.constData() + 4, contentsSize) != qFromLittleEndian<quint32>(data.constData() + 4 + contentsSize))
+        return false;
+    // contents
+    QDataStream in (data.mid(4, contentsSize));
+    in.setVersion(QDataStream::Qt_5_0);
+    qint32 version = 0, count = 0;
+    quint64 indexNextId = 0;
+    in >> version >> indexNextId >> segment >> offset >> count;
+    if (version != pn_indexVersion)
+        return false;
+    QMap<quint64, pn_SpoolEntry> indexEntries;
+    QMap<int, int> indexSegments;
+    QHash<int, bool> existingSegments;
+    const QDir dir (directory);
+    for (int ix = 0; ix < count && in.status() == QDataStream::Ok; ++ix) {
+        pn_SpoolEntry spooled;
+        QByteArray meta;
+        in >> spooled.entry.id >> spooled.segment >> spooled.dataOffset >> spooled.entry.size
+            >> spooled.entry.attempts >> spooled.entry.nextAttemptMsecs >> meta;
+        if (!pn_decodeMeta(meta, spooled.entry.envelope, spooled.entry.createdMsecs))
+            return false;
+        // skip the messages whose segment is gone, deleted after the index was written
+        auto exists = existingSegments.find(spooled.segment);
+        if (exists == existingSegments.end())
+            exists = existingSegments.insert(spooled.segment, dir.exists(pn_segmentName(spooled.segment)));
+        if (!exists.value()) {
+            RT_WARNING("spool: index message %1 dropped, its segment is missing")
+                % QString::number(spooled.entry.id);
+            continue;
+        }
+        indexEntries.insert(spooled.entry.id, spooled);
+        ++indexSegments[spooled.segment];
+    }
+    if (in.status() != QDataStream::Ok)
+        return false;
+    // success
+    nextId = indexNextId;
+    entries.swap(indexEntries);
+    segmentMessages.swap(indexSegments);
+    indexSegment = segment;
+    return true;
+}
+
+bool Spool::PrivateData::writeIndex()
+{
+    // ensure the index covers synced records only
+    if (!syncActive())
+        return false;
+    // contents
+    QByteArray contents;
+    QDataStream out (&contents, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << qint32(pn_indexVersion) << nextId << activeSegment << active.size()
+        << qint32(entries.size());
+    for (const auto &spooled : entries)
+        out << spooled.entry.id << spooled.segment << spooled.dataOffset << spooled.entry.size
+            << spooled.entry.attempts << spooled.entry.nextAttemptMsecs
+            << pn_encodeMeta(spooled.entry.envelope, spooled.entry.createdMsecs);
+    QByteArray data (4, Qt::Uninitialized);
+    qToLittleEndian<quint32>(pn_indexMagic, data.data());
+    data += contents;
+    QByteArray crc (4, Qt::Uninitialized);
+    qToLittleEndian<quint32>(pn_crc32(0, contents.constData(), contents.size()), crc.data());
+    data += crc;
+    // write it aside, then replace the previous one
+    const QDir dir (directory);
+    QFile file (dir.filePath("spool.index.tmp"));
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(data) != data.size()
+            || !file.flush() || !pn_syncDescriptor(file.handle()))
+        return pn_fail(QStringLiteral("unable to write the spool index, error: %1").arg(file.errorString()), CALL_CONTEXT);
+    file.close();
+    // replace it atomically, so that a crash leaves either the previous index or the new one
+#ifdef Q_OS_UNIX
+    const bool replaced = (::rename(QFile::encodeName(file.fileName()).constData(),
+        QFile::encodeName(dir.filePath("spool.index")).constData()) == 0);
+#else
+    dir.remove("spool.index");
+    const bool replaced = dir.rename("spool.index.tmp", "spool.index");
+#endif
+    if (!replaced)
+        return pn_fail("unable to replace the spool index", CALL_CONTEXT);
+    pn_syncDirectory(directory);
+    indexSegment = activeSegment;
+    // success
+    return true;
+}
+
+void Spool::PrivateData::dropSegments()
+{
+    const QDir dir (directory);
+    // oldest first, so that completions are never dropped before their messages
+    while (!segmentMessages.isEmpty()) {
+        const auto it = segmentMessages.begin();
+        if (it.key() >= activeSegment || it.value() > 0)
+            break;
+        // the index must not replay from a deleted segment, bringing completed messages back
+        if (indexSegment > 0 && it.key() >= indexSegment && !writeIndex())
+            break;
+        dir.remove(pn_segmentName(it.key()));
+        segmentMessages.erase(it);
+    }
+}
+
+Spool::Spool()
+    : d(new PrivateData()) {}
+
+Spool::~Spool()
+{
+    // ensure it is closed
+    close();
+    // free resources
+    delete d;
+}
+
+void Spool::setSegmentSize(qint64 bytes)
+{
+    QMutexLocker locker (&d->mutex);
+    d->segmentSize = qMax<qint64>(bytes, 1024);
+}
+
+void Spool::setSyncBatch(int syncRecords, int syncInterval)
+{
+    QMutexLocker locker (&d->mutex);
+    d->syncRecords = qMax(syncRecords, 1);
+    d->syncInterval = qMax(syncInterval, 0);
+}
+
+bool Spool::open(const QString &directory)
+{
+    QMutexLocker locker (&d->mutex);
+    // ensure it is closed
+    if (d->open)
+        return pn_fail("unable to open, spool is open already", CALL_CONTEXT);
+    // ensure the directory exists
+    QDir dir (directory);
+    if (!dir.mkpath("."))
+        return pn_fail(QStringLiteral("unable to open, cannot create directory %1").arg(directory), CALL_CONTEXT);
+    d->directory = dir.absolutePath();
+    d->entries.clear();
+    d->segmentMessages.clear();
+    d->nextId = 1;
+    d->indexSegment = 0;
+
+    // list the segments, oldest first
+    QList<int> segments;
+    for (const auto &name : dir.entryList({ QStringLiteral("segment-*.log") }, QDir::Files, QDir::Name)) {
+        bool valid = false;
+        const int segment = name.mid(8, name.size() - 12).toInt(&valid);
+        if (valid)
+            segments.append(segment);
+    }
+    std::sort(segments.begin(), segments.end());
+    // load the index, replaying the segments from its position on, or all of them
+    int fromSegment = 0;
+    qint64 fromOffset = 0;
+    if (!d->loadIndex(fromSegment, fromOffset)) {
+        d->entries.clear();
+        d->segmentMessages.clear();
+        d->nextId = 1;
+        fromSegment = 0;
+        fromOffset = 0;
+    }
+    for (int ix = 0; ix < segments.size(); ++ix) {
+        const int segment = segments.at(ix);
+        if (segment < fromSegment)
+            continue;
+        d->replaySegment(segment, (segment == fromSegment)? fromOffset : 0, ix == segments.size() - 1);
+    }
+    // segments with no pending message are tracked as well, to be deleted
+    for (const int segment : segments)
+        d->segmentMessages.insert(segment, d->segmentMessages.value(segment));
+
+    // append to the last segment
+    if (!d->openSegment(segments.isEmpty()? 1 : segments.last()))
+        return false;
+    d->unsyncedRecords = 0;
+    d->open = true;
+    d->dropSegments();
+    // sync the records left unsynced on an interval, whether batched by time
+    if (d->syncInterval > 0) {
+        d->syncThread = new pn_SyncThread(this, d->syncInterval);
+        d->syncThread->start();
+    }
+    RT_DEBUG("spool: opened %1, %2 pending messages") % d->directory % QString::number(d->entries.size());
+    // success
+    return true;
+}
+
+void Spool::close()
+{
+    // fast return whether closed
+    {
+        QMutexLocker locker (&d->mutex);
+        if (!d->open)
+            return;
+    }
+    // stop the background syncer, out of the lock it may be waiting for
+    if (d->syncThread != nullptr) {
+        d->syncThread->stop();
+        delete d->syncThread;
+        d->syncThread = nullptr;
+    }
+    // leave an index for a fast recovery
+    checkpoint();
+    QMutexLocker locker (&d->mutex);
+    d->syncActive();
+    d->active.close();
+    d->entries.clear();
+    d->segmentMessages.clear();
+    d->open = false;
+}
+
+bool Spool::isOpen() const
+{
+    QMutexLocker locker (&d->mutex);
+    return d->open;
+}
+
+quint64 Spool::enqueue(const MimeMessage &msg, TransportFeatures features)
+{
+    // ensure the message is valid
+    if (!msg.isValid()) {
+        pn_fail("unable to enqueue, message is not valid", CALL_CONTEXT);
+        return 0;
+    }
+    // encode it, out of the lock
+    QByteArray data;
+    QBuffer buffer (&data);
+    buffer.open(QIODevice::WriteOnly);
+    if (!msg.writeToDev(buffer, features)) {
+        pn_fail("unable to enqueue, message encoding failed", CALL_CONTEXT);
+        return 0;
+    }
+    buffer.close();
+    return enqueue(Envelope::fromMessage(msg, features), data);
+}
+
+quint64 Spool::enqueue(const Envelope &envelope, const QByteArray &encodedData, qint64 createdMsecs)
+{
+    // ensure the envelope is valid
+    if (envelope.sender.isEmpty() || envelope.recipients.isEmpty()) {
+        pn_fail("unable to enqueue, envelope is not valid", CALL_CONTEXT);
+        return 0;
+    }
+    if (createdMsecs < 0)
+        createdMsecs = QDateTime::currentMSecsSinceEpoch();
+    const QByteArray meta = pn_encodeMeta(envelope, createdMsecs);
+    QByteArray head (4, Qt::Uninitialized);
+    qToLittleEndian<quint32>(quint32(meta.size()), head.data());
+    head += meta;
+
+    QMutexLocker locker (&d->mutex);
+    // ensure it is open
+    if (!d->open) {
+        pn_fail("unable to enqueue, spool is not open", CALL_CONTEXT);
+        return 0;
+    }
+    // append it
+    const quint64 id = d->nextId;
+    pn_SpoolEntry spooled;
+    if (!d->append(MessageRecord, id, head, encodedData, &spooled.dataOffset))
+        return 0;
+    ++d->nextId;
+    spooled.segment = d->activeSegment;
+    spooled.entry.id = id;
+    spooled.entry.envelope = envelope;
+    spooled.entry.size = encodedData.size();
+    spooled.entry.createdMsecs = createdMsecs;
+    d->entries.insert(id, spooled);
+    ++d->segmentMessages[spooled.segment];
+    return id;
+}
+
+bool Spool::sync()
+{
+    QMutexLocker locker (&d->mutex);
+    return d->open && d->syncActive();
+}
+
+int Spool::count() const
+{
+    QMutexLocker locker (&d->mutex);
+    return d->entries.size();
+}
+
+QList<Spool::Entry> Spool::pending(qint64 dueMsecs, int max) const
+{
+    QMutexLocker locker (&d->mutex);
+    QList<Entry> due;
+    for (const auto &spooled : d->entries) {
+        if (max >= 0 && due.size() >= max)
+            break;
+        if (dueMsecs < 0 || spooled.entry.nextAttemptMsecs <= dueMsecs)
+            due.append(spooled.entry);
+    }
+    return due;
+}
+
+QList<Spool::Entry> Spool::pendingAfter(quint64 id, int max) const
+{
+    QMutexLocker locker (&d->mutex);
+    QList<Entry> after;
+    for (auto it = d->entries.upperBound(id); it != d->entries.end(); ++it) {
+        if (max >= 0 && after.size() >= max)
+            break;
+        after.append(it->entry);
+    }
+    return after;
+}
+
+bool Spool::entry(quint64 id, Entry &entry) const
+{
+    QMutexLocker locker (&d->mutex);
+    const auto it = d->entries.constFind(id);
+    if (it == d->entries.constEnd())
+        return false;
+    entry = it->entry;
+    return true;
+}
+
+QIODevice* Spool::openData(quint64 id) const
+{
+    QMutexLocker locker (&d->mutex);
+    const auto it = d->entries.constFind(id);
+    if (it == d->entries.constEnd())
+        return nullptr;
+    // the reader has its own file, so it can be used out of the lock
+    auto *reader = new pn_RangeReader(
+        QDir(d->directory).filePath(pn_segmentName(it->segment)), it->dataOffset, it->entry.size);
+    if (!reader->openRange()) {
+        delete reader;
+        pn_fail(QStringLiteral("unable to read the data of message %1").arg(id), CALL_CONTEXT);
+        return nullptr;
+    }
+    return reader;
+}
+
+bool Spool::defer(quint64 id, qint64 nextAttemptMsecs, int attempts)
+{
+    QMutexLocker locker (&d->mutex);
+    auto it = d->entries.find(id);
+    if (!d->open || it == d->entries.end())
+        return false;
+    if (attempts < 0)
+        attempts = it->entry.attempts + 1;
+    QByteArray payload (12, Qt::Uninitialized);
+    qToLittleEndian<qint32>(attempts, payload.data());
+    qToLittleEndian<qint64>(nextAttemptMsecs, payload.data() + 4);
+    if (!d->append(DeferRecord, id, payload, QByteArray(), nullptr))
+        return false;
+    it->entry.attempts = attempts;
+    it->entry.nextAttemptMsecs = nextAttemptMsecs;
+    return true;
+}
+
+bool Spool::complete(quint64 id)
+{
+    QMutexLocker locker (&d->mutex);
+    auto it = d->entries.find(id);
+    if (!d->open || it == d->entries.end())
+        return false;
+    if (!d->append(CompleteRecord, id, QByteArray(), QByteArray(), nullptr))
+        return false;
+    --d->segmentMessages[it->segment];
+    d->entries.erase(it);
+    d->dropSegments();
+    return true;
+}
+
+bool Spool::checkpoint()
+{
+    QMutexLocker locker (&d->mutex);
+    return d->open && d->writeIndex();
+}
@@ -0,0 +1,115 @@
+#ifndef SMTP_SPOOL_H
+#define SMTP_SPOOL_H
+
+#include <QList>
+#include <QString>
+#include "utils/smtp/smtp_transport.h"
+#include "utils/macros.h"
+
+// fwd declarations
+class QIODevice;
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// Crash-Safe Outbound Spool, persisting encoded messages and their envelopes
+/// \note Records are appended to segment files ("segment-<n>.log"), each one checked by a CRC32:
+///     messages, deferrals (attempts and next attempt time) and completions
+/// \note Appends are synced to disk in batches: a message is durable once `sync()` returned,
+///     which happens on its own every `syncRecords` appends, and by a background thread every
+///     `syncInterval` msecs for the records left unsynced
+/// \note Opening the spool recovers it: the index ("spool.index", written by `checkpoint()`)
+///     is loaded and the segments are replayed from its position on, dropping a torn tail
+/// \note Segments with no pending message left are deleted, but the one being appended; the index
+///     is written again before deleting a segment it replays from
+/// \note Thread-safe, message data is read through devices owned by the reader
+class Spool
+{
+// public definitions
+public:
+    /// Spooled Message
+    struct Entry
+    {
+        quint64 id = 0;
+        Envelope envelope;
+        qint64 size = 0; ///< encoded data bytes
+        qint64 createdMsecs = 0; ///< enqueue time, msecs since epoch
+        int attempts = 0; ///< deferred delivery attempts
+        qint64 nextAttemptMsecs = 0; ///< earliest time of the next attempt, msecs since epoch
+    };
+
+// construction
+public:
+    /// Ctor
+    Spool();
+    /// Dtor, closing the spool
+    ~Spool();
+    /// Not copyable
+    Q_DISABLE_COPY(Spool)
+
+// public interface
+public:
+    /// Sets the size from which the segment being appended is rotated
+    /// \default As default 64MB
+    void setSegmentSize(qint64 bytes);
+    /// Sets the sync batching: appends are synced every given records or msecs, whatever first
+    /// \default As default 64 records or 50 msecs, a single record syncs each append
+    /// \note The interval of the background syncer is applied on the next open
+    void setSyncBatch(int syncRecords, int syncInterval);
+
+    /// Opens the spool into the given directory (created whether missing), recovering it
+    /// \return True on success, False otherwise
+    bool open(const QString &directory);
+    /// Closes the spool, syncing and writing the index
+    void close();
+    /// Checks whether the spool is open
+    bool isOpen() const;
+
+    /// Spools the given message, encoded with the given transport features
+    /// \return The id of the spooled message, zero on failure
+    quint64 enqueue(const MimeMessage &msg, TransportFeatures features = NoTransportFeatures);
+    /// Spools the given encoded message (not dot-stuffed), created at the given time (msecs since
+    ///     epoch, negative for now)
+    /// \return The id of the spooled message, zero on failure
+    quint64 enqueue(const Envelope &envelope, const QByteArray &encodedData, qint64 createdMsecs = -1);
+    /// Syncs all the appended records to disk
+    /// \return True on success, False otherwise
+    bool sync();
+
+    /// Gets the amount of pending messages
+    int count() const;
+    /// Gets the pending messages, in enqueue order, due at the given time (msecs since epoch,
+    ///     negative for all of them) up to the given amount (negative for all)
+    QList<Entry> pending(qint64 dueMsecs = -1, int max = -1) const;
+    /// Gets the pending messages enqueued after the given one, in enqueue order, up to the given
+    ///     amount (negative for all)
+    QList<Entry> pendingAfter(quint64 id, int max = -1) const;
+    /// Gets the given pending message
+    /// \return True whether found, False otherwise
+    bool entry(quint64 id, Entry &entry) const;
+    /// Opens a device reading the encoded data of the given pending message
+    /// \note The caller takes the ownership of the device
+    /// \return The device on success, nullptr otherwise
+    QIODevice* openData(quint64 id) const;
+
+    /// Defers the given pending message, setting its attempts (negative for counting one more)
+    /// \return True on success, False otherwise
+    bool defer(quint64 id, qint64 nextAttemptMsecs, int attempts = -1);
+    /// Completes the given pending message (delivered or given up), removing it
+    /// \return True on success, False otherwise
+    bool complete(quint64 id);
+
+    /// Writes the index, so that the next recovery replays the segments from here on
+    /// \return True on success, False otherwise
+    bool checkpoint();
+
+// private members
+private:
+    PRIVATE_DATA_PTR(d)
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_SPOOL_H
@@ -0,0 +1,221 @@
+#include "smtp_timings.h"
+
+#include <QtAlgorithms>
+#include <limits>
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Min value placeholder for empty histograms
+constexpr qint64 pn_noMin = std::numeric_limits<qint64>::max();
+
+// Atomically lowers the given value down to the candidate
+void pn_atomicMin(QAtomicInteger<qint64> &value, qint64 candidate)
+{
+    qint64 current = value.load();
+    while (candidate < current && !value.testAndSetOrdered(current, candidate, current)) {}
+}
+// Atomically raises the given value up to the candidate
+void pn_atomicMax(QAtomicInteger<qint64> &value, qint64 candidate)
+{
+    qint64 current = value.load();
+    while (candidate > current && !value.testAndSetOrdered(current, candidate, current)) {}
+}
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+// LatencyHistogram
+
+LatencyHistogram::LatencyHistogram()
+    : d_min(pn_noMin) {}
+
+void LatencyHistogram::record(qint64 usecs)
+{
+    // negative values are clock glitches
+    if (usecs < 0)
+        usecs = 0;
+    // count it
+    d_buckets[bucketIndex(usecs)].fetchAndAddRelaxed(1);
+    d_count.fetchAndAddRelaxed(1);
+    d_sum.fetchAndAddRelaxed(usecs);
+    pn_atomicMin(d_min, usecs);
+    pn_atomicMax(d_max, usecs);
+}
+
+void LatencyHistogram::add(const LatencyHistogram &other)
+{
+    // fast return whether there is nothing to add
+    if (other.count() == 0)
+        return;
+    // add all the buckets
+    for (int ix = 0; ix < BucketCount; ++ix) {
+        const quint64 value = other.bucketCount(ix);
+        if (value > 0)
+            d_buckets[ix].fetchAndAddRelaxed(value);
+    }
+    d_count.fetchAndAddRelaxed(other.count());
+    d_sum.fetchAndAddRelaxed(other.sum());
+    pn_atomicMin(d_min, other.d_min.load());
+    pn_atomicMax(d_max, other.d_max.load());
+}
+
+void LatencyHistogram::reset()
+{
+    for (auto &bucket : d_buckets)
+        bucket.store(0);
+    d_count.store(0);
+    d_sum.store(0);
+    d_min.store(pn_noMin);
+    d_max.store(0);
+}
+
+qint64 LatencyHistogram::min() const
+{
+    const qint64 value = d_min.load();
+    return (value == pn_noMin)? 0 : value;
+}
+
+qint64 LatencyHistogram::max() const
+{
+    return d_max.load();
+}
+
+double LatencyHistogram::mean() const
+{
+    const quint64 values = count();
+    return (values == 0)? 0.0 : double(sum()) / double(values);
+}
+
+qint64 LatencyHistogram::percentile(double percent) const
+{
+    // fast return whether empty
+    const quint64 values = count();
+    if (values == 0)
+        return 0;
+    // compute the rank of the requested value (1-based)
+    const double clamped = qBound(0.0, percent, 100.0);
+    quint64 rank = quint64(clamped / 100.0 * double(values) + 0.5);
+    if (rank == 0)
+        rank = 1;
+    // look for the bucket holding it
+    quint64 seen = 0;
+    for (int ix = 0; ix < BucketCount; ++ix) {
+        seen += bucketCount(ix);
+        if (seen >= rank)
+            return qMin(bucketUpperBound(ix), max());
+    }
+    // concurrently recorded values may not be counted in buckets yet
+    return max();
+}
+
+int LatencyHistogram::bucketIndex(qint64 usecs)
+{
+    // small values have their own bucket
+    if (usecs < SubBucketCount)
+        return int(qMax<qint64>(usecs, 0));
+    // huge values fall in the last bucket
+    if (usecs >= (Q_INT64_C(1) << MaxValueBits))
+        return BucketCount - 1;
+    // power of two group, and linear sub-bucket inside it
+    const int msb = 63 - int(qCountLeadingZeroBits(quint64(usecs)));
+    const int shift = msb - SubBucketBits;
+    const int subBucket = int(usecs >> shift) & (SubBucketCount - 1);
+    return (shift + 1) * SubBucketCount + subBucket;
+}
+
+qint64 LatencyHistogram::bucketUpperBound(int index)
+{
+    // small values have their own bucket
+    if (index < SubBucketCount)
+        return index;
+    // power of two group, and linear sub-bucket inside it
+    const int shift = index / SubBucketCount - 1;
+    const qint64 lowerBound = qint64(SubBucketCount + index % SubBucketCount) << shift;
+    return lowerBound + (Q_INT64_C(1) << shift) - 1;
+}
+
+
+
+// SessionTimings
+
+void SessionTimings::clear()
+{
+    for (auto &duration : durations)
+        duration = -1;
+}
+
+void SessionTimings::clearSendPhases()
+{
+    for (int ix = PhaseEnvelope; ix < PhaseCount; ++ix)
+        durations[ix] = -1;
+}
+
+void SessionTimings::addDuration(Phase phase, qint64 nsecs)
+{
+    durations[phase] = hasPhase(phase)? durations[phase] + nsecs : nsecs;
+}
+
+qint64 SessionTimings::connectDuration() const
+{
+    qint64 total = 0;
+    for (int ix = PhaseDns; ix < PhaseEnvelope; ++ix)
+        total += qMax<qint64>(durations[ix], 0);
+    return total;
+}
+
+qint64 SessionTimings::sendDuration() const
+{
+    qint64 total = 0;
+    for (int ix = PhaseEnvelope; ix < PhaseCount; ++ix)
+        total += qMax<qint64>(durations[ix], 0);
+    return total;
+}
+
+const char* SessionTimings::phaseName(Phase phase)
+{
+    switch (phase) {
+    case PhaseDns: return "dns";
+    case PhaseConnect: return "connect";
+    case PhaseTlsHandshake: return "tls_handshake";
+    case PhaseGreeting: return "greeting";
+    case PhaseEhlo: return "ehlo";
+    case PhaseStartTls: return "starttls";
+    case PhaseAuth: return "auth";
+    case PhaseEnvelope: return "envelope";
+    case PhaseDataEncoding: return "data_encoding";
+    case PhaseDataTransfer: return "data_transfer";
+    case PhaseDataAck: return "data_ack";
+    case PhaseCount: break;
+    }
+    return "unknown";
+}
+
+
+
+// SessionLatencies
+
+void SessionLatencies::record(const SessionTimings &timings)
+{
+    for (int ix = 0; ix < SessionTimings::PhaseCount; ++ix) {
+        const auto phase = SessionTimings::Phase(ix);
+        if (timings.hasPhase(phase))
+            record(phase, timings.duration(phase));
+    }
+}
+
+void SessionLatencies::add(const SessionLatencies &other)
+{
+    for (int ix = 0; ix < SessionTimings::PhaseCount; ++ix)
+        d_histograms[ix].add(other.d_histograms[ix]);
+}
+
+void SessionLatencies::reset()
+{
+    for (auto &histogram : d_histograms)
+        histogram.reset();
+}
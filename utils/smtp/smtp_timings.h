@@ -0,0 +1,156 @@
+#ifndef SMTP_TIMINGS_H
+#define SMTP_TIMINGS_H
+
+#include <QAtomicInteger>
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// Lock-Free Latency Histogram
+/// \note Values are recorded in microseconds into log-linear buckets: each power of two is split
+///     into 16 linear sub-buckets, so the relative error stays below 6.25% over the whole range
+/// \note Recording is wait-free on the buckets, thus it can be shared between threads
+class LatencyHistogram
+{
+// public definitions
+public:
+    enum Limits
+    {
+        SubBucketBits = 4,
+        SubBucketCount = 1 << SubBucketBits,
+        MaxValueBits = 36, ///< values from 2^36 usecs (about 19 hours) on fall in the last bucket
+        BucketCount = (MaxValueBits - SubBucketBits + 1) * SubBucketCount
+    };
+
+// construction
+public:
+    /// Builds an empty histogram
+    LatencyHistogram();
+    /// Not copyable, counters are shared by reference
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+// public interface
+public:
+    /// Records a value, in microseconds
+    void record(qint64 usecs);
+    /// Records a value, in nanoseconds
+    inline void recordNsecs(qint64 nsecs) { record(nsecs / 1000); }
+    /// Adds all values recorded by another histogram
+    void add(const LatencyHistogram &other);
+    /// Removes all recorded values
+    /// \warning Values recorded concurrently to a reset may be partially lost
+    void reset();
+
+    /// Gets the amount of recorded values
+    inline quint64 count() const { return d_count.load(); }
+    /// Gets the sum of the recorded values, in microseconds
+    inline qint64 sum() const { return d_sum.load(); }
+    /// Gets the min recorded value (0 when empty)
+    qint64 min() const;
+    /// Gets the max recorded value (0 when empty)
+    qint64 max() const;
+    /// Gets the mean of the recorded values (0 when empty)
+    double mean() const;
+    /// Gets the value at the given percentile (0-100)
+    /// \note The value is the upper bound of the bucket holding it, limited to the max value
+    qint64 percentile(double percent) const;
+
+    /// Gets the amount of values recorded in the given bucket
+    inline quint64 bucketCount(int index) const { return d_buckets[index].load(); }
+    /// Gets the index of the bucket holding the given value
+    static int bucketIndex(qint64 usecs);
+    /// Gets the highest value held by the given bucket
+    static qint64 bucketUpperBound(int index);
+
+// private members
+private:
+    QAtomicInteger<quint64> d_buckets[BucketCount];
+    QAtomicInteger<quint64> d_count;
+    QAtomicInteger<qint64> d_sum;
+    QAtomicInteger<qint64> d_min;
+    QAtomicInteger<qint64> d_max;
+};
+
+
+
+/// Durations of the Phases of an SMTP session
+/// \note Durations are monotonic, in nanoseconds, and -1 for phases which were not done;
+///     phases done more than once by the same session (e.g. EHLO after STARTTLS) are summed
+struct SessionTimings
+{
+    /// Session Phases
+    enum Phase
+    {
+        PhaseDns,          ///< server host name resolution
+        PhaseConnect,      ///< TCP connection
+        PhaseTlsHandshake, ///< TLS handshake, for SSL connections or after STARTTLS
+        PhaseGreeting,     ///< wait for the server greeting
+        PhaseEhlo,         ///< EHLO round trips
+        PhaseStartTls,     ///< STARTTLS round trip
+        PhaseAuth,         ///< authentication round trips
+        PhaseEnvelope,     ///< MAIL FROM, RCPT TO and DATA round trips
+        PhaseDataEncoding, ///< message encoding and streaming, waits on the socket excluded
+        PhaseDataTransfer, ///< waits on the socket to write the message data
+        PhaseDataAck,      ///< wait for the server to accept the message data
+        PhaseCount
+    };
+
+    qint64 durations[PhaseCount];
+
+    /// Builds timings with no phase done
+    inline SessionTimings() { clear(); }
+
+    /// Marks all phases as not done
+    void clear();
+    /// Marks the message sending phases as not done (connection phases are kept)
+    void clearSendPhases();
+
+    /// Checks whether the given phase was done
+    inline bool hasPhase(Phase phase) const { return (durations[phase] >= 0); }
+    /// Gets the duration of the given phase, -1 whether not done
+    inline qint64 duration(Phase phase) const { return durations[phase]; }
+    /// Adds the given duration to the phase
+    void addDuration(Phase phase, qint64 nsecs);
+
+    /// Gets the time spent connecting (up to the authentication), in nanoseconds
+    qint64 connectDuration() const;
+    /// Gets the time spent sending the message (from the envelope on), in nanoseconds
+    qint64 sendDuration() const;
+
+    /// Gets the name of the given phase, in snake_case
+    static const char* phaseName(Phase phase);
+};
+
+
+
+/// Session Latencies aggregated by Phase
+/// \note Recording is lock-free, thus the same instance can be shared by multiple clients
+class SessionLatencies
+{
+// public interface
+public:
+    /// Records the duration (in nanoseconds) of a phase
+    inline void record(SessionTimings::Phase phase, qint64 nsecs)
+        { d_histograms[phase].recordNsecs(nsecs); }
+    /// Records all the phases done by the given timings
+    void record(const SessionTimings &timings);
+    /// Adds all values recorded by another instance
+    void add(const SessionLatencies &other);
+    /// Removes all recorded values
+    void reset();
+
+    /// Gets the histogram of the given phase
+    inline const LatencyHistogram& histogram(SessionTimings::Phase phase) const
+        { return d_histograms[phase]; }
+
+// private members
+private:
+    LatencyHistogram d_histograms[SessionTimings::PhaseCount];
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_TIMINGS_H
@@ -0,0 +1,386 @@
+#include "smtp_transport.h"
+
+#include <QAtomicInteger>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHostInfo>
+#include <QStringBuilder>
+#include "utils/smtp/smtp_datadevice.h"
+#include "utils/rtloghandler.h"
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// namespace usage
+using namespace Smtp;
+
+// PRIVATE UTILITY NAMESPACE
+namespace {
+
+// Log the error and fail (return false)
+bool pn_fail(const QString &err, const CallContext &ctx)
+{
+    // log the error as a warning
+    RTLogHandler(ctx, RTLogHandler::Warning, err);
+    // fail
+    return false;
+}
+
+// Marks all the given statuses with the given reply
+void pn_setStatuses(RecipientStatuses &statuses, int code, const QByteArray &text)
+{
+    for (auto &status : statuses) {
+        status.code = code;
+        status.text = text;
+    }
+}
+
+// Gets a unique file name, as for the maildir specification: "<secs>.M<usecs>P<pid>Q<n>.<host>"
+QString pn_uniqueName()
+{
+    static QAtomicInteger<quint64> counter;
+    static const QString host = QHostInfo::localHostName().replace('/', "\\057").replace(':', "\\072");
+    const qint64 msecs = QDateTime::currentMSecsSinceEpoch();
+    return QString::number(msecs / 1000) % ".M" % QString::number((msecs % 1000) * 1000)
+        % 'P' % QString::number(QCoreApplication::applicationPid())
+        % 'Q' % QString::number(counter.fetchAndAddRelaxed(1)) % '.' % host;
+}
+
+// Flushes the file and syncs it to disk
+bool pn_syncFile(QFile &file)
+{
+    if (!file.flush())
+        return false;
+#ifdef Q_OS_UNIX
+    return (::fsync(file.handle()) == 0);
+#else
+    return true;
+#endif
+}
+// Syncs the given directory to disk, making the files renamed into it durable
+bool pn_syncDirectory(const QString &path)
+{
+#ifdef Q_OS_UNIX
+    const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    const bool synced = (::fsync(fd) == 0);
+    ::close(fd);
+    return synced;
+#else
+    Q_UNUSED(path)
+    return true;
+#endif
+}
+
+// Null Device, counting and dropping the written data
+class pn_NullDevice : public QIODevice
+{
+public:
+    inline qint64 writtenBytes() const { return d_writtenBytes; }
+    bool isSequential() const override { return true; }
+
+protected:
+    qint64 readData(char*, qint64) override { return -1; }
+    qint64 writeData(const char*, qint64 size) override { d_writtenBytes += size; return size; }
+
+private:
+    qint64 d_writtenBytes = 0;
+};
+
+} // PRIVATE UTILITY NAMESPACE
+
+
+
+// Transport Utils
+
+RecipientStatuses Smtp::envelopeRecipients(const MimeMessage &msg)
+{
+    return Envelope::fromMessage(msg).pendingStatuses();
+}
+
+
+
+// Envelope
+
+Envelope Envelope::fromMessage(const MimeMessage &msg, TransportFeatures features)
+{
+    Envelope envelope;
+    envelope.sender = msg.senderAddress().email();
+    envelope.recipients.reserve(msg.toRecipients().size() + msg.ccRecipients().size());
+    for (const auto &to : msg.toRecipients())
+        envelope.recipients.append(to.email());
+    for (const auto &cc : msg.ccRecipients())
+        envelope.recipients.append(cc.email());
+    // SMTPUTF8 is only required by messages with utf8 headers
+    envelope.features = features;
+    if (!msg.hasUtf8Headers())
+        envelope.features.setFlag(TransportSmtpUtf8, false);
+    return envelope;
+}
+
+RecipientStatuses Envelope::pendingStatuses() const
+{
+    RecipientStatuses statuses;
+    statuses.reserve(recipients.size());
+    for (const auto &recipient : recipients)
+        statuses.append(RecipientStatus(recipient));
+    return statuses;
+}
+
+
+
+// MaildirTransport
+
+struct Smtp::MaildirTransport::PrivateData
+{
+    QString directory;
+    Layout layout = MaildirLayout;
+    TransportFeatures features = Transport8BitMime | TransportSmtpUtf8;
+    bool syncEnabled = true;
+    bool open = false;
+    QString lastMessagePath;
+    RecipientStatuses recipientStatuses;
+};
+
+MaildirTransport::MaildirTransport(const QString &directory, Layout layout)
+    : d(new PrivateData())
+{
+    d->directory = directory;
+    d->layout = layout;
+}
+
+MaildirTransport::~MaildirTransport()
+{
+    // free resources
+    delete d;
+}
+
+void MaildirTransport::setDirectory(const QString &directory)
+{
+    // ensure it is closed
+    if (d->open)
+        return;
+    // update setting
+    d->directory = directory;
+}
+
+const QString& MaildirTransport::directory() const
+{
+    return d->directory;
+}
+
+void MaildirTransport::setLayout(Layout layout)
+{
+    // ensure it is closed
+    if (d->open)
+        return;
+    // update setting
+    d->layout = layout;
+}
+
+MaildirTransport::Layout MaildirTransport::layout() const
+{
+    return d->layout;
+}
+
+void MaildirTransport::setTransportFeatures(TransportFeatures features)
+{
+    d->features = features;
+}
+
+void MaildirTransport::setSyncEnabled(bool on)
+{
+    d->syncEnabled = on;
+}
+
+const QString& MaildirTransport::lastMessagePath() const
+{
+    return d->lastMessagePath;
+}
+
+bool MaildirTransport::open()
+{
+    // ensure the directory was set
+    if (d->directory.isEmpty())
+        return pn_fail("unable to open, missing directory", CALL_CONTEXT);
+    // ensure the directories exist
+    QDir dir (d->directory);
+    const bool created = (d->layout == MaildirLayout)?
+        (dir.mkpath("tmp") && dir.mkpath("new") && dir.mkpath("cur")) : dir.mkpath(".");
+    if (!created)
+        return pn_fail(QStringLiteral("unable to open, cannot create directory %1").arg(d->directory), CALL_CONTEXT);
+    // success
+    d->open = true;
+    return true;
+}
+
+void MaildirTransport::close()
+{
+    d->open = false;
+}
+
+bool MaildirTransport::isOpen() const
+{
+    return d->open;
+}
+
+bool MaildirTransport::sendMessage(const MimeMessage &msg) const
+{
+    // ensure the message is valid
+    if (!msg.isValid())
+        return pn_fail("unable to send, message is not valid", CALL_CONTEXT);
+    // ensure it is open
+    if (!d->open)
+        return pn_fail("unable to send, transport is not open", CALL_CONTEXT);
+    d->recipientStatuses = envelopeRecipients(msg);
+
+    // compute the paths: written as temporary, then moved into place
+    const QString name = pn_uniqueName();
+    const QDir dir (d->directory);
+    const QString tmpPath = (d->layout == MaildirLayout)?
+        dir.filePath("tmp/" % name) : dir.filePath('.' % name % ".tmp");
+    const QString finalPath = (d->layout == MaildirLayout)?
+        dir.filePath("new/" % name) : dir.filePath(name % ".eml");
+
+    // write the message
+    QFile file (tmpPath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        pn_setStatuses(d->recipientStatuses, 451, QByteArrayLiteral("4.3.0 Unable to create the message file"));
+        return pn_fail(QStringLiteral("unable to create file %1, error: %2")
+            .arg(tmpPath, file.errorString()), CALL_CONTEXT);
+    }
+    bool written = true;
+    // the envelope, for pickup services
+    if (d->layout == PickupLayout) {
+        QByteArray envelope = "X-Sender: " % msg.senderAddress().email().toUtf8() % "\r\n";
+        for (const auto &status : d->recipientStatuses)
+            envelope += "X-Receiver: " % status.address.toUtf8() % "\r\n";
+        written = (file.write(envelope) == envelope.size());
+    }
+    written = written && msg.writeToDev(file, d->features) && (!d->syncEnabled || pn_syncFile(file));
+    const QString error = file.errorString();
+    file.close();
+    if (!written) {
+        file.remove();
+        pn_setStatuses(d->recipientStatuses, 451, QByteArrayLiteral("4.3.0 Unable to write the message file"));
+        return pn_fail(QStringLiteral("unable to write file %1, error: %2").arg(tmpPath, error), CALL_CONTEXT);
+    }
+    // move it into place
+    if (!QFile::rename(tmpPath, finalPath)) {
+        QFile::remove(tmpPath);
+        pn_setStatuses(d->recipientStatuses, 451, QByteArrayLiteral("4.3.0 Unable to deliver the message file"));
+        return pn_fail(QStringLiteral("unable to move file %1 into %2").arg(tmpPath, finalPath), CALL_CONTEXT);
+    }
+    // the rename is durable once its directory is synced, the message being delivered anyway
+    if (d->syncEnabled && !pn_syncDirectory(QFileInfo(finalPath).path()))
+        RT_WARNING("unable to sync the directory of %1") % finalPath;
+
+    // success
+    d->lastMessagePath = finalPath;
+    pn_setStatuses(d->recipientStatuses, 250, QByteArrayLiteral("2.0.0 Delivered"));
+    return true;
+}
+
+const RecipientStatuses& MaildirTransport::recipientStatuses() const
+{
+    return d->recipientStatuses;
+}
+
+
+
+// NullTransport
+
+struct Smtp::NullTransport::PrivateData
+{
+    TransportFeatures features = Transport8BitMime | TransportSmtpUtf8;
+    bool dataStuffing = true;
+    bool open = false;
+    qint64 messageCount = 0;
+    qint64 byteCount = 0;
+    RecipientStatuses recipientStatuses;
+};
+
+NullTransport::NullTransport()
+    : d(new PrivateData()) {}
+
+NullTransport::~NullTransport()
+{
+    // free resources
+    delete d;
+}
+
+void NullTransport::setTransportFeatures(TransportFeatures features)
+{
+    d->features = features;
+}
+
+void NullTransport::setDataStuffing(bool on)
+{
+    d->dataStuffing = on;
+}
+
+qint64 NullTransport::messageCount() const
+{
+    return d->messageCount;
+}
+
+qint64 NullTransport::byteCount() const
+{
+    return d->byteCount;
+}
+
+bool NullTransport::open()
+{
+    d->open = true;
+    return true;
+}
+
+void NullTransport::close()
+{
+    d->open = false;
+}
+
+bool NullTransport::isOpen() const
+{
+    return d->open;
+}
+
+bool NullTransport::sendMessage(const MimeMessage &msg) const
+{
+    // ensure the message is valid
+    if (!msg.isValid())
+        return pn_fail("unable to send, message is not valid", CALL_CONTEXT);
+    // ensure it is open
+    if (!d->open)
+        return pn_fail("unable to send, transport is not open", CALL_CONTEXT);
+    d->recipientStatuses = envelopeRecipients(msg);
+
+    // encode the message into the void, through the DATA stream whether required
+    pn_NullDevice sink;
+    sink.open(QIODevice::WriteOnly);
+    if (d->dataStuffing) {
+        DataDevice writer (&sink);
+        writer.open(QIODevice::WriteOnly);
+        if (!msg.writeToDev(writer, d->features) || !writer.finish())
+            return false;
+    } else if (!msg.writeToDev(sink, d->features)) {
+        return false;
+    }
+
+    // success
+    ++d->messageCount;
+    d->byteCount += sink.writtenBytes();
+    pn_setStatuses(d->recipientStatuses, 250, QByteArrayLiteral("2.0.0 Discarded"));
+    return true;
+}
+
+const RecipientStatuses& NullTransport::recipientStatuses() const
+{
+    return d->recipientStatuses;
+}
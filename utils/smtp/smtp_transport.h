@@ -0,0 +1,186 @@
+#ifndef SMTP_TRANSPORT_H
+#define SMTP_TRANSPORT_H
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include "utils/smtp/smtp_mime.h"
+#include "utils/smtp/smtp_reply.h"
+#include "utils/macros.h"
+
+// > Smtp NS
+namespace Smtp {
+
+
+/// Delivery Status of a Recipient
+struct RecipientStatus
+{
+    QString address; ///< envelope address
+    int code = 0; ///< reply code, zero whether not replied yet
+    EnhancedStatusCode enhancedCode; ///< reply enhanced code, whether any
+    QByteArray text; ///< reply text
+
+    /// Builds a pending status for the given address
+    RecipientStatus() = default;
+    explicit RecipientStatus(QString address)
+        : address(std::move(address)) {}
+
+    /// Checks whether the message was accepted for the recipient
+    inline bool isAccepted() const { return (code >= 200 && code < 300); }
+    /// Gets the reply severity, transient whether not replied yet
+    inline ReplySeverity severity() const { return classifyReply(code, enhancedCode); }
+};
+/// Delivery Statuses of the recipients of a message, in envelope order
+using RecipientStatuses = QList<RecipientStatus>;
+/// Gets the pending statuses of the envelope recipients of the message ("To" and "Cc")
+RecipientStatuses envelopeRecipients(const MimeMessage &msg);
+
+
+
+/// Message Envelope, for messages handed over already encoded
+struct Envelope
+{
+    QString sender; ///< reverse path
+    QStringList recipients; ///< forward paths
+    TransportFeatures features = NoTransportFeatures; ///< features the encoded data requires
+
+    /// Gets the envelope of the given message, encoded with the given features
+    static Envelope fromMessage(const MimeMessage &msg, TransportFeatures features = NoTransportFeatures);
+    /// Gets the pending statuses of the recipients
+    RecipientStatuses pendingStatuses() const;
+};
+
+
+
+/// Mail Transport Interface, handing messages over to a mail system
+/// \note Backends: Smtp::Client (SMTP or LMTP, over TCP, TLS or a local socket),
+///     Smtp::MaildirTransport (maildir or pickup directory) and Smtp::NullTransport
+class Transport
+{
+// construction
+public:
+    /// Dtor
+    virtual ~Transport() = default;
+
+// public interface
+public:
+    /// Opens the transport, e.g. connecting and authenticating to the server
+    /// \return True on success, False otherwise
+    virtual bool open() = 0;
+    /// Closes the transport (whether open)
+    virtual void close() = 0;
+    /// Checks whether the transport is open
+    virtual bool isOpen() const = 0;
+
+    /// Tries handing the message over, the transport being open
+    /// \return True whether accepted for all the recipients, False otherwise
+    virtual bool sendMessage(const MimeMessage &msg) const = 0;
+    /// Gets the status of each recipient of the last sent message
+    virtual const RecipientStatuses& recipientStatuses() const = 0;
+};
+
+
+
+/// Maildir or Pickup Directory Transport, writing each message into its own file
+/// \note Maildir: the message is written into "tmp/" and moved into "new/" once complete
+/// \note Pickup: the message is written as a hidden temporary file and renamed as ".eml" once
+///     complete, preceded by "X-Sender" / "X-Receiver" envelope headers
+/// \note Messages are written with the 8BITMIME and SMTPUTF8 features (whether allowed),
+///     with CRLF line breaks and no dot-stuffing
+class MaildirTransport : public Transport
+{
+// public definitions
+public:
+    /// Directory Layouts
+    enum Layout
+    {
+        MaildirLayout,
+        PickupLayout
+    };
+
+// construction
+public:
+    /// Builds a transport writing into the given directory
+    explicit MaildirTransport(const QString &directory = QString(), Layout layout = MaildirLayout);
+    /// Dtor
+    ~MaildirTransport() override;
+    /// Not copyable
+    Q_DISABLE_COPY(MaildirTransport)
+
+// public interface
+public:
+    /// Sets the target directory
+    void setDirectory(const QString &directory);
+    /// Gets the target directory
+    const QString& directory() const;
+    /// Sets the directory layout
+    void setLayout(Layout layout);
+    /// Gets the directory layout
+    Layout layout() const;
+    /// Sets the transport features allowed while writing the messages
+    /// \default As default 8BITMIME and SMTPUTF8
+    void setTransportFeatures(TransportFeatures features);
+    /// Enables syncing each file to disk before moving it into place, and its directory after
+    /// \default As default enabled
+    void setSyncEnabled(bool on);
+
+    /// Gets the path of the last written message
+    const QString& lastMessagePath() const;
+
+    /// Transport interface, opening creates the directories whether missing
+    bool open() override;
+    void close() override;
+    bool isOpen() const override;
+    bool sendMessage(const MimeMessage &msg) const override;
+    const RecipientStatuses& recipientStatuses() const override;
+
+// private members
+private:
+    PRIVATE_DATA_PTR(d)
+};
+
+
+
+/// Null Transport, encoding the messages and dropping them
+/// \note Useful to benchmark the encoding path on its own
+class NullTransport : public Transport
+{
+// construction
+public:
+    /// Ctor
+    NullTransport();
+    /// Dtor
+    ~NullTransport() override;
+    /// Not copyable
+    Q_DISABLE_COPY(NullTransport)
+
+// public interface
+public:
+    /// Sets the transport features allowed while encoding the messages
+    /// \default As default 8BITMIME and SMTPUTF8
+    void setTransportFeatures(TransportFeatures features);
+    /// Enables the dot-stuffing of the DATA stream, as sent over SMTP
+    /// \default As default enabled
+    void setDataStuffing(bool on);
+
+    /// Gets the amount of messages sent so far
+    qint64 messageCount() const;
+    /// Gets the amount of bytes encoded so far
+    qint64 byteCount() const;
+
+    /// Transport interface
+    bool open() override;
+    void close() override;
+    bool isOpen() const override;
+    bool sendMessage(const MimeMessage &msg) const override;
+    const RecipientStatuses& recipientStatuses() const override;
+
+// private members
+private:
+    PRIVATE_DATA_PTR(d)
+};
+
+
+} // < Smtp NS
+
+#endif // SMTP_TRANSPORT_H